@@ -17,6 +17,9 @@
 
 /*** Protocol ***/
 #define SQ_SERVER_MSG_ID 222220
+/* the server also takes SOCK_SEQPACKET connections here, one message
+   per packet (SQUIDLIGHTS_TRANSPORT=socket) */
+#define SQ_SERVER_SOCKET_PATH "/tmp/squidlights.sock"
 
 #define SQ_LIGHT_SET_NAME 1 /* this message must be sent only once */
 #define SQ_LIGHT_ON 2
@@ -26,7 +29,16 @@
 #define SQ_LIGHT_HSI 6
 #define SQ_DIE 7 /* sent by the server to kill everything */
 #define SQ_CLIENT_SET_NAME 8 /* again, only once */
-
+#define SQ_ATTACH_RING 9 /* offers the server a shared memory ring
+			    (see shmring.h) */
+#define SQ_LIGHT_BATCH 10 /* several of the above light messages at once */
+#define SQ_LIGHT_FADE 11 /* brightness over time, for lights that can fade themselves */
+#define SQ_EFFECT 12 /* starts or stops an effect the server runs itself */
+#define SQ_LIGHT_TIMED_BATCH 13 /* a batch to apply at a given time */
+#define SQ_LIGHT_TRACED_BATCH 14 /* a batch with latency stamps (see sqtrace.h) */
+
+/* initial sizes of the server's tables.  they grow past these as
+   needed (light ids stay below 65536, since batches carry 16 bits). */
 #define NUM_LIGHT_SERVERS 256
 #define NUM_CLIENTS 256
 
@@ -45,6 +57,7 @@ struct light_init_msg {
   int lightid;
   int msqid; /* when sending to clients, this is the "islight" field */
   char name[100]; /* name is actually 32 bytes.  padding for safety! */
+  int pid; /* the light process's, so the server can tell when it's gone */
 };
 
 struct light_brightness_msg {
@@ -72,6 +85,106 @@ struct light_hsi_msg {
   float i;
 };
 
+struct light_fade_msg {
+  long mtype;
+  int lightid;
+  int clientid;
+  float brightness; /* where to end up */
+  float seconds; /* how long to take getting there */
+};
+
+/* one light change inside a batch.  type is SQ_LIGHT_ON through
+   SQ_LIGHT_HSI or SQ_LIGHT_FADE, and v holds the brightness, rgb,
+   hsi, or (brightness, seconds) values. */
+struct light_batch_entry {
+  unsigned short lightid;
+  unsigned char type;
+  unsigned char pad;
+  float v[3];
+};
+
+/* as many entries as fit in a generic_msgbuf */
+#define SQ_BATCH_MAX 16
+
+struct light_batch_msg {
+  long mtype;
+  int count; /* in place of lightid */
+  int clientid;
+  struct light_batch_entry entries[SQ_BATCH_MAX];
+};
+
+/* Effects.  Instead of a client sending every step of a strobe or a
+   chase, it sends one SQ_EFFECT and the server works out the lights'
+   states itself, on its frame clock, sending only changes.  For each
+   light k of the effect, the place in the cycle is
+
+     x = (seconds since start)*rate + phase - k*spread  (mod 1)
+
+   and chase, strobe and pulse give the light intensity i times
+   (respectively) whether it's the light whose turn it is (i.e.,
+   strobe with spread and duty 1/nlights), whether x < duty, or
+   (1-cos(2 pi x))/2.  The color is (h, s, that); with s = 0 they send
+   plain brightness, which any light takes.  rainbow sends hue h+360x
+   at (s, i).
+
+   Effects are numbered by the client, from 0 to SQ_MAX_EFFECTS-1,
+   and run until stopped (SQ_EFFECT_STOP) or replaced by another with
+   the same number, even after the client that started them quits. */
+#define SQ_MAX_EFFECTS 256
+#define SQ_EFFECT_MAX_LIGHTS 64
+
+#define SQ_EFFECT_STOP 0
+#define SQ_EFFECT_CHASE 1
+#define SQ_EFFECT_STROBE 2
+#define SQ_EFFECT_PULSE 3
+#define SQ_EFFECT_RAINBOW 4
+
+struct effect_msg {
+  long mtype;
+  int effectid; /* in place of lightid */
+  int clientid;
+  int kind; /* SQ_EFFECT_* */
+  float rate; /* cycles per second */
+  float phase; /* cycles */
+  float spread; /* cycles from one light to the next */
+  float duty; /* for strobe */
+  float h, s, i;
+  int nlights;
+  unsigned short lights[SQ_EFFECT_MAX_LIGHTS];
+};
+
+/* a batch that should happen at a given time (usec on the monotonic
+   clock, as from squidlights_client_now).  it's one entry shorter
+   than a plain batch to make room for the time. */
+#define SQ_TIMED_BATCH_MAX (SQ_BATCH_MAX - 1)
+
+struct light_timed_batch_msg {
+  long mtype;
+  int count;
+  int clientid;
+  long long at;
+  struct light_batch_entry entries[SQ_TIMED_BATCH_MAX];
+};
+
+/* a batch that carries when it was sent, taken by the server, and
+   passed on (nsec on the monotonic clock).  a stamp is 0 if that
+   hasn't happened yet. */
+#define SQ_TRACED_BATCH_MAX (SQ_BATCH_MAX - 2)
+
+struct sq_trace {
+  long long sent;
+  long long received;
+  long long forwarded;
+};
+
+struct light_traced_batch_msg {
+  long mtype;
+  int count;
+  int clientid;
+  struct sq_trace trace;
+  struct light_batch_entry entries[SQ_TRACED_BATCH_MAX];
+};
+
 struct client_init_msg {
   long mtype;
   int clientid;
@@ -79,6 +192,13 @@ struct client_init_msg {
   char name[100];
 };
 
+struct ring_attach_msg {
+  long mtype;
+  int islight; /* 1 if the ring is server->light, 0 if client->server */
+  int msqid; /* the queue of the process offering the ring */
+  char shmname[100];
+};
+
 /*** client functions ***/
 
 /* initializes the light system for this process */
@@ -95,6 +215,10 @@ int squidlights_client_initialize(void);
    * if the name is taken, SQ_NAME_TAKEN is returned. */
 int squidlights_client_connect(char* name);
 
+/* One more than the largest light id known so far (for iterating
+   with squidlights_client_lightname). */
+int squidlights_client_num_lights(void);
+
 /* Get the name of a light by id.  Empty if no such light. */
 char* squidlights_client_lightname(int lightid);
 
@@ -102,6 +226,11 @@ char* squidlights_client_lightname(int lightid);
    such light. */
 int squidlights_client_getlight(char* name);
 
+/* A number which changes whenever a light is added or removed.  A
+   result from squidlights_client_getlight stays good for as long as
+   this doesn't change. */
+unsigned int squidlights_client_generation(void);
+
 /* Handles outstanding messages on the queue. Returns -1 if no longer
    connected. */
 int squidlights_client_process_messages(void);
@@ -120,6 +249,34 @@ int squidlights_client_light_off(int clientid, int light);
 int squidlights_client_light_set(int clientid, int light, float brightness);
 int squidlights_client_light_rgb(int clientid, int light, float r, float g, float b);
 int squidlights_client_light_hsi(int clientid, int light, float h, float s, float i);
+/* Fades a light to brightness over some seconds.  Lights that can fade
+   by themselves get just this one message instead of a stream of
+   brightnesses; others jump straight to the end. */
+int squidlights_client_light_fade(int clientid, int light, float brightness, float seconds);
+
+/* Timing.  After squidlights_client_at(when), light changes (and
+   frames) are to happen at when, which is in usec on the clock
+   squidlights_client_now reads; the server holds them until then.
+   squidlights_client_at(0) goes back to "as soon as possible".  A
+   change that reaches the server after its time is applied right away
+   or dropped, depending on the server's -l option. */
+long long squidlights_client_now(void);
+int squidlights_client_at(long long when);
+
+/* Starts effect->effectid (see SQ_EFFECT) with what the rest of
+   *effect says; mtype and clientid are filled in.  stop stops it, the
+   lights staying where it left them. */
+int squidlights_client_effect(int clientid, struct effect_msg * effect);
+int squidlights_client_effect_stop(int clientid, int effectid);
+
+/* Frames.  Between frame_begin and frame_commit the functions above
+   don't send anything; the changes are staged and then shipped in as
+   few SQ_LIGHT_BATCH messages as possible (SQ_BATCH_MAX changes per
+   message).  A later change to the same light and kind within a frame
+   replaces the earlier one, and takes its place at the end (on and off
+   count as one kind, as do brightness and fade). */
+int squidlights_client_frame_begin(int clientid);
+int squidlights_client_frame_commit(int clientid);
 
 /*** light server functions ***/
 
@@ -158,6 +315,16 @@ int squidlights_light_add_off(int lightid, void(*off_handler)(int lightid, int c
 int squidlights_light_add_brightness(int lightid, void(*brightness_handler)(int lightid, int clientid, float brightness));
 int squidlights_light_add_rgb(int lightid, void(*rgb_handler)(int lightid, int clientid, float r, float g, float b));
 int squidlights_light_add_hsi(int lightid, void(*hsi_handler)(int lightid, int clientid, float h, float s, float i));
+/* without a fade handler, a fade calls the brightness handler with
+   the end brightness */
+int squidlights_light_add_fade(int lightid, void(*fade_handler)(int lightid, int clientid, float brightness, float seconds));
+
+/* hsi to rgb, for handlers that want to do it themselves.  h is in
+   degrees.  chroma gives the proportions of red, green, and blue
+   (summing to 1) in rgb[0..2]; hsi_to_rgb scales that by intensity and
+   clips to [0,1], as lights without an hsi handler get it. */
+void squidlights_hsi_chroma(float h, float s, float * rgb);
+void squidlights_hsi_to_rgb(float h, float s, float i, float * r, float * g, float * b);
 
 /* once set up, just runs the lights */
 void squidlights_light_run(void);
@@ -165,6 +332,9 @@ void squidlights_light_run(void);
 int squidlights_lights_handle(char wait);
 /* initialize this thing. */
 int squidlights_lights_handle_init(void);
+/* a file descriptor that polls readable when squidlights_lights_handle
+   has something to do, for programs with their own event loop */
+int squidlights_lights_fd(void);
 /* and to cleanup when quitting if doing it by iteration */
 void squidlights_lights_cleanup(void);
 
@@ -0,0 +1,113 @@
+#ifndef _squidlights_shmring_h
+#define _squidlights_shmring_h
+
+/* A single-producer single-consumer ring of protocol messages living
+   in POSIX shared memory.  This is the optional fast path for
+   client->server and server->light traffic: a send is a memcpy into
+   the next slot, and the only syscall is a futex wake when the
+   consumer has gone to sleep.
+
+   The consumer sleeps on a "doorbell", which is just a futex word.
+   The server has one doorbell (in the hub segment) shared by every
+   client ring, and each light process has one in its own ring.  A
+   producer waiting for room sleeps on the ring's other doorbell,
+   which the consumer rings as it takes messages. */
+
+#include "protocol.h"
+#include <stddef.h>
+
+#define SQ_RING_SLOTS 1024 /* must be a power of two */
+#define SQ_RING_MAGIC 0x5351524e
+#define SQ_RING_CHECK_MSEC 100 /* how often a waiting producer sees if the consumer died */
+
+/* the server's hub segment.  clients map it to find the doorbell. */
+#define SQ_SHM_HUB_NAME "/squidlights-hub"
+
+/* which transport the client/light libraries use.  chosen with the
+   SQUIDLIGHTS_TRANSPORT environment variable ("msg", "shm" or
+   "socket"). */
+#define SQ_TRANSPORT_ENV "SQUIDLIGHTS_TRANSPORT"
+#define SQ_TRANSPORT_MSG 0
+#define SQ_TRANSPORT_SHM 1
+#define SQ_TRANSPORT_SOCKET 2
+
+struct sq_doorbell {
+  unsigned int seq; /* the futex word.  bumped on every ring */
+  unsigned int waiting; /* consumer is asleep (or about to be) */
+};
+
+struct sq_hub {
+  unsigned int magic;
+  int server_pid;
+  char pad0[56];
+  struct sq_doorbell bell;
+};
+
+struct sq_ring {
+  unsigned int magic;
+  unsigned int slots;
+  int owner; /* pid of the process that made it */
+  char pad0[52];
+  unsigned long long head; /* written only by the producer */
+  char pad1[56];
+  unsigned long long tail; /* written only by the consumer */
+  char pad2[56];
+  struct sq_doorbell bell; /* for rings whose consumer sleeps alone */
+  char pad3[56];
+  struct sq_doorbell space; /* for a producer waiting on a full ring */
+  char pad4[56];
+  struct generic_msgbuf msgs[SQ_RING_SLOTS];
+};
+
+/* reads SQUIDLIGHTS_TRANSPORT */
+int sq_transport_from_env(void);
+
+/* shared memory rings.  a NULL name makes a process-private ring on
+   the heap (used by the server for its own threads). */
+struct sq_ring * sq_ring_create(const char * shmname);
+struct sq_ring * sq_ring_attach(const char * shmname);
+void sq_ring_detach(struct sq_ring * ring);
+void sq_ring_unlink(const char * shmname);
+/* whether the process that made the ring is still around.  The
+   server asks this of its clients' rings now and then, since a client
+   that dies doesn't say so. */
+int sq_ring_owner_alive(struct sq_ring * ring);
+
+/* copies a message (size as given to msgsnd) into the ring and rings
+   the bell.  Returns -1 if the ring is full. */
+int sq_ring_push(struct sq_ring * ring, const void * msg, int size, struct sq_doorbell * bell);
+/* like sq_ring_push, but waits for room instead of failing.  Gives
+   up (returning -1) if the peer's message queue msqid disappears,
+   which is how we notice the consumer has died. */
+int sq_ring_push_wait(struct sq_ring * ring, const void * msg, int size, struct sq_doorbell * bell, int msqid);
+/* waits until fewer than count messages are waiting.  Returns 0 then,
+   or -1 if timeout_ms passes first. */
+int sq_ring_wait_below(struct sq_ring * ring, int count, int timeout_ms);
+/* the oldest message in the ring, or NULL if empty.  It stays valid
+   until sq_ring_advance. */
+struct generic_msgbuf * sq_ring_peek(struct sq_ring * ring);
+void sq_ring_advance(struct sq_ring * ring);
+/* number of messages waiting */
+int sq_ring_count(struct sq_ring * ring);
+
+/* doorbells.  A consumer takes a ticket before draining its rings,
+   then waits with it; the wait returns at once if anything rang in
+   between.  timeout_ms < 0 waits forever. */
+unsigned int sq_doorbell_ticket(struct sq_doorbell * bell);
+void sq_doorbell_wait(struct sq_doorbell * bell, unsigned int ticket, int timeout_ms);
+void sq_doorbell_ring(struct sq_doorbell * bell);
+
+/* the server's unix socket (SQ_SERVER_SOCKET_PATH).  connect returns
+   the fd or -1.  recv reads one message into buf; it returns 1 for a
+   message, 0 if there's nothing yet (or a signal came), and -1 if
+   the server hung up. */
+int sq_socket_connect(void);
+int sq_socket_recv(int fd, void * buf, int size, int wait);
+
+/* the hub segment (created by the server) */
+struct sq_hub * sq_hub_create(void);
+struct sq_hub * sq_hub_attach(void);
+void sq_hub_detach(struct sq_hub * hub);
+void sq_hub_destroy(struct sq_hub * hub);
+
+#endif
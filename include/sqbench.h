@@ -0,0 +1,39 @@
+#ifndef _squidlights_sqbench_h
+#define _squidlights_sqbench_h
+
+/* What benchmarks (sqload, sqreplay) read back after a run.  A
+   snapshot adds up the stats pages (sqstats.h) and trace pages
+   (sqtrace.h) for some of the lights, picked by name; taking one
+   before and one after, and subtracting, gives what the run did.
+   None of it goes near the data path. */
+
+#include "sqtrace.h"
+
+struct sq_bench_snapshot {
+  int server_lights; /* picked lights the server has */
+  unsigned long long server_in, server_out, coalesced; /* the server's, for the picked lights */
+  unsigned long long dropped; /* batches lost under -q drop, for all lights */
+  unsigned long long handled; /* by the light processes, for the picked lights */
+  unsigned long long loops, loop_ns; /* the server's forward loop */
+  /* the stages of every traced batch that went to a process with a
+     picked light, and the whole trip for the picked lights */
+  struct sq_trace_hist stages[SQ_TRACE_STAGES];
+  struct sq_trace_hist latency;
+};
+
+/* fills in *snap for the lights pick(name, arg) says yes to.  Returns
+   -1 if the server's page isn't there. */
+int sq_bench_snapshot(struct sq_bench_snapshot * snap, int (*pick)(const char * name, void * arg), void * arg);
+
+/* waits (up to SQ_BENCH_SETTLE_MAX_SEC) for everything the server has
+   passed on to have been handled, and takes *after then */
+#define SQ_BENCH_SETTLE_MSEC 200
+#define SQ_BENCH_SETTLE_MAX_SEC 10
+void sq_bench_settle(struct sq_bench_snapshot * before, struct sq_bench_snapshot * after,
+		     int (*pick)(const char * name, void * arg), void * arg);
+
+/* takes before's counts out of after's.  The maxes can't be
+   subtracted, so they become the top of the highest bucket left. */
+void sq_bench_since(struct sq_bench_snapshot * after, struct sq_bench_snapshot * before);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _squidlights_sqcolor_h
+#define _squidlights_sqcolor_h
+
+/* Color math over whole arrays, for drivers with lots of fixtures.
+   The arrays are structure-of-arrays (all the reds, then all the
+   greens, ...), which is what lets these use SSE2 or AVX2.  Which one
+   is picked when first called, from what the cpu has; setting
+   SQUIDLIGHTS_SIMD to "scalar", "sse2" or "avx2" forces a lower one
+   (for checking them against each other). */
+
+#define SQ_SIMD_ENV "SQUIDLIGHTS_SIMD"
+
+/* clips v[0..n) to [0,1].  NaN becomes 0. */
+void sq_color_clamp(float * v, int n);
+
+/* hsi (h in degrees) to rgb; squidlights_hsi_to_rgb is this one at a
+   time.  with i NULL, gives the chroma instead (r+g+b=1, like
+   squidlights_hsi_chroma).  a NaN or infinite h is taken as 0.  the
+   outputs may not alias the inputs. */
+void sq_color_hsi_to_rgb(const float * h, const float * s, const float * i,
+			 float * r, float * g, float * b, int n);
+
+/* divides r, g, b by their sum, in place, and puts the sum in sum.
+   where the sum is 0 they're left as 0. */
+void sq_color_normalize(float * r, float * g, float * b, float * sum, int n);
+
+/* "scalar", "sse2" or "avx2" */
+const char * sq_color_impl(void);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _squidlights_sqcurve_h
+#define _squidlights_sqcurve_h
+
+/* Output curves for light drivers.  A curve maps a brightness in
+   [0,1] to what actually gets sent, and is worked out once, when the
+   driver loads its config, into a table of SQ_CURVE_STEPS+1 entries.
+   Applying it is then just a lookup.
+
+   Curves are named in driver configs as
+
+     linear          straight through (the default)
+     gamma:2.2       x^2.2
+     scurve:6        a logistic S, steeper for bigger numbers
+     table:0,.1,.4,1 straight lines through evenly spaced points */
+
+#define SQ_CURVE_STEPS 1024
+
+/* which table entry brightness x (already in [0,1]) uses */
+static inline int sq_curve_index(float x) {
+  return (int)(x * SQ_CURVE_STEPS + 0.5f);
+}
+
+/* fills table[0..SQ_CURVE_STEPS] with the curve spec, scaled to
+   0..max.  Returns -1 (and says why) if spec doesn't make sense. */
+int sq_curve_build(const char * spec, int max, unsigned short * table);
+
+/* 1 if spec is the straight line, which drivers can skip */
+int sq_curve_is_linear(const char * spec);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _squidlights_sqhash_h
+#define _squidlights_sqhash_h
+
+/* the string hash used for light name lookups (FNV-1a) */
+static inline unsigned int sq_name_hash(const char * name) {
+  unsigned int h = 2166136261u;
+  while(*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _squidlights_sqrecord_h
+#define _squidlights_sqrecord_h
+
+/* The server's traffic log (server -o file).  A file is a header and
+   then records, all SQ_RECORD_SIZE bytes, in the order the server took
+   the changes, in the byte order of the machine that wrote it.
+
+   A light change is one record, with the light's server-wide id (the
+   one clients use).  When a light comes or goes there's a record with
+   type SQ_LIGHT_SET_NAME and v[0] 1 or 0, and then more=1 record
+   holding its name.  Readers should skip the "more" records of types
+   they don't know. */
+
+#define SQ_RECORD_MAGIC "SQREC1"
+#define SQ_RECORD_SIZE 32
+
+struct sq_record_header {
+  char magic[8]; /* SQ_RECORD_MAGIC */
+  unsigned int record_size; /* SQ_RECORD_SIZE */
+  unsigned int pad;
+  unsigned long long count; /* records after the header */
+  long long start_usec; /* CLOCK_MONOTONIC when recording started */
+};
+
+struct sq_record {
+  long long usec; /* CLOCK_MONOTONIC */
+  int clientid;
+  unsigned short light;
+  unsigned char type; /* SQ_LIGHT_ON through SQ_LIGHT_FADE, or SQ_LIGHT_SET_NAME */
+  unsigned char more; /* records after this one that belong to it */
+  float v[3]; /* as in light_batch_entry */
+  int pad;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _squidlights_sqshow_h
+#define _squidlights_sqshow_h
+
+#include <stddef.h>
+
+/* The compiled show format, made by "sqshow compile" from a cue list
+   and played by "sqshow play", which maps it in and reads it where it
+   lies.  A file is
+
+     struct sq_show_header
+     nlights names, SQ_SHOW_NAME_LEN bytes each (nul padded)
+     nevents struct sq_show_event, sorted by time
+
+   in the byte order of the machine that compiled it. */
+
+#define SQ_SHOW_MAGIC "SQSHOW1"
+#define SQ_SHOW_NAME_LEN 32 /* as light names are */
+
+struct sq_show_header {
+  char magic[8]; /* SQ_SHOW_MAGIC */
+  unsigned int nlights;
+  unsigned int nevents;
+  unsigned int length_msec; /* time of the last event */
+  unsigned int pad;
+};
+
+struct sq_show_event {
+  unsigned int msec; /* from the start of the show */
+  unsigned short light; /* index into the names */
+  unsigned char type; /* SQ_LIGHT_ON through SQ_LIGHT_HSI, or SQ_LIGHT_FADE */
+  unsigned char pad;
+  float v[3]; /* as in light_batch_entry */
+};
+
+static inline char * sq_show_name(struct sq_show_header * h, unsigned int k) {
+  return (char *)(h + 1) + (size_t)k * SQ_SHOW_NAME_LEN;
+}
+
+static inline struct sq_show_event * sq_show_events(struct sq_show_header * h) {
+  return (struct sq_show_event *)sq_show_name(h, h->nlights);
+}
+
+#endif
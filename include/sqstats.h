@@ -0,0 +1,116 @@
+#ifndef _squidlights_sqstats_h
+#define _squidlights_sqstats_h
+
+#include <stddef.h>
+
+/* Live statistics.  The server, and each light process, keeps a page
+   of counters in shared memory (SQ_STATS_SERVER_SHM, and
+   SQ_STATS_LIGHTS_SHM_PREFIX followed by the pid), which anyone can
+   map read-only and look at ("sqlights stats" and "sqlights top")
+   without sending a message to anybody.
+
+   The pages are seqlocked: the writer makes seq odd, changes things,
+   and makes it even again, and a reader copies the page out and keeps
+   the copy only if seq was the same even number before and after.  A
+   page can grow (as lights come), so readers go by size. */
+
+#define SQ_STATS_SERVER_SHM "/squidlights-stats"
+#define SQ_STATS_LIGHTS_SHM_PREFIX "/squidlights-s"
+#define SQ_STATS_MAGIC 0x53515354
+
+struct sq_stats_header {
+  unsigned int magic;
+  unsigned int seq; /* odd while being written */
+  int pid;
+  int islight; /* 0 for the server's page */
+  unsigned long long size; /* of the whole page */
+  long long updated_usec; /* CLOCK_MONOTONIC */
+};
+
+struct sq_stats_client {
+  char name[32];
+  int live;
+  int pad;
+  unsigned long long msgs_in;
+};
+
+struct sq_stats_light {
+  char name[32];
+  int live;
+  int queued; /* server: messages waiting for the light's process */
+  unsigned long long changes_in; /* taken from clients (or, in a light process, handled) */
+  unsigned long long changes_out; /* server: passed on to the light's process */
+  unsigned long long coalesced; /* server: written over before they went out */
+};
+
+/* the server's page.  nclients sq_stats_client follow it, and then
+   nlights sq_stats_light, both indexed by the server's ids. */
+struct sq_stats_server {
+  struct sq_stats_header h;
+  unsigned long long loops; /* times around the forward loop */
+  unsigned long long loop_ns; /* time spent in it (not counting waiting) */
+  unsigned long long loop_ns_max; /* longest time around, since the last update */
+  unsigned long long msgs_in;
+  unsigned long long queue_msgs_in; /* the part that came by message queue,
+				       whose senders can't be told apart */
+  unsigned long long batches_out;
+  unsigned long long coalesced;
+  unsigned long long dropped; /* queued batches lost under -q drop */
+  unsigned long long disconnected;
+  unsigned long long timed_late;
+  unsigned long long timed_dropped;
+  unsigned long long record_dropped;
+  int nclients;
+  int nlights;
+};
+
+/* a light process's page.  nlights sq_stats_light follow it, indexed
+   by the process's own light ids. */
+struct sq_stats_lights {
+  struct sq_stats_header h;
+  unsigned long long msgs_in;
+  unsigned long long handler_ns; /* spent handling messages */
+  unsigned long long handler_ns_max;
+  int nlights;
+  int pad;
+};
+
+/* Pages a process publishes for others to read, like the stats pages.
+   They can only be written by the process that made them.  create
+   gives a zeroed page; resize can move it (returning the new place, or
+   NULL if it couldn't, leaving the old one as it was); map finds one
+   made by someone else, read-only, and says how big it is right now.
+   (in sqstats.c) */
+void * sq_page_create(const char * shmname, size_t size);
+void * sq_page_resize(void * page, const char * shmname, size_t old_size, size_t size);
+void * sq_page_map(const char * shmname, size_t * size);
+void sq_page_unmap(void * page, size_t size);
+void sq_page_destroy(void * page, const char * shmname, size_t size);
+
+/* copies the page shmname into *copy (realloc'd to *copy_cap bytes as
+   needed), as it was at one moment.  returns 0 if there's no such
+   page, or no room for the copy (*copy is left as it was). */
+int sq_stats_read(const char * shmname, void ** copy, size_t * copy_cap);
+
+static inline struct sq_stats_client * sq_stats_server_clients(struct sq_stats_server * s) {
+  return (struct sq_stats_client *)(s + 1);
+}
+
+static inline struct sq_stats_light * sq_stats_server_lights(struct sq_stats_server * s) {
+  return (struct sq_stats_light *)(sq_stats_server_clients(s) + s->nclients);
+}
+
+static inline struct sq_stats_light * sq_stats_lights_lights(struct sq_stats_lights * s) {
+  return (struct sq_stats_light *)(s + 1);
+}
+
+static inline void sq_stats_write_begin(struct sq_stats_header * h) {
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void sq_stats_write_end(struct sq_stats_header * h) {
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif
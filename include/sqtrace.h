@@ -0,0 +1,114 @@
+#ifndef _squidlights_sqtrace_h
+#define _squidlights_sqtrace_h
+
+/* Latency tracing.  A client run with SQUIDLIGHTS_TRACE set sends its
+   light changes as SQ_LIGHT_TRACED_BATCH, stamped as they're sent; the
+   server stamps them when it takes them and when it passes them on,
+   and the light process stamps them when it dispatches them and when
+   its handlers are done.  The light process keeps histograms of the
+   time between stamps (and per light, of the whole trip) in shared
+   memory, SQ_TRACE_SHM_PREFIX followed by its pid, where "sqlights
+   latency" finds them.
+
+   The histograms are in nanoseconds, HDR style: exact below
+   SQ_TRACE_SUB, and above that SQ_TRACE_SUB buckets to each power of
+   two, so any value is known to within 1/SQ_TRACE_SUB of itself. */
+
+#include <time.h>
+
+#define SQ_TRACE_ENV "SQUIDLIGHTS_TRACE"
+#define SQ_TRACE_SHM_PREFIX "/squidlights-t"
+#define SQ_TRACE_MAGIC 0x53515452
+
+#define SQ_TRACE_SUB_BITS 4
+#define SQ_TRACE_SUB (1 << SQ_TRACE_SUB_BITS)
+#define SQ_TRACE_MAX_BITS 40 /* about 18 minutes */
+#define SQ_TRACE_BUCKETS ((SQ_TRACE_MAX_BITS - SQ_TRACE_SUB_BITS + 2) * SQ_TRACE_SUB)
+
+/* the stages, between consecutive stamps, and then the whole trip */
+#define SQ_TRACE_TO_SERVER 0 /* client send -> server receive */
+#define SQ_TRACE_IN_SERVER 1 /* server receive -> server forward */
+#define SQ_TRACE_TO_LIGHT 2 /* server forward -> light dispatch */
+#define SQ_TRACE_HANDLER 3 /* light dispatch -> handlers done */
+#define SQ_TRACE_TOTAL 4 /* client send -> handlers done */
+#define SQ_TRACE_STAGES 5
+
+static const char * const sq_trace_stage_names[SQ_TRACE_STAGES] = {
+  "client->server", "in server", "server->light", "handler", "total"
+};
+
+struct sq_trace_hist {
+  unsigned long long count;
+  unsigned long long max;
+  unsigned int buckets[SQ_TRACE_BUCKETS];
+};
+
+/* a light process's histograms.  the lights that were connected when
+   the first traced change came each get one (nlights of them). */
+struct sq_trace_page {
+  unsigned int magic;
+  int pid;
+  int nlights;
+  int pad;
+  struct sq_trace_hist stages[SQ_TRACE_STAGES];
+  struct {
+    char name[32];
+    struct sq_trace_hist total;
+  } lights[];
+};
+
+static inline long long sq_trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int sq_trace_bucket(unsigned long long ns) {
+  if(ns < SQ_TRACE_SUB) {
+    return ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  if(e > SQ_TRACE_MAX_BITS) {
+    return SQ_TRACE_BUCKETS - 1;
+  }
+  return (e - SQ_TRACE_SUB_BITS + 1) * SQ_TRACE_SUB + ((ns >> (e - SQ_TRACE_SUB_BITS)) & (SQ_TRACE_SUB - 1));
+}
+
+/* the largest value that goes in bucket b */
+static inline unsigned long long sq_trace_bucket_top(int b) {
+  if(b < SQ_TRACE_SUB) {
+    return b;
+  }
+  int e = b / SQ_TRACE_SUB + SQ_TRACE_SUB_BITS - 1;
+  unsigned long long m = SQ_TRACE_SUB + b % SQ_TRACE_SUB;
+  return ((m + 1) << (e - SQ_TRACE_SUB_BITS)) - 1;
+}
+
+static inline void sq_trace_add(struct sq_trace_hist * h, long long ns) {
+  if(ns < 0) {
+    ns = 0; /* stamps from different cpus can disagree a little */
+  }
+  h->buckets[sq_trace_bucket(ns)]++;
+  h->count++;
+  if((unsigned long long)ns > h->max) {
+    h->max = ns;
+  }
+}
+
+/* the value at fraction q (0.5 for the median) of h, in ns */
+static inline unsigned long long sq_trace_quantile(struct sq_trace_hist * h, double q) {
+  unsigned long long want = (unsigned long long)(q * h->count + 0.5), seen = 0;
+  if(want == 0) {
+    want = 1;
+  }
+  for(int b = 0; b < SQ_TRACE_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if(seen >= want) {
+      unsigned long long top = sq_trace_bucket_top(b);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+#endif
@@ -1,6 +1,9 @@
 /* generic code for supporting a client */
 
 #include "protocol.h"
+#include "shmring.h"
+#include "sqhash.h"
+#include "sqtrace.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,38 +11,177 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/socket.h>
 
 /* at this level, we only need a name */
 struct lights_s {
   char name[32];
   int islight;
+  int hash_next; /* chain in the name index */
 };
 
-static struct lights_s light_servers[NUM_LIGHT_SERVERS];
+static struct lights_s * light_servers;
+static int num_light_servers = 0; /* grows as the server hands out ids */
+
+/* name -> id index over the live lights, and a counter bumped whenever
+   a light comes or goes so callers can cache lookups */
+static int * light_buckets;
+static int num_light_buckets = 0;
+static unsigned int light_generation = 0;
 
 int client_msqid;
 int server_msqid;
 
+/* the shared memory transport, if SQUIDLIGHTS_TRANSPORT=shm */
+static int transport;
+static struct sq_hub * hub;
+static struct sq_ring * ring;
+static char ring_name[64];
+/* the server socket, if SQUIDLIGHTS_TRANSPORT=socket */
+static int server_sock = -1;
+/* with SQUIDLIGHTS_TRACE set, light changes all go as traced batches */
+static char tracing = 0;
+
 /* initializes message queue for this process */
 int squidlights_client_initialize(void) {
   if((client_msqid = msgget(IPC_PRIVATE, 0666 | IPC_CREAT)) == -1) {
     perror("clients.c, initialization msgget");
     return -1;
   }
+  transport = sq_transport_from_env();
+  tracing = getenv(SQ_TRACE_ENV) != NULL;
+  return 0;
+}
+
+static void client_close_ring(void) {
+  if(ring != NULL) {
+    /* give the server a moment to pick up what we sent, since it
+       can't attach to the ring once we unlink it (unless it's gone) */
+    if(hub != NULL && (kill(hub->server_pid, 0) == 0 || errno != ESRCH)) {
+      sq_ring_wait_below(ring, 1, 1000);
+    }
+    sq_ring_detach(ring);
+    sq_ring_unlink(ring_name);
+    ring = NULL;
+  }
+  if(hub != NULL) {
+    sq_hub_detach(hub);
+    hub = NULL;
+  }
+}
+
+/* waits for the next message from the server */
+static int client_recv(void * buf, int size) {
+  if(server_sock != -1) {
+    int r;
+    while((r = sq_socket_recv(server_sock, buf, size, 1)) == 0);
+    return r == 1 ? 0 : -1;
+  }
+  return msgrcv(client_msqid, buf, size, 0, 0) == -1 ? -1 : 0;
+}
+
+/* offers the server a ring for our messages.  On any trouble we just
+   stay on the message queue. */
+static void client_open_ring(void) {
+  struct ring_attach_msg ram;
+
+  client_close_ring();
+  if((hub = sq_hub_attach()) == NULL) {
+    printf("no shared memory hub.  using message queues.\n");
+    return;
+  }
+  sprintf(ring_name, "/squidlights-c%d", (int)getpid());
+  if((ring = sq_ring_create(ring_name)) == NULL) {
+    client_close_ring();
+    return;
+  }
+  ram.mtype = SQ_ATTACH_RING;
+  ram.islight = 0;
+  ram.msqid = client_msqid;
+  strcpy(ram.shmname, ring_name);
+  if(msgsnd(server_msqid, &ram, SIZEOF_MSG(struct ring_attach_msg), 0) == -1) {
+    perror("clients.c, attach msgsnd");
+    client_close_ring();
+  }
+}
+
+static void client_hash_light(int lightid) {
+  int b = sq_name_hash(light_servers[lightid].name) % num_light_buckets;
+  light_servers[lightid].hash_next = light_buckets[b];
+  light_buckets[b] = lightid;
+}
+
+static void client_unhash_light(int lightid) {
+  int * p = &light_buckets[sq_name_hash(light_servers[lightid].name) % num_light_buckets];
+  while(*p != -1 && *p != lightid) {
+    p = &light_servers[*p].hash_next;
+  }
+  if(*p == lightid) {
+    *p = light_servers[lightid].hash_next;
+  }
+}
+
+static void client_rehash_lights(void) {
+  for(int i = 0; i < num_light_buckets; i++) {
+    light_buckets[i] = -1;
+  }
+  for(int i = 0; i < num_light_servers; i++) {
+    if(light_servers[i].islight) {
+      client_hash_light(i);
+    }
+  }
+}
+
+static int client_grow_lights(int lightid) {
+  int n = num_light_servers ? num_light_servers : NUM_LIGHT_SERVERS;
+  while(n <= lightid) {
+    n *= 2;
+  }
+  if(n == num_light_servers) {
+    return 0;
+  }
+  struct lights_s * p = realloc(light_servers, n * sizeof(struct lights_s));
+  if(p == NULL) {
+    printf("clients.c: out of memory for lights\n");
+    return -1;
+  }
+  memset(p + num_light_servers, 0, (n - num_light_servers) * sizeof(struct lights_s));
+  light_servers = p;
+  num_light_servers = n;
+
+  int * b = realloc(light_buckets, 2 * n * sizeof(int));
+  if(b == NULL) {
+    printf("clients.c: out of memory for lights\n");
+    return -1;
+  }
+  light_buckets = b;
+  num_light_buckets = 2 * n;
+  client_rehash_lights();
   return 0;
 }
 
 static int client_add_light(struct light_init_msg * lim) {
+  if(lim->lightid < 0 || client_grow_lights(lim->lightid) == -1) {
+    return -1;
+  }
   if(lim->msqid) {
     //    printf("got light %d %s\n", lim->lightid, lim->name);
   } else {
     printf("lost light %d\n", lim->lightid);
   }
+  if(light_servers[lim->lightid].islight) {
+    client_unhash_light(lim->lightid);
+  }
   strcpy(light_servers[lim->lightid].name, lim->name);
   light_servers[lim->lightid].islight = lim->msqid;
+  if(lim->msqid) {
+    client_hash_light(lim->lightid);
+  }
+  light_generation++;
   return 0;
 }
 
@@ -53,41 +195,68 @@ int squidlights_client_connect(char* name) {
     perror("server not running? msgget");
     return SQ_CONNECTION_ERROR;
   }
+  if(server_sock != -1) {
+    close(server_sock);
+    server_sock = -1;
+  }
+  if(transport == SQ_TRANSPORT_SOCKET && (server_sock = sq_socket_connect()) == -1) {
+    return SQ_CONNECTION_ERROR;
+  }
 
   msg.mtype = SQ_CLIENT_SET_NAME;
   msg.clientid = 0; // not used...
   msg.msqid = client_msqid;
   strcpy(msg.name, name);
 
-  if(msgsnd(server_msqid, &msg, SIZEOF_MSG(struct client_init_msg), 0) == -1) {
+  if(server_sock != -1) {
+    if(send(server_sock, &msg, sizeof(struct client_init_msg), MSG_NOSIGNAL) == -1) {
+      perror("clients.c, squidclient send");
+      return SQ_CONNECTION_ERROR;
+    }
+  } else if(msgsnd(server_msqid, &msg, SIZEOF_MSG(struct client_init_msg), 0) == -1) {
     perror("clients.c, squidclient msgsnd");
     return SQ_CONNECTION_ERROR;
   }
   
   /* clear what is known about lights */
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
+  client_grow_lights(0);
+  for(int i = 0; i < num_light_servers; i++) {
     light_servers[i].islight = 0;
   }
+  client_rehash_lights();
+  light_generation++;
 
   //  printf("waiting for server to send lights... "); fflush(stdout);
-  if(msgrcv(client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0, 0) == -1) {
-    perror("clients.c, connect1 msgrcv");
+  if(client_recv(&lim, SIZEOF_MSG(struct light_init_msg)) == -1) {
+    perror("clients.c, connect1 recv");
     return SQ_CONNECTION_ERROR;
   }
   //  printf(".");
   while(lim.lightid != -1) {
     client_add_light(&lim);
-    if(msgrcv(client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0, 0) == -1) {
-      perror("clients.c, connect2 msgrcv");
+    if(client_recv(&lim, SIZEOF_MSG(struct light_init_msg)) == -1) {
+      perror("clients.c, connect2 recv");
       return SQ_CONNECTION_ERROR;
     }
     //    printf(".");
   }
   //  printf(" done\n");
+  if(transport == SQ_TRANSPORT_SHM) {
+    client_open_ring();
+  }
   return ++nextclientid;
 }
 
+int squidlights_client_num_lights(void) {
+  return num_light_servers;
+}
+
 char* squidlights_client_lightname(int lightid) {
+  static char noname[1];
+  if(lightid < 0 || lightid >= num_light_servers) {
+    noname[0] = '\0';
+    return noname;
+  }
   if(!light_servers[lightid].islight) {
     light_servers[lightid].name[0] = '\0';
   }
@@ -95,31 +264,61 @@ char* squidlights_client_lightname(int lightid) {
 }
 
 int squidlights_client_getlight(char* name) {
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
-    if(light_servers[i].islight && strcmp(name, light_servers[i].name) == 0) {
+  if(num_light_buckets == 0) {
+    return SQ_UNDEFINED_LIGHT;
+  }
+  int i = light_buckets[sq_name_hash(name) % num_light_buckets];
+  while(i != -1) {
+    if(strcmp(name, light_servers[i].name) == 0) {
       return i;
     }
+    i = light_servers[i].hash_next;
   }
   return SQ_UNDEFINED_LIGHT;
 }
 
+unsigned int squidlights_client_generation(void) {
+  return light_generation;
+}
+
+/* handles one message from the server.  returns -1 if told to die */
+static int client_handle(struct generic_msgbuf * buf) {
+  switch(buf->mtype) {
+  case SQ_LIGHT_SET_NAME :
+    client_add_light((struct light_init_msg *) buf);
+    break;
+  case SQ_DIE :
+    return -1;
+  default :
+    printf("ignoring unknown message type %ld\n", buf->mtype);
+  }
+  return 0;
+}
+
 int squidlights_client_process_messages(void) {
   struct generic_msgbuf buf;
   struct msqid_ds msq;
+  if(server_sock != -1) {
+    int r;
+    while((r = sq_socket_recv(server_sock, &buf, SIZEOF_MSG(struct generic_msgbuf), 0)) == 1) {
+      if(client_handle(&buf) == -1) {
+	return -1;
+      }
+    }
+    if(r == -1) {
+      printf("server hung up\n");
+      return -1;
+    }
+    return 0;
+  }
   int ret = msgctl(client_msqid, IPC_STAT, &msq);
   while(ret != -1 && msq.msg_qnum > 0) {
     if(!msgrcv(client_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, IPC_NOWAIT)) {
       perror("clients.c process msgrcv");
       return SQ_CONNECTION_ERROR;
     }
-    switch(buf.mtype) {
-    case SQ_LIGHT_SET_NAME :
-      client_add_light((struct light_init_msg *) &buf);
-      break;
-    case SQ_DIE :
+    if(client_handle(&buf) == -1) {
       return -1;
-    default :
-      printf("ignoring unknown message type %ld\n", buf.mtype);
     }
     ret = msgctl(client_msqid, IPC_STAT, &msq);
   }
@@ -134,6 +333,11 @@ int squidlights_client_quit(void) {
   /* cleanup! cleanup! everybody do your share! */
   printf("killing message queue\n");
   
+  client_close_ring();
+  if(server_sock != -1) {
+    close(server_sock);
+    server_sock = -1;
+  }
   /* server will detect shutdown of queue */
   if(msgctl(client_msqid, IPC_RMID, NULL) == -1) {
     perror("msgctl");
@@ -143,6 +347,23 @@ int squidlights_client_quit(void) {
 }
 
 static int send_msg(void* msg, int size) {
+  if(tracing && *(long *)msg == SQ_LIGHT_TRACED_BATCH) {
+    ((struct light_traced_batch_msg *)msg)->trace.sent = sq_trace_now();
+  }
+  if(server_sock != -1) {
+    if(send(server_sock, msg, size + sizeof(long), MSG_NOSIGNAL) == -1) {
+      perror("send in send_msg");
+      return -1;
+    }
+    return 0;
+  }
+  if(ring != NULL) {
+    if(sq_ring_push_wait(ring, msg, size, &hub->bell, server_msqid) == -1) {
+      printf("server went away in send_msg\n");
+      return -1;
+    }
+    return 0;
+  }
   if(msgsnd(server_msqid, msg, size, 0) == -1) {
     perror("msgsnd in send_mesg");
     return -1;
@@ -151,7 +372,113 @@ static int send_msg(void* msg, int size) {
   }
 }
 
+/* the frame being staged, if any.  it is sent whenever it fills up.
+   with a time set (squidlights_client_at), changes are staged too,
+   and go out as timed batches. */
+static struct light_batch_msg frame;
+static char frame_open = 0;
+static long long frame_at = 0;
+
+static int frame_send(void) {
+  int ret = 0;
+  if(frame.count > 0 && frame_at != 0) {
+    struct light_timed_batch_msg timed;
+    timed.mtype = SQ_LIGHT_TIMED_BATCH;
+    timed.count = frame.count;
+    timed.clientid = frame.clientid;
+    timed.at = frame_at;
+    memcpy(timed.entries, frame.entries, frame.count * sizeof(struct light_batch_entry));
+    ret = send_msg(&timed, SIZEOF_MSG(struct light_timed_batch_msg));
+    frame.count = 0;
+  } else if(frame.count > 0 && tracing) {
+    struct light_traced_batch_msg traced;
+    traced.mtype = SQ_LIGHT_TRACED_BATCH;
+    traced.count = frame.count;
+    traced.clientid = frame.clientid;
+    memset(&traced.trace, 0, sizeof(traced.trace));
+    memcpy(traced.entries, frame.entries, frame.count * sizeof(struct light_batch_entry));
+    ret = send_msg(&traced, SIZEOF_MSG(struct light_traced_batch_msg));
+    frame.count = 0;
+  } else if(frame.count > 0) {
+    frame.mtype = SQ_LIGHT_BATCH;
+    ret = send_msg(&frame, SIZEOF_MSG(struct light_batch_msg));
+    frame.count = 0;
+  }
+  return ret;
+}
+
+/* the kinds of change that replace each other in a frame.  on and
+   off are one switch, as they are in the server, and a brightness and
+   a fade both say where the brightness ends up. */
+static int frame_slot(int type) {
+  switch(type) {
+  case SQ_LIGHT_OFF : return SQ_LIGHT_ON;
+  case SQ_LIGHT_FADE : return SQ_LIGHT_BRIGHTNESS;
+  }
+  return type;
+}
+
+static int frame_stage(int clientid, int type, int light, float v0, float v1, float v2) {
+  struct light_batch_entry * e;
+  if(light < 0 || light > 0xFFFF) {
+    return SQ_UNDEFINED_LIGHT;
+  }
+  /* a replaced change moves to the end, so the frame keeps the order
+     the changes were last made in */
+  for(int i = 0; i < frame.count; i++) {
+    if(frame.entries[i].lightid == light && frame_slot(frame.entries[i].type) == frame_slot(type)) {
+      memmove(&frame.entries[i], &frame.entries[i+1], (frame.count - i - 1) * sizeof(struct light_batch_entry));
+      frame.count--;
+      break;
+    }
+  }
+  int max = frame_at ? SQ_TIMED_BATCH_MAX : tracing ? SQ_TRACED_BATCH_MAX : SQ_BATCH_MAX;
+  if(frame.count == max && frame_send() == -1) {
+    return -1;
+  }
+  e = &frame.entries[frame.count++];
+  e->lightid = light;
+  e->type = type;
+  e->pad = 0;
+  frame.clientid = clientid;
+  e->v[0] = v0;
+  e->v[1] = v1;
+  e->v[2] = v2;
+  if(!frame_open) {
+    return frame_send(); /* a single timed (or traced) change */
+  }
+  return 0;
+}
+
+long long squidlights_client_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int squidlights_client_at(long long when) {
+  int ret = 0;
+  if(when != frame_at) {
+    ret = frame_send(); /* what's staged keeps its own time */
+    frame_at = when;
+  }
+  return ret;
+}
+
+int squidlights_client_frame_begin(int clientid) {
+  frame_open = 1;
+  frame.count = 0;
+  frame.clientid = clientid;
+  return 0;
+}
+
+int squidlights_client_frame_commit(int clientid) {
+  frame_open = 0;
+  return frame_send();
+}
+
 int squidlights_client_light_on(int clientid, int light) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_ON, light, 0, 0, 0);
   struct generic_msgbuf msg;
   msg.mtype = SQ_LIGHT_ON;
   msg.lightid = light;
@@ -159,6 +486,7 @@ int squidlights_client_light_on(int clientid, int light) {
   return send_msg(&msg, SIZEOF_MSG(struct generic_msgbuf));
 }
 int squidlights_client_light_off(int clientid, int light) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_OFF, light, 0, 0, 0);
   struct generic_msgbuf msg;
   msg.mtype = SQ_LIGHT_OFF;
   msg.lightid = light;
@@ -166,6 +494,7 @@ int squidlights_client_light_off(int clientid, int light) {
   return send_msg(&msg, SIZEOF_MSG(struct generic_msgbuf));
 }
 int squidlights_client_light_set(int clientid, int light, float brightness) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_BRIGHTNESS, light, brightness, 0, 0);
   struct light_brightness_msg msg;
   msg.mtype = SQ_LIGHT_BRIGHTNESS;
   msg.lightid = light;
@@ -174,6 +503,7 @@ int squidlights_client_light_set(int clientid, int light, float brightness) {
   return send_msg(&msg, SIZEOF_MSG(struct light_brightness_msg));
 }
 int squidlights_client_light_rgb(int clientid, int light, float r, float g, float b) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_RGB, light, r, g, b);
   struct light_rgb_msg msg;
   msg.mtype = SQ_LIGHT_RGB;
   msg.lightid = light;
@@ -184,6 +514,7 @@ int squidlights_client_light_rgb(int clientid, int light, float r, float g, floa
   return send_msg(&msg, SIZEOF_MSG(struct light_rgb_msg));
 }
 int squidlights_client_light_hsi(int clientid, int light, float h, float s, float i) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_HSI, light, h, s, i);
   struct light_hsi_msg msg;
   msg.mtype = SQ_LIGHT_HSI;
   msg.lightid = light;
@@ -193,3 +524,35 @@ int squidlights_client_light_hsi(int clientid, int light, float h, float s, floa
   msg.i = i;
   return send_msg(&msg, SIZEOF_MSG(struct light_hsi_msg));
 }
+
+int squidlights_client_light_fade(int clientid, int light, float brightness, float seconds) {
+  if(frame_open || frame_at || tracing) return frame_stage(clientid, SQ_LIGHT_FADE, light, brightness, seconds, 0);
+  struct light_fade_msg msg;
+  msg.mtype = SQ_LIGHT_FADE;
+  msg.lightid = light;
+  msg.clientid = clientid;
+  msg.brightness = brightness;
+  msg.seconds = seconds;
+  return send_msg(&msg, SIZEOF_MSG(struct light_fade_msg));
+}
+
+int squidlights_client_effect(int clientid, struct effect_msg * effect) {
+  if(effect->effectid < 0 || effect->effectid >= SQ_MAX_EFFECTS
+     || effect->nlights < 0 || effect->nlights > SQ_EFFECT_MAX_LIGHTS) {
+    return SQ_UNDEFINED_LIGHT;
+  }
+  if(frame_open && frame_send() == -1) { /* keep things in order */
+    return -1;
+  }
+  effect->mtype = SQ_EFFECT;
+  effect->clientid = clientid;
+  return send_msg(effect, SIZEOF_MSG(struct effect_msg));
+}
+
+int squidlights_client_effect_stop(int clientid, int effectid) {
+  struct effect_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.effectid = effectid;
+  msg.kind = SQ_EFFECT_STOP;
+  return squidlights_client_effect(clientid, &msg);
+}
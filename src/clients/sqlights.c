@@ -1,10 +1,19 @@
 /* light control by the command line */
 
 #include "protocol.h"
+#include "sqtrace.h"
+#include "sqstats.h"
+#include "shmring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 void print_usage(char* prgname) {
     printf("usage: %s\n"
@@ -13,9 +22,17 @@ void print_usage(char* prgname) {
 	   "\toff (lightname)\n"
 	   "\tset (lightname) (brightness)\n"
 	   "\trgb (lightname) (r) (g) (b)\n"
-	   "\thsi (lightname) (h) (s) (i)\n\n"
-	   "use . for lightname to send the signal to all lights\n",
-	   prgname);
+	   "\thsi (lightname) (h) (s) (i)\n"
+	   "\tfade (lightname) (brightness) (seconds)\n"
+	   "\teffect (id) (chase|strobe|pulse|rainbow) (rate) (phase) (spread) (duty) (h) (s) (i) (lightname)...\n"
+	   "\tstop (id)\n"
+	   "\tlatency\n"
+	   "\tstats\n"
+	   "\ttop\n\n"
+	   "use . for lightname to send the signal to all lights\n"
+	   "(effects run in the server until stopped; see SQ_EFFECT in protocol.h)\n"
+	   "(latency shows what clients run with %s set have seen; see sqtrace.h)\n",
+	   prgname, SQ_TRACE_ENV);
 }
 
 float read_arg_float(int argc, char** argv, int i) {
@@ -48,10 +65,278 @@ void handle_command(int clientid, int argc, char** argv, int lightid) {
     float i = read_arg_float(argc, argv, 5);
     printf("turning %s to hsi=(%f,%f,%f)\n", squidlights_client_lightname(lightid), h,s,i);
     squidlights_client_light_hsi(clientid,lightid, h,s,i);
+  } else if(strcmp(argv[1], "fade")==0) {
+    float b = read_arg_float(argc, argv, 3);
+    float secs = read_arg_float(argc, argv, 4);
+    printf("fading %s to %f over %fs\n", squidlights_client_lightname(lightid), b, secs);
+    squidlights_client_light_fade(clientid,lightid, b, secs);
+  }
+}
+
+static const char * effect_kinds[] = {"stop", "chase", "strobe", "pulse", "rainbow"};
+
+/* argv[2] on are "(id) (kind) (rate) (phase) (spread) (duty) (h) (s) (i) (lightname)..." */
+void start_effect(int clientid, int argc, char** argv) {
+  struct effect_msg em;
+  memset(&em, 0, sizeof(em));
+  em.effectid = atoi(argv[2]);
+  for(em.kind = SQ_EFFECT_CHASE; em.kind <= SQ_EFFECT_RAINBOW; em.kind++) {
+    if(strcmp(argv[3], effect_kinds[em.kind]) == 0) break;
+  }
+  if(em.kind > SQ_EFFECT_RAINBOW) {
+    printf("No such effect %s\n", argv[3]);
+    return;
+  }
+  em.rate = read_arg_float(argc, argv, 4);
+  em.phase = read_arg_float(argc, argv, 5);
+  em.spread = read_arg_float(argc, argv, 6);
+  em.duty = read_arg_float(argc, argv, 7);
+  em.h = read_arg_float(argc, argv, 8);
+  em.s = read_arg_float(argc, argv, 9);
+  em.i = read_arg_float(argc, argv, 10);
+  for(int a = 11; a < argc; a++) {
+    if(strcmp(argv[a], ".") == 0) {
+      for(int i = 0; i < squidlights_client_num_lights() && em.nlights < SQ_EFFECT_MAX_LIGHTS; i++) {
+	if(squidlights_client_lightname(i)[0] != '\0') {
+	  em.lights[em.nlights++] = i;
+	}
+      }
+      continue;
+    }
+    int lightid = squidlights_client_getlight(argv[a]);
+    if(lightid == SQ_UNDEFINED_LIGHT) {
+      printf("No such light %s\n", argv[a]);
+      return;
+    }
+    if(em.nlights == SQ_EFFECT_MAX_LIGHTS) {
+      printf("at most %d lights in an effect\n", SQ_EFFECT_MAX_LIGHTS);
+      return;
+    }
+    em.lights[em.nlights++] = lightid;
+  }
+  printf("starting effect %d, %s of %d lights\n", em.effectid, effect_kinds[em.kind], em.nlights);
+  if(squidlights_client_effect(clientid, &em) != 0) {
+    printf("couldn't start it\n");
+  }
+}
+
+static void print_hist(const char * name, struct sq_trace_hist * h) {
+  printf("  %-16s %8.1f %8.1f %8.1f %8.1f %8llu\n", name,
+	 sq_trace_quantile(h, 0.5) / 1000.0, sq_trace_quantile(h, 0.99) / 1000.0,
+	 sq_trace_quantile(h, 0.999) / 1000.0, h->max / 1000.0, h->count);
+}
+
+/* prints the histograms of every light process that has traced
+   anything (the shared memory is under /dev/shm) */
+int print_latency(void) {
+  DIR * dir = opendir("/dev/shm");
+  struct dirent * de;
+  int found = 0;
+  if(dir == NULL) {
+    perror("/dev/shm");
+    return 1;
+  }
+  while((de = readdir(dir)) != NULL) {
+    char shmname[300];
+    struct stat st;
+    if(strncmp(de->d_name, SQ_TRACE_SHM_PREFIX + 1, strlen(SQ_TRACE_SHM_PREFIX) - 1) != 0) {
+      continue;
+    }
+    snprintf(shmname, sizeof(shmname), "/%s", de->d_name);
+    int fd = shm_open(shmname, O_RDONLY, 0);
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct sq_trace_page)) {
+      if(fd != -1) close(fd);
+      continue;
+    }
+    struct sq_trace_page * page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED) {
+      continue;
+    }
+    if(page->magic == SQ_TRACE_MAGIC
+       && st.st_size >= (off_t)(sizeof(struct sq_trace_page) + page->nlights * sizeof(page->lights[0]))) {
+      found++;
+      printf("light process %d%s\n", page->pid,
+	     kill(page->pid, 0) == -1 && errno == ESRCH ? " (gone)" : "");
+      printf("  latency (usec)        p50      p99     p999      max    count\n");
+      for(int k = 0; k < SQ_TRACE_STAGES; k++) {
+	print_hist(sq_trace_stage_names[k], &page->stages[k]);
+      }
+      for(int k = 0; k < page->nlights; k++) {
+	if(page->lights[k].total.count > 0) {
+	  print_hist(page->lights[k].name, &page->lights[k].total);
+	}
+      }
+    }
+    munmap(page, st.st_size);
+  }
+  closedir(dir);
+  if(found == 0) {
+    printf("nothing traced yet.  run a client with %s=1.\n", SQ_TRACE_ENV);
+  }
+  return 0;
+}
+
+/*** stats and top ***/
+
+/* now, or (with before) how much it went up per second */
+#define PER_SEC(field) (before ? (s->field - before->field) / dt : (double)s->field)
+
+void print_server_stats(struct sq_stats_server * s, struct sq_stats_server * before, double dt) {
+  long long age = squidlights_client_now() - s->h.updated_usec;
+  unsigned long long loops = s->loops - (before ? before->loops : 0);
+  unsigned long long loop_ns = s->loop_ns - (before ? before->loop_ns : 0);
+  printf("server (pid %d), updated %.1fs ago%s\n", s->h.pid, age / 1e6,
+	 kill(s->h.pid, 0) == -1 && errno == ESRCH ? " (gone)" : "");
+  printf("  %s: %.0f loops, %.0f msgs in (%.0f by message queue), %.0f batches out\n",
+	 before ? "per second" : "in all", PER_SEC(loops), PER_SEC(msgs_in), PER_SEC(queue_msgs_in),
+	 PER_SEC(batches_out));
+  printf("  loop: %.1fus on average, %.1fus at most lately\n",
+	 loops ? loop_ns / 1000.0 / loops : 0, s->loop_ns_max / 1000.0);
+  printf("  coalesced %.0f, dropped %.0f, disconnected %.0f, late %.0f (dropped %.0f), not recorded %.0f\n",
+	 PER_SEC(coalesced), PER_SEC(dropped), PER_SEC(disconnected), PER_SEC(timed_late),
+	 PER_SEC(timed_dropped), PER_SEC(record_dropped));
+  struct sq_stats_client * sc = sq_stats_server_clients(s);
+  struct sq_stats_client * bc = before ? sq_stats_server_clients(before) : NULL;
+  printf("  %-32s %10s\n", "client", "msgs in");
+  for(int i = 0; i < s->nclients; i++) {
+    if(sc[i].live) {
+      int same = bc != NULL && i < before->nclients && bc[i].live && strcmp(bc[i].name, sc[i].name) == 0;
+      unsigned long long was = same ? bc[i].msgs_in : 0;
+      printf("  %-32s %10.0f\n", sc[i].name, before ? (sc[i].msgs_in - was) / dt : (double)sc[i].msgs_in);
+    }
+  }
+  struct sq_stats_light * sl = sq_stats_server_lights(s);
+  struct sq_stats_light * bl = before ? sq_stats_server_lights(before) : NULL;
+  printf("  %-32s %10s %10s %10s %7s\n", "light", "in", "out", "coalesced", "queued");
+  for(int i = 0; i < s->nlights; i++) {
+    if(sl[i].live) {
+      struct sq_stats_light was = {{0}};
+      if(bl != NULL && i < before->nlights && bl[i].live && strcmp(bl[i].name, sl[i].name) == 0) {
+	was = bl[i];
+      }
+      double d = before ? dt : 1;
+      printf("  %-32s %10.0f %10.0f %10.0f %7d\n", sl[i].name, (sl[i].changes_in - was.changes_in) / d,
+	     (sl[i].changes_out - was.changes_out) / d, (sl[i].coalesced - was.coalesced) / d, sl[i].queued);
+    }
+  }
+}
+
+void print_lights_stats(struct sq_stats_lights * s, struct sq_stats_lights * before, double dt) {
+  unsigned long long msgs = s->msgs_in - (before ? before->msgs_in : 0);
+  unsigned long long ns = s->handler_ns - (before ? before->handler_ns : 0);
+  printf("light process %d%s: %.0f msgs in, handling took %.1fus on average, %.1fus at most\n",
+	 s->h.pid, kill(s->h.pid, 0) == -1 && errno == ESRCH ? " (gone)" : "",
+	 PER_SEC(msgs_in), msgs ? ns / 1000.0 / msgs : 0, s->handler_ns_max / 1000.0);
+  struct sq_stats_light * sl = sq_stats_lights_lights(s);
+  struct sq_stats_light * bl = before ? sq_stats_lights_lights(before) : NULL;
+  for(int i = 0; i < s->nlights; i++) {
+    unsigned long long was = bl != NULL && i < before->nlights ? bl[i].changes_in : 0;
+    printf("  %-32s %10.0f\n", sl[i].name, before ? (sl[i].changes_in - was) / dt : (double)sl[i].changes_in);
   }
 }
 
+#undef PER_SEC
+
+/* what's been read, so top can say how fast things are going */
+#define STATS_MAX_PAGES 64
+struct stats_pages_s {
+  int n;
+  char names[STATS_MAX_PAGES][sizeof(((struct dirent *)0)->d_name) + 1];
+  void * copies[STATS_MAX_PAGES];
+  size_t caps[STATS_MAX_PAGES];
+};
+
+static void read_all_stats(struct stats_pages_s * pages) {
+  DIR * dir = opendir("/dev/shm");
+  struct dirent * de;
+  pages->n = 0;
+  if(dir == NULL) {
+    return;
+  }
+  char * prefix = SQ_STATS_LIGHTS_SHM_PREFIX + 1;
+  strcpy(pages->names[pages->n++], SQ_STATS_SERVER_SHM);
+  while((de = readdir(dir)) != NULL && pages->n < STATS_MAX_PAGES) {
+    if(strncmp(de->d_name, prefix, strlen(prefix)) == 0
+       && de->d_name[strlen(prefix)] >= '0' && de->d_name[strlen(prefix)] <= '9') {
+      snprintf(pages->names[pages->n++], sizeof(pages->names[0]), "/%s", de->d_name);
+    }
+  }
+  closedir(dir);
+  for(int k = 0; k < pages->n; k++) {
+    if(!sq_stats_read(pages->names[k], &pages->copies[k], &pages->caps[k])) {
+      pages->names[k][0] = '\0';
+    }
+  }
+}
+
+static void * find_page(struct stats_pages_s * pages, char * name) {
+  for(int k = 0; k < pages->n; k++) {
+    if(strcmp(pages->names[k], name) == 0) {
+      return pages->copies[k];
+    }
+  }
+  return NULL;
+}
+
+static volatile sig_atomic_t top_running;
+
+void top_sigint_handler(int sig) {
+  top_running = 0;
+}
+
+/* prints everything once, or with top, what's changed every second
+   until ^C */
+int print_stats(int top) {
+  static struct stats_pages_s pages[2];
+  int cur = 0, found;
+  long long then = 0;
+  top_running = 1;
+  if(top) {
+    signal(SIGINT, top_sigint_handler);
+  }
+  do {
+    read_all_stats(&pages[cur]);
+    long long now = squidlights_client_now();
+    struct stats_pages_s * before = then ? &pages[!cur] : NULL;
+    double dt = (now - then) / 1e6;
+    if(top) {
+      printf("\033[H\033[J");
+    }
+    found = 0;
+    for(int k = 0; k < pages[cur].n; k++) {
+      char * name = pages[cur].names[k];
+      struct sq_stats_header * h = pages[cur].copies[k];
+      if(name[0] == '\0') {
+	continue;
+      }
+      found++;
+      void * was = before ? find_page(before, name) : NULL;
+      if(h->islight) {
+	print_lights_stats((struct sq_stats_lights *)h, was, dt);
+      } else {
+	print_server_stats((struct sq_stats_server *)h, was, dt);
+      }
+    }
+    if(found == 0) {
+      printf("no stats.  is the server running?\n");
+    }
+    fflush(stdout);
+    then = now;
+    cur = !cur;
+  } while(top && top_running && sleep(1) == 0);
+  return found == 0;
+}
+
 int main(int argc, char** argv) {
+  /* these only read shared memory, and don't need the server */
+  if(argc > 1 && strcmp(argv[1], "latency") == 0) {
+    return print_latency();
+  }
+  if(argc > 1 && (strcmp(argv[1], "stats") == 0 || strcmp(argv[1], "top") == 0)) {
+    return print_stats(argv[1][0] == 't');
+  }
+
   if(squidlights_client_initialize() == -1) {
     printf("Something's wrong\n");
     exit(1);
@@ -64,24 +349,39 @@ int main(int argc, char** argv) {
     print_usage(argv[0]);
   } else if(strcmp(argv[1], "list") == 0) {
     printf("Registered lights:\n\n");
-    for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
+    for(int i = 0; i < squidlights_client_num_lights(); i++) {
       char* lightname = squidlights_client_lightname(i);
       if(lightname[0] != '\0') {
 	printf("%s ", lightname);
       }
     }
     printf("\n");
+  } else if(strcmp(argv[1], "effect") == 0) {
+    if(argc < 12) {
+      print_usage(argv[0]);
+    } else {
+      start_effect(clientid, argc, argv);
+    }
+  } else if(strcmp(argv[1], "stop") == 0) {
+    if(argc < 3) {
+      print_usage(argv[0]);
+    } else {
+      printf("stopping effect %d\n", atoi(argv[2]));
+      squidlights_client_effect_stop(clientid, atoi(argv[2]));
+    }
   } else {
     if(argc < 3) {
       print_usage(argv[0]);
     } else {
       if(strcmp(argv[2], ".") == 0) {
-	for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
+	squidlights_client_frame_begin(clientid);
+	for(int i = 0; i < squidlights_client_num_lights(); i++) {
 	  char* lightname = squidlights_client_lightname(i);
 	  if(lightname[0] != '\0') {
 	    handle_command(clientid, argc, argv, i);
 	  }
 	}
+	squidlights_client_frame_commit(clientid);
       } else {
 	int lightid = squidlights_client_getlight(argv[2]);
 	if(lightid == SQ_UNDEFINED_LIGHT) {
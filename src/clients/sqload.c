@@ -0,0 +1,328 @@
+/* load generator, for benchmarks.  Forks some clients, which between
+   them drive the lights prefix0 .. prefix<n-1> (nulllight makes these)
+   at some rate, each light getting its changes from one client.  The
+   changes go traced, so the light process keeps latency histograms.
+   Afterwards it reads the stats and trace pages (nothing goes through
+   the server but the load) and prints one line of JSON saying what was
+   sent, what the server passed on or coalesced, what the lights
+   handled, and how long it took to get there. */
+
+#include "protocol.h"
+#include "sqbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define LOAD_CONNECT_SEC 5 /* for the lights to show up */
+#define LOAD_PROCESS_EVERY 64 /* ticks between reading the server's messages */
+
+static int nlights = 16;
+static char * prefix = "null";
+static double hz = 100;
+static int nclients = 1;
+static double seconds = 5;
+static char * mix_spec = "set:5,rgb:3,hsi:1,fade:1";
+static int batched = 1;
+
+/*** the message mix ***/
+
+static const char * const mix_names[] = {"on", "off", "set", "rgb", "hsi", "fade"};
+#define MIX_KINDS 6
+static int mix_weights[MIX_KINDS];
+static int mix_total = 0;
+
+int parse_mix(char * spec) {
+  char * copy = strdup(spec);
+  char * save;
+  for(char * tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    char * colon = strchr(tok, ':');
+    int weight = colon ? atoi(colon + 1) : 1;
+    int k;
+    if(colon) *colon = '\0';
+    for(k = 0; k < MIX_KINDS && strcmp(tok, mix_names[k]) != 0; k++);
+    if(k == MIX_KINDS || weight < 0) {
+      printf("bad mix entry %s\n", tok);
+      free(copy);
+      return -1;
+    }
+    mix_weights[k] += weight;
+    mix_total += weight;
+  }
+  free(copy);
+  if(mix_total == 0) {
+    printf("the mix is empty\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* the changes are made up from a cheap random number */
+static unsigned int rand_state;
+
+static unsigned int next_rand(void) {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+int send_change(int clientid, int light, float x) {
+  int r = next_rand() % mix_total;
+  int k = 0;
+  while(r >= mix_weights[k]) {
+    r -= mix_weights[k++];
+  }
+  switch(k) {
+  case 0 : return squidlights_client_light_on(clientid, light);
+  case 1 : return squidlights_client_light_off(clientid, light);
+  case 2 : return squidlights_client_light_set(clientid, light, x);
+  case 3 : return squidlights_client_light_rgb(clientid, light, x, 1 - x, 0.5);
+  case 4 : return squidlights_client_light_hsi(clientid, light, x, 1, 1);
+  default : return squidlights_client_light_fade(clientid, light, x, 0.5);
+  }
+}
+
+/*** the clients ***/
+
+struct load_result {
+  unsigned long long sent, errors, ticks, late_ticks;
+  long long first_usec, last_usec;
+};
+
+static int mine(int k, int j) {
+  return j % nclients == k;
+}
+
+/* the lights client k drives, looked up.  returns how many. */
+static int find_lights(int k, int * ids) {
+  char name[32];
+  int n = 0;
+  for(int j = 0; j < nlights; j++) {
+    if(mine(k, j)) {
+      sprintf(name, "%s%d", prefix, j);
+      if((ids[n] = squidlights_client_getlight(name)) == SQ_UNDEFINED_LIGHT) {
+	return -1;
+      }
+      n++;
+    }
+  }
+  return n;
+}
+
+static void sleep_until(long long usec) {
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* client k: says it's ready on ready_fd, starts when go_fd closes, and
+   writes a load_result to ready_fd at the end */
+void run_client(int k, int ready_fd, int go_fd) {
+  struct load_result res = {0};
+  int * ids = malloc(nlights * sizeof(int));
+  char name[32];
+  int clientid = -1, n = -1;
+  rand_state = 2463534242u + k;
+  sprintf(name, "sqload%d", k);
+  if(squidlights_client_initialize() == -1 || (clientid = squidlights_client_connect(name)) < 0) {
+    printf("%s couldn't connect\n", name);
+  } else {
+    long long give_up = squidlights_client_now() + LOAD_CONNECT_SEC * 1000000LL;
+    while(squidlights_client_process_messages() != -1 && (n = find_lights(k, ids)) == -1
+	  && squidlights_client_now() < give_up) {
+      usleep(10000);
+    }
+    if(n == -1) {
+      printf("%s didn't find its lights\n", name);
+    }
+  }
+  char c = n == -1 ? 'x' : 'r';
+  if(write(ready_fd, &c, 1) != 1 || read(go_fd, &c, 1) != 0 || n == -1) {
+    exit(1);
+  }
+
+  long long period = 1000000 / hz;
+  long long start = squidlights_client_now();
+  long long end = start + (long long)(seconds * 1000000);
+  unsigned int generation = squidlights_client_generation();
+  res.first_usec = start;
+  for(long long next = start; next < end; next += period) {
+    long long now = squidlights_client_now();
+    if(now < next) {
+      sleep_until(next);
+    } else if(now - next > period) {
+      res.late_ticks++;
+    }
+    if(res.ticks % LOAD_PROCESS_EVERY == 0) {
+      if(squidlights_client_process_messages() == -1) {
+	break;
+      }
+      if(squidlights_client_generation() != generation) {
+	generation = squidlights_client_generation();
+	if(find_lights(k, ids) == -1) {
+	  printf("%s lost its lights\n", name);
+	  break;
+	}
+      }
+    }
+    float x = (res.ticks % 100) / 100.0;
+    if(batched) {
+      squidlights_client_frame_begin(clientid);
+    }
+    for(int i = 0; i < n; i++) {
+      if(send_change(clientid, ids[i], x) < 0) {
+	res.errors++;
+      } else {
+	res.sent++;
+      }
+    }
+    if(batched && squidlights_client_frame_commit(clientid) < 0) {
+      res.errors++;
+    }
+    res.ticks++;
+  }
+  res.last_usec = squidlights_client_now();
+  squidlights_client_quit();
+  if(write(ready_fd, &res, sizeof(res)) != sizeof(res)) {
+    exit(1);
+  }
+  exit(0);
+}
+
+/* is it one of prefix0 .. prefix<nlights-1>? */
+static int target_light(const char * name, void * arg) {
+  size_t len = strlen(prefix);
+  char * end;
+  if(strncmp(name, prefix, len) != 0 || name[len] < '0' || name[len] > '9') {
+    return 0;
+  }
+  long j = strtol(name + len, &end, 10);
+  return *end == '\0' && j < nlights;
+}
+
+/*** main ***/
+
+void print_usage(char * name) {
+  printf("usage: %s [-n lights] [-p prefix] [-r hz] [-c clients] [-t seconds] [-m mix] [-u]\n", name);
+  printf("drives prefix0 .. prefix<lights-1> (default null, 16 of them) from some clients\n"
+	 "(default 1, and no more than there are lights), each light changing hz\n"
+	 "times a second (default 100) for some seconds (default 5).  mix is\n"
+	 "kind:weight,... with kinds on, off, set, rgb, hsi and fade (default\n"
+	 "%s).  each client sends a tick's changes as one\n"
+	 "frame, unless -u.  prints the results as JSON.\n", mix_spec);
+}
+
+int main(int argc, char ** argv) {
+  int opt;
+  while((opt = getopt(argc, argv, "n:p:r:c:t:m:u")) != -1) {
+    switch(opt) {
+    case 'n' : nlights = atoi(optarg); break;
+    case 'p' : prefix = optarg; break;
+    case 'r' : hz = atof(optarg); break;
+    case 'c' : nclients = atoi(optarg); break;
+    case 't' : seconds = atof(optarg); break;
+    case 'm' : mix_spec = optarg; break;
+    case 'u' : batched = 0; break;
+    default :
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(nlights < 1 || nclients < 1 || hz <= 0 || hz > 1000000 || seconds <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(nclients > nlights) {
+    printf("%d clients is more than the %d lights; each light has only one client\n", nclients, nlights);
+    return 1;
+  }
+  if(parse_mix(mix_spec) == -1) {
+    return 1;
+  }
+
+  struct sq_bench_snapshot before, after;
+  if(sq_bench_snapshot(&before, target_light, NULL) == -1) {
+    printf("no stats.  is the server running?\n");
+    return 1;
+  }
+  if(before.server_lights < nlights) {
+    printf("only %d of the lights %s0 .. %s%d are there\n", before.server_lights, prefix, prefix, nlights - 1);
+    return 1;
+  }
+
+  /* the clients trace their changes, and keep stdout for the results */
+  setenv(SQ_TRACE_ENV, "1", 1);
+  fflush(stdout);
+  int ready[2], go[2];
+  if(pipe(ready) == -1 || pipe(go) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  for(int k = 0; k < nclients; k++) {
+    pid_t pid = fork();
+    if(pid == -1) {
+      perror("fork");
+      return 1;
+    }
+    if(pid == 0) {
+      dup2(2, 1);
+      close(ready[0]);
+      close(go[1]);
+      run_client(k, ready[1], go[0]);
+    }
+  }
+  close(ready[1]);
+  close(go[0]);
+  int failed = 0;
+  for(int k = 0; k < nclients; k++) {
+    char c;
+    if(read(ready[0], &c, 1) != 1 || c != 'r') {
+      failed = 1;
+    }
+  }
+  if(failed) {
+    close(go[1]);
+    while(wait(NULL) > 0);
+    return 1;
+  }
+  sq_bench_snapshot(&before, target_light, NULL);
+  close(go[1]);
+
+  struct load_result total = {0}, res;
+  total.first_usec = -1;
+  for(int k = 0; k < nclients; k++) {
+    if(read(ready[0], &res, sizeof(res)) != sizeof(res)) {
+      failed++;
+      continue;
+    }
+    total.sent += res.sent;
+    total.errors += res.errors;
+    total.ticks += res.ticks;
+    total.late_ticks += res.late_ticks;
+    if(total.first_usec == -1 || res.first_usec < total.first_usec) total.first_usec = res.first_usec;
+    if(res.last_usec > total.last_usec) total.last_usec = res.last_usec;
+  }
+  while(wait(NULL) > 0);
+
+  sq_bench_settle(&before, &after, target_light, NULL);
+  sq_bench_since(&after, &before);
+  double elapsed = total.last_usec > total.first_usec ? (total.last_usec - total.first_usec) / 1e6 : 0;
+  struct sq_trace_hist * lat = &after.latency;
+  long long unaccounted = (long long)total.sent - (long long)after.handled - (long long)after.coalesced;
+
+  printf("{\"lights\": %d, \"clients\": %d, \"hz\": %g, \"mix\": \"%s\", \"batched\": %d, "
+	 "\"seconds\": %.3f, \"sent\": %llu, \"send_errors\": %llu, \"late_ticks\": %llu, "
+	 "\"failed_clients\": %d, \"sent_per_sec\": %.1f, \"server_in\": %llu, \"server_out\": %llu, "
+	 "\"coalesced\": %llu, \"dropped_batches\": %llu, \"handled\": %llu, \"handled_per_sec\": %.1f, "
+	 "\"unaccounted\": %lld, \"latency_us\": {\"count\": %llu, \"p50\": %.1f, \"p90\": %.1f, "
+	 "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+	 nlights, nclients, hz, mix_spec, batched, elapsed, total.sent, total.errors, total.late_ticks,
+	 failed, elapsed > 0 ? total.sent / elapsed : 0, after.server_in, after.server_out,
+	 after.coalesced, after.dropped, after.handled, elapsed > 0 ? after.handled / elapsed : 0,
+	 unaccounted, lat->count, sq_trace_quantile(lat, 0.5) / 1000.0, sq_trace_quantile(lat, 0.9) / 1000.0,
+	 sq_trace_quantile(lat, 0.99) / 1000.0, sq_trace_quantile(lat, 0.999) / 1000.0, lat->max / 1000.0);
+  return failed || total.sent == 0;
+}
@@ -0,0 +1,417 @@
+/* replays a recording (server -o file) into the server, for
+   benchmarks on traffic as it really comes.
+
+     sqreplay names file    lists the lights in it, for nulllight
+     sqreplay play file     plays it
+
+   Changes go out as they were recorded: each run of changes from one
+   client close together in time (-g, 20us by default) is a frame, sent
+   at the time it was taken, or speed times faster (-s), or as fast as
+   possible (-f).  They go traced, and afterwards it reads the stats and
+   trace pages (see sqbench.h) and prints one line of JSON: how late
+   frames went out, how long they took to the server, in the server, to
+   the light process and in its handlers, and the whole trip per light.
+   With -b it also compares with an earlier run's JSON. */
+
+#include "protocol.h"
+#include "sqrecord.h"
+#include "sqbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REPLAY_CONNECT_SEC 5 /* for the lights to show up */
+#define REPLAY_PROCESS_EVERY 64 /* frames between reading the server's messages */
+#define REPLAY_MAX_LIGHTS 0x10000 /* recorded ids are 16 bits */
+#define REPLAY_NAME_LEN 32
+
+static struct sq_record_header * recording;
+static size_t recording_size;
+static struct sq_record * records;
+static unsigned long long nrecords;
+
+/* the names of the lights in the recording, each once */
+static char (*names)[REPLAY_NAME_LEN + 1];
+static int nnames = 0;
+
+int open_recording(char * file) {
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) == -1) {
+    perror(file);
+    return -1;
+  }
+  recording_size = st.st_size;
+  if(recording_size < sizeof(struct sq_record_header)) {
+    printf("%s is too short to be a recording\n", file);
+    close(fd);
+    return -1;
+  }
+  recording = mmap(NULL, recording_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(recording == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  if(memcmp(recording->magic, SQ_RECORD_MAGIC, sizeof(SQ_RECORD_MAGIC)) != 0
+     || recording->record_size != SQ_RECORD_SIZE) {
+    printf("%s isn't a recording (or is from another version)\n", file);
+    return -1;
+  }
+  /* a recording cut short has fewer records than it says */
+  records = (struct sq_record *)(recording + 1);
+  nrecords = (recording_size - sizeof(struct sq_record_header)) / SQ_RECORD_SIZE;
+  if(recording->count < nrecords) {
+    nrecords = recording->count;
+  }
+  madvise(recording, recording_size, MADV_SEQUENTIAL);
+
+  names = malloc(REPLAY_MAX_LIGHTS * sizeof(names[0]));
+  for(unsigned long long i = 0; i < nrecords; i += 1 + records[i].more) {
+    struct sq_record * r = &records[i];
+    if(r->type == SQ_LIGHT_SET_NAME && r->v[0] == 1 && r->more >= 1 && i + 1 < nrecords) {
+      char name[REPLAY_NAME_LEN + 1];
+      int k;
+      snprintf(name, sizeof(name), "%.*s", REPLAY_NAME_LEN, (char *)(r + 1));
+      for(k = 0; k < nnames && strcmp(names[k], name) != 0; k++);
+      if(k == nnames && nnames < REPLAY_MAX_LIGHTS) {
+	strcpy(names[nnames++], name);
+      }
+    }
+  }
+  return 0;
+}
+
+static int recorded_light(const char * name, void * arg) {
+  for(int k = 0; k < nnames; k++) {
+    if(strcmp(names[k], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*** playing ***/
+
+static double speed = 1; /* 0 for as fast as possible */
+static long long group_usec = 20;
+
+static volatile sig_atomic_t playing;
+
+void replay_sigint_handler(int sig) {
+  playing = 0;
+}
+
+static void sleep_until(long long usec) {
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  while(playing && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+struct replay_result {
+  unsigned long long frames, changes, skipped;
+  long long first_usec, last_usec;
+  struct sq_trace_hist late; /* frames' send time after their due time, in ns */
+};
+
+static int send_change(int clientid, int light, struct sq_record * r) {
+  switch(r->type) {
+  case SQ_LIGHT_ON : return squidlights_client_light_on(clientid, light);
+  case SQ_LIGHT_OFF : return squidlights_client_light_off(clientid, light);
+  case SQ_LIGHT_BRIGHTNESS : return squidlights_client_light_set(clientid, light, r->v[0]);
+  case SQ_LIGHT_RGB : return squidlights_client_light_rgb(clientid, light, r->v[0], r->v[1], r->v[2]);
+  case SQ_LIGHT_HSI : return squidlights_client_light_hsi(clientid, light, r->v[0], r->v[1], r->v[2]);
+  case SQ_LIGHT_FADE : return squidlights_client_light_fade(clientid, light, r->v[0], r->v[1]);
+  default : return SQ_UNDEFINED_LIGHT;
+  }
+}
+
+/* recorded id -> name -> light id now */
+static void find_lights(int * ids, int * name_of) {
+  for(int id = 0; id < REPLAY_MAX_LIGHTS; id++) {
+    ids[id] = name_of[id] == -1 ? -1 : squidlights_client_getlight(names[name_of[id]]);
+  }
+}
+
+void play(int clientid, struct replay_result * res) {
+  int * ids = malloc(REPLAY_MAX_LIGHTS * sizeof(int));
+  int * name_of = malloc(REPLAY_MAX_LIGHTS * sizeof(int));
+  unsigned long long * in_frame = calloc(REPLAY_MAX_LIGHTS, sizeof(unsigned long long));
+  unsigned int generation = squidlights_client_generation();
+  unsigned long long i = 0;
+  long long first = -1, start = squidlights_client_now();
+  for(int id = 0; id < REPLAY_MAX_LIGHTS; id++) {
+    name_of[id] = -1;
+    ids[id] = -1;
+  }
+  res->first_usec = start;
+  playing = 1;
+  while(playing && i < nrecords) {
+    struct sq_record * r = &records[i];
+    if(r->type == SQ_LIGHT_SET_NAME) {
+      int k = -1;
+      if(r->v[0] == 1 && r->more >= 1 && i + 1 < nrecords) {
+	char name[REPLAY_NAME_LEN + 1];
+	snprintf(name, sizeof(name), "%.*s", REPLAY_NAME_LEN, (char *)(r + 1));
+	for(k = 0; k < nnames && strcmp(names[k], name) != 0; k++);
+	if(k == nnames) k = -1;
+      }
+      name_of[r->light] = k;
+      ids[r->light] = k == -1 ? -1 : squidlights_client_getlight(names[k]);
+    }
+    if(r->type < SQ_LIGHT_ON || r->type == SQ_LIGHT_SET_NAME) {
+      i += 1 + r->more;
+      continue;
+    }
+
+    /* a frame: this change, and the ones close after it from the same
+       client, up to a second change to a light (which the frame would
+       write over the first) */
+    if(first == -1) {
+      first = r->usec;
+    }
+    if(speed > 0) {
+      long long due = start + (long long)((r->usec - first) / speed);
+      long long now = squidlights_client_now();
+      if(now < due) {
+	sleep_until(due);
+	now = squidlights_client_now();
+      }
+      sq_trace_add(&res->late, (now - due) * 1000);
+    }
+    if(res->frames % REPLAY_PROCESS_EVERY == 0) {
+      if(squidlights_client_process_messages() == -1) {
+	break;
+      }
+      if(squidlights_client_generation() != generation) {
+	generation = squidlights_client_generation();
+	find_lights(ids, name_of);
+      }
+    }
+    long long frame_usec = r->usec;
+    int frame_client = r->clientid;
+    squidlights_client_frame_begin(clientid);
+    while(i < nrecords && r->type != SQ_LIGHT_SET_NAME && r->clientid == frame_client
+	  && r->usec - frame_usec <= group_usec && in_frame[r->light] != res->frames + 1) {
+      in_frame[r->light] = res->frames + 1;
+      if(r->type >= SQ_LIGHT_ON && ids[r->light] != -1 && send_change(clientid, ids[r->light], r) >= 0) {
+	res->changes++;
+      } else {
+	res->skipped++;
+      }
+      i += 1 + r->more;
+      r = &records[i];
+    }
+    squidlights_client_frame_commit(clientid);
+    res->frames++;
+  }
+  res->last_usec = squidlights_client_now();
+  free(ids);
+  free(name_of);
+  free(in_frame);
+}
+
+/*** the results ***/
+
+/* what gets printed, and compared with -b */
+#define REPLAY_MAX_METRICS 64
+static struct {
+  char name[48];
+  double value;
+  int lower_is_better; /* 0 if it isn't a time */
+} metrics[REPLAY_MAX_METRICS];
+static int nmetrics = 0;
+
+static void metric(const char * key, double value, int lower_is_better) {
+  if(nmetrics < REPLAY_MAX_METRICS) {
+    strcpy(metrics[nmetrics].name, key);
+    metrics[nmetrics].value = value;
+    metrics[nmetrics].lower_is_better = lower_is_better;
+    nmetrics++;
+  }
+}
+
+static void hist_metrics(const char * key, struct sq_trace_hist * h) {
+  static const double qs[] = {0.5, 0.9, 0.99, 0.999};
+  static const char * const qnames[] = {"p50", "p90", "p99", "p999"};
+  char name[48];
+  for(int k = 0; k < 4; k++) {
+    snprintf(name, sizeof(name), "%s_%s_us", key, qnames[k]);
+    metric(name, h->count ? sq_trace_quantile(h, qs[k]) / 1000.0 : 0, 1);
+  }
+  snprintf(name, sizeof(name), "%s_max_us", key);
+  metric(name, h->max / 1000.0, 1);
+}
+
+/* prints how this run compares with the JSON in file.  returns 1 if a
+   time is worse by more than worse_pct percent (if that's >= 0). */
+int compare(char * file, double worse_pct) {
+  FILE * f = fopen(file, "r");
+  char baseline[65536];
+  size_t len;
+  int regressed = 0;
+  if(f == NULL) {
+    perror(file);
+    return 1;
+  }
+  len = fread(baseline, 1, sizeof(baseline) - 1, f);
+  baseline[len] = '\0';
+  fclose(f);
+  fprintf(stderr, "%-24s %12s %12s %9s\n", "", "baseline", "now", "change");
+  for(int k = 0; k < nmetrics; k++) {
+    char key[sizeof(metrics[0].name) + 4];
+    key[0] = '"';
+    strcpy(key + 1, metrics[k].name);
+    strcat(key, "\":");
+    char * at = strstr(baseline, key);
+    if(at == NULL) {
+      continue;
+    }
+    double was = strtod(at + strlen(key), NULL), now = metrics[k].value;
+    double change = was != 0 ? 100 * (now - was) / was : 0;
+    int worse = metrics[k].lower_is_better && worse_pct >= 0 && change > worse_pct;
+    fprintf(stderr, "%-24s %12.1f %12.1f %+8.1f%%%s\n", metrics[k].name, was, now, change,
+	    worse ? "  worse" : "");
+    regressed |= worse;
+  }
+  return regressed;
+}
+
+/*** main ***/
+
+void print_usage(char * name) {
+  printf("usage: %s names file\n", name);
+  printf("       %s play [-f] [-s speed] [-g usec] [-b baseline.json [-x pct]] file\n", name);
+  printf("plays a recording made with server -o into the server, at the speed it was\n"
+	 "recorded, or speed times faster, or (-f) as fast as it can, and prints the\n"
+	 "results as JSON.  changes from a client within usec (default 20) of each\n"
+	 "other go as one frame.  with -b, compares with an earlier run's results,\n"
+	 "and with -x, exits with 2 if a time is more than pct percent worse.\n");
+}
+
+int main(int argc, char ** argv) {
+  char * baseline = NULL;
+  double worse_pct = -1;
+  int opt;
+  if(argc == 3 && strcmp(argv[1], "names") == 0) {
+    if(open_recording(argv[2])) return 1;
+    for(int k = 0; k < nnames; k++) {
+      printf("%s\n", names[k]);
+    }
+    return 0;
+  }
+  if(argc < 3 || strcmp(argv[1], "play") != 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  optind = 2;
+  while((opt = getopt(argc, argv, "fs:g:b:x:")) != -1) {
+    switch(opt) {
+    case 'f' : speed = 0; break;
+    case 's' : speed = atof(optarg); break;
+    case 'g' : group_usec = atoll(optarg); break;
+    case 'b' : baseline = optarg; break;
+    case 'x' : worse_pct = atof(optarg); break;
+    default :
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind != argc - 1 || speed < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(open_recording(argv[optind])) {
+    return 1;
+  }
+
+  /* the results go to stdout, everything else to stderr */
+  fflush(stdout);
+  int results = dup(1);
+  dup2(2, 1);
+
+  setenv(SQ_TRACE_ENV, "1", 1);
+  if(squidlights_client_initialize() == -1) {
+    printf("Something's wrong\n");
+    exit(1);
+  }
+  int clientid = squidlights_client_connect("sqreplay");
+  if(clientid < 0) {
+    printf("couldn't connect\n");
+    exit(1);
+  }
+  long long give_up = squidlights_client_now() + REPLAY_CONNECT_SEC * 1000000LL;
+  int missing;
+  do {
+    usleep(10000);
+    squidlights_client_process_messages();
+    missing = 0;
+    for(int k = 0; k < nnames; k++) {
+      missing += squidlights_client_getlight(names[k]) == SQ_UNDEFINED_LIGHT;
+    }
+  } while(missing > 0 && squidlights_client_now() < give_up);
+  if(missing > 0) {
+    printf("%d of the %d lights aren't there; their changes will be skipped\n", missing, nnames);
+  }
+
+  struct sq_bench_snapshot before, after;
+  struct replay_result res;
+  memset(&res, 0, sizeof(res));
+  if(sq_bench_snapshot(&before, recorded_light, NULL) == -1) {
+    printf("no stats.  is the server running?\n");
+    exit(1);
+  }
+  struct sigaction sa;
+  sa.sa_handler = replay_sigint_handler;
+  sa.sa_flags = 0;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  play(clientid, &res);
+  squidlights_client_quit();
+  sq_bench_settle(&before, &after, recorded_light, NULL);
+  sq_bench_since(&after, &before);
+
+  double elapsed = (res.last_usec - res.first_usec) / 1e6;
+  metric("records", nrecords, 0);
+  metric("lights", nnames, 0);
+  metric("frames", res.frames, 0);
+  metric("changes", res.changes, 0);
+  metric("skipped", res.skipped, 0);
+  metric("seconds", elapsed, 0);
+  metric("frames_per_sec", elapsed > 0 ? res.frames / elapsed : 0, 0);
+  metric("changes_per_sec", elapsed > 0 ? res.changes / elapsed : 0, 0);
+  metric("server_in", after.server_in, 0);
+  metric("server_out", after.server_out, 0);
+  metric("coalesced", after.coalesced, 0);
+  metric("dropped_batches", after.dropped, 0);
+  metric("handled", after.handled, 0);
+  metric("loop_avg_us", after.loops ? after.loop_ns / 1000.0 / after.loops : 0, 1);
+  if(speed > 0) {
+    hist_metrics("send_late", &res.late);
+  }
+  hist_metrics("to_server", &after.stages[SQ_TRACE_TO_SERVER]);
+  hist_metrics("in_server", &after.stages[SQ_TRACE_IN_SERVER]);
+  hist_metrics("to_light", &after.stages[SQ_TRACE_TO_LIGHT]);
+  hist_metrics("handler", &after.stages[SQ_TRACE_HANDLER]);
+  hist_metrics("latency", &after.latency);
+
+  FILE * out = fdopen(results, "w");
+  fprintf(out, "{\"file\": \"%s\", \"speed\": %g", argv[optind], speed);
+  for(int k = 0; k < nmetrics; k++) {
+    fprintf(out, ", \"%s\": %.*f", metrics[k].name, metrics[k].value == (long long)metrics[k].value ? 0
+	    : metrics[k].value < 10 ? 3 : 1,
+	    metrics[k].value);
+  }
+  fprintf(out, "}\n");
+  fclose(out);
+  if(baseline != NULL && compare(baseline, worse_pct)) {
+    return 2;
+  }
+  return 0;
+}
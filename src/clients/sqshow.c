@@ -0,0 +1,373 @@
+/* compiles and plays shows (see sqshow.h)
+
+   A cue list has one change per line:
+
+     (time) (lightname) on|off|set|rgb|hsi|fade (values...)
+
+   with the values as sqlights takes them, and time in seconds, or
+   m:ss.s, or h:mm:ss.s.  Blank lines and lines starting with # are
+   skipped.  The cues don't have to be in order.
+
+   Playing sends each change ahead of time with its time attached
+   (squidlights_client_at), so the server puts it out on the dot, and
+   the changes due at the same moment go in one frame.  Once playing
+   starts, nothing is allocated. */
+
+#include "protocol.h"
+#include "sqshow.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHOW_LOOKAHEAD_USEC 100000 /* how far ahead changes are sent */
+#define SHOW_POLL_USEC 50000 /* longest nap between looking at the clock */
+
+void print_usage(char * prgname) {
+  printf("usage: %s\n"
+	 "\tcompile (cuelist) (showfile)\n"
+	 "\tplay (showfile) [start seconds]\n"
+	 "\tinfo (showfile)\n",
+	 prgname);
+}
+
+/*** compiling ***/
+
+/* seconds, m:ss or h:mm:ss, into msec.  -1 if it isn't a time. */
+static long parse_time(char * s) {
+  double t = 0;
+  char * end;
+  for(;;) {
+    double part = strtod(s, &end);
+    if(end == s || part < 0) {
+      return -1;
+    }
+    t = t * 60 + part;
+    if(*end != ':') break;
+    s = end + 1;
+  }
+  if(*end != '\0') {
+    return -1;
+  }
+  return (long)(t * 1000 + 0.5);
+}
+
+static struct sq_show_event * sort_events;
+
+/* by time, then by where they were in the cue list */
+static int cmp_events(const void * a, const void * b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  if(sort_events[x].msec != sort_events[y].msec) {
+    return sort_events[x].msec < sort_events[y].msec ? -1 : 1;
+  }
+  return x - y;
+}
+
+int compile_show(char * cuefile, char * showfile) {
+  FILE * in = fopen(cuefile, "r");
+  if(in == NULL) {
+    perror(cuefile);
+    return -1;
+  }
+  char line[512];
+  char (*names)[SQ_SHOW_NAME_LEN] = NULL;
+  struct sq_show_event * events = NULL;
+  int nnames = 0, names_cap = 0, nevents = 0, events_cap = 0, lineno = 0;
+  while(fgets(line, sizeof(line), in) != NULL) {
+    lineno++;
+    char * tok[6];
+    int n = 0;
+    for(char * t = strtok(line, " \t\r\n"); t != NULL && n < 6; t = strtok(NULL, " \t\r\n")) {
+      tok[n++] = t;
+    }
+    if(n == 0 || tok[0][0] == '#') {
+      continue;
+    }
+    struct sq_show_event e;
+    static const struct { char * name; int type; int nvals; } cmds[] = {
+      {"on", SQ_LIGHT_ON, 0}, {"off", SQ_LIGHT_OFF, 0}, {"set", SQ_LIGHT_BRIGHTNESS, 1},
+      {"rgb", SQ_LIGHT_RGB, 3}, {"hsi", SQ_LIGHT_HSI, 3}, {"fade", SQ_LIGHT_FADE, 2},
+    };
+    int c = -1;
+    for(int k = 0; n >= 3 && k < 6; k++) {
+      if(strcmp(tok[2], cmds[k].name) == 0) c = k;
+    }
+    long msec = n >= 3 ? parse_time(tok[0]) : -1;
+    if(c == -1 || msec < 0 || n != 3 + cmds[c].nvals || strlen(tok[1]) >= SQ_SHOW_NAME_LEN) {
+      printf("%s:%d: can't make sense of this\n", cuefile, lineno);
+      fclose(in);
+      return -1;
+    }
+    memset(&e, 0, sizeof(e));
+    e.msec = msec;
+    e.type = cmds[c].type;
+    for(int k = 0; k < cmds[c].nvals; k++) {
+      e.v[k] = (float)atof(tok[3 + k]);
+    }
+    int light;
+    for(light = 0; light < nnames && strcmp(names[light], tok[1]) != 0; light++)
+      ;
+    if(light == nnames) {
+      if(nnames == 0xFFFF) {
+	printf("%s:%d: too many lights\n", cuefile, lineno);
+	fclose(in);
+	return -1;
+      }
+      if(nnames == names_cap) {
+	names_cap = names_cap ? 2*names_cap : 64;
+	names = realloc(names, names_cap * SQ_SHOW_NAME_LEN);
+      }
+      memset(names[nnames], 0, SQ_SHOW_NAME_LEN);
+      strcpy(names[nnames++], tok[1]);
+    }
+    e.light = light;
+    if(nevents == events_cap) {
+      events_cap = events_cap ? 2*events_cap : 1024;
+      events = realloc(events, events_cap * sizeof(struct sq_show_event));
+    }
+    if(names == NULL || events == NULL) {
+      perror("sqshow.c, realloc");
+      exit(1);
+    }
+    events[nevents++] = e;
+  }
+  fclose(in);
+
+  /* cues at the same time stay in the order written */
+  int * order = malloc((nevents + 1) * sizeof(int));
+  struct sq_show_event * sorted = malloc((nevents + 1) * sizeof(struct sq_show_event));
+  if(order == NULL || sorted == NULL) {
+    perror("sqshow.c, malloc");
+    exit(1);
+  }
+  for(int k = 0; k < nevents; k++) {
+    order[k] = k;
+  }
+  sort_events = events;
+  qsort(order, nevents, sizeof(int), cmp_events);
+  for(int k = 0; k < nevents; k++) {
+    sorted[k] = events[order[k]];
+  }
+  free(order);
+  free(events);
+  events = sorted;
+
+  struct sq_show_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SQ_SHOW_MAGIC, sizeof(SQ_SHOW_MAGIC));
+  h.nlights = nnames;
+  h.nevents = nevents;
+  h.length_msec = nevents > 0 ? events[nevents-1].msec : 0;
+  FILE * out = fopen(showfile, "wb");
+  if(out == NULL) {
+    perror(showfile);
+    return -1;
+  }
+  if(fwrite(&h, sizeof(h), 1, out) != 1
+     || fwrite(names, SQ_SHOW_NAME_LEN, nnames, out) != (size_t)nnames
+     || fwrite(events, sizeof(struct sq_show_event), nevents, out) != (size_t)nevents
+     || fclose(out) != 0) {
+    perror(showfile);
+    return -1;
+  }
+  printf("%d cues for %d lights, %u:%06.3f long\n", nevents, nnames,
+	 h.length_msec / 60000, (h.length_msec % 60000) / 1000.0);
+  free(names);
+  free(events);
+  return 0;
+}
+
+/*** playing ***/
+
+static struct sq_show_header * show;
+static size_t show_size;
+
+/* maps showfile in and checks it over */
+int open_show(char * showfile) {
+  int fd = open(showfile, O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) == -1) {
+    perror(showfile);
+    return -1;
+  }
+  show_size = st.st_size;
+  if(show_size < sizeof(struct sq_show_header)) {
+    printf("%s is too short to be a show\n", showfile);
+    close(fd);
+    return -1;
+  }
+  show = mmap(NULL, show_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(show == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  if(memcmp(show->magic, SQ_SHOW_MAGIC, sizeof(SQ_SHOW_MAGIC)) != 0) {
+    printf("%s isn't a show (or is from an older sqshow)\n", showfile);
+    return -1;
+  }
+  if(show_size != sizeof(struct sq_show_header) + (size_t)show->nlights * SQ_SHOW_NAME_LEN
+     + (size_t)show->nevents * sizeof(struct sq_show_event)) {
+    printf("%s is the wrong size for its header\n", showfile);
+    return -1;
+  }
+  /* play_show trusts these, so a bad file is caught here */
+  struct sq_show_event * events = sq_show_events(show);
+  for(unsigned int i = 0; i < show->nevents; i++) {
+    struct sq_show_event * e = &events[i];
+    int known = (e->type >= SQ_LIGHT_ON && e->type <= SQ_LIGHT_HSI) || e->type == SQ_LIGHT_FADE;
+    if(e->light >= show->nlights || !known || (i > 0 && e->msec < events[i-1].msec)) {
+      printf("%s: cue %u is bad (light %u, type %u, at %ums)\n", showfile, i, e->light, e->type, e->msec);
+      return -1;
+    }
+  }
+  madvise(show, show_size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+static volatile sig_atomic_t playing;
+
+void play_sigint_handler(int sig) {
+  playing = 0;
+}
+
+/* looks up the show's lights by name.  ids[k] is -1 if there's no
+   such light right now. */
+static void find_lights(int * ids, int complain) {
+  for(unsigned int k = 0; k < show->nlights; k++) {
+    char name[SQ_SHOW_NAME_LEN + 1];
+    memcpy(name, sq_show_name(show, k), SQ_SHOW_NAME_LEN);
+    name[SQ_SHOW_NAME_LEN] = '\0';
+    ids[k] = squidlights_client_getlight(name);
+    if(ids[k] == SQ_UNDEFINED_LIGHT) {
+      ids[k] = -1;
+      if(complain) {
+	printf("no light \"%s\" (skipping its cues)\n", name);
+      }
+    }
+  }
+}
+
+static void stage(int clientid, struct sq_show_event * e, int lightid) {
+  switch(e->type) {
+  case SQ_LIGHT_ON : squidlights_client_light_on(clientid, lightid); break;
+  case SQ_LIGHT_OFF : squidlights_client_light_off(clientid, lightid); break;
+  case SQ_LIGHT_BRIGHTNESS : squidlights_client_light_set(clientid, lightid, e->v[0]); break;
+  case SQ_LIGHT_RGB : squidlights_client_light_rgb(clientid, lightid, e->v[0], e->v[1], e->v[2]); break;
+  case SQ_LIGHT_HSI : squidlights_client_light_hsi(clientid, lightid, e->v[0], e->v[1], e->v[2]); break;
+  case SQ_LIGHT_FADE : squidlights_client_light_fade(clientid, lightid, e->v[0], e->v[1]); break;
+  }
+}
+
+int play_show(int clientid, double start_sec) {
+  struct sq_show_event * events = sq_show_events(show);
+  unsigned int n = show->nevents, i = 0;
+  int * ids = malloc((show->nlights + 1) * sizeof(int)); /* the last allocation */
+  unsigned int gen = squidlights_client_generation();
+  long long start_msec = (long long)(start_sec * 1000);
+  if(ids == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  find_lights(ids, 1);
+  /* find where to start */
+  unsigned int lo = 0, hi = n;
+  while(lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if(events[mid].msec < start_msec) lo = mid + 1;
+    else hi = mid;
+  }
+  i = lo;
+
+  struct sigaction sa;
+  sa.sa_handler = play_sigint_handler;
+  sa.sa_flags = 0;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+
+  printf("playing %u cues from %.3fs\n", n - i, start_sec);
+  long long base = squidlights_client_now() + SHOW_LOOKAHEAD_USEC - start_msec * 1000;
+  playing = 1;
+  while(playing && i < n) {
+    long long horizon = squidlights_client_now() + SHOW_LOOKAHEAD_USEC;
+    while(i < n && base + events[i].msec * 1000LL <= horizon) {
+      /* everything at this moment goes in one frame */
+      unsigned int t = events[i].msec;
+      squidlights_client_at(base + t * 1000LL);
+      squidlights_client_frame_begin(clientid);
+      for(; i < n && events[i].msec == t; i++) {
+	if(ids[events[i].light] != -1) {
+	  stage(clientid, &events[i], ids[events[i].light]);
+	}
+      }
+      squidlights_client_frame_commit(clientid);
+    }
+    squidlights_client_at(0);
+    if(squidlights_client_process_messages() == -1) {
+      printf("lost the server\n");
+      break;
+    }
+    if(squidlights_client_generation() != gen) {
+      gen = squidlights_client_generation();
+      find_lights(ids, 0);
+    }
+    if(i < n) {
+      long long wait = base + events[i].msec * 1000LL - SHOW_LOOKAHEAD_USEC - squidlights_client_now();
+      if(wait > SHOW_POLL_USEC) wait = SHOW_POLL_USEC;
+      if(wait > 0) usleep(wait);
+    }
+  }
+  if(i == n) {
+    /* let the last ones go out before saying goodbye */
+    long long wait = n == 0 ? 0 : base + events[n-1].msec * 1000LL + SHOW_POLL_USEC - squidlights_client_now();
+    if(wait > 0) usleep(wait);
+    printf("done\n");
+  } else {
+    printf("stopped at %.3fs\n", events[i].msec / 1000.0);
+  }
+  free(ids);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc >= 4 && strcmp(argv[1], "compile") == 0) {
+    return compile_show(argv[2], argv[3]) ? 1 : 0;
+  }
+  if(argc >= 3 && strcmp(argv[1], "info") == 0) {
+    if(open_show(argv[2])) return 1;
+    printf("%u cues for %u lights, %u:%06.3f long\n", show->nevents, show->nlights,
+	   show->length_msec / 60000, (show->length_msec % 60000) / 1000.0);
+    for(unsigned int k = 0; k < show->nlights; k++) {
+      printf("%.*s ", SQ_SHOW_NAME_LEN, sq_show_name(show, k));
+    }
+    printf("\n");
+    return 0;
+  }
+  if(argc < 3 || strcmp(argv[1], "play") != 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(open_show(argv[2])) {
+    return 1;
+  }
+
+  if(squidlights_client_initialize() == -1) {
+    printf("Something's wrong\n");
+    exit(1);
+  }
+  int clientid = squidlights_client_connect("sqshow");
+  if(clientid < 0) {
+    printf("couldn't connect\n");
+    exit(1);
+  }
+  squidlights_client_process_messages();
+  play_show(clientid, argc > 3 ? atof(argv[3]) : 0);
+
+  printf("\nquitting... ");
+  squidlights_client_quit();
+  return 0;
+}
@@ -14,7 +14,7 @@ int main(void) {
   int clientid = squidlights_client_connect("testclient");
   squidlights_client_process_messages(); {
     printf("Lights:\n");
-    for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
+    for(int i = 0; i < squidlights_client_num_lights(); i++) {
       char* lightname = squidlights_client_lightname(i);
       if(lightname[0] != '\0') {
  	printf("%d. %s\n", i, lightname);
@@ -1,6 +1,10 @@
 /* generic code for supporting a light server */
 
 #include "protocol.h"
+#include "shmring.h"
+#include "sqtrace.h"
+#include "sqstats.h"
+#include "sqcolor.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,9 +12,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 
 struct light_server {
   char name[32];
@@ -20,11 +28,20 @@ struct light_server {
   void(*brightness_handler)(int lightid, int clientid, float brightness);
   void(*rgb_handler)(int lightid, int clientid, float r, float g, float b);
   void(*hsi_handler)(int lightid, int clientid, float h, float s, float i);
+  void(*fade_handler)(int lightid, int clientid, float brightness, float seconds);
+  unsigned long long changes_in; /* handled, for the stats page */
 };
 
-static struct light_server light_servers[256];
+static struct light_server * light_servers;
+static int light_servers_cap = 0; /* grows as lights connect */
 static int unused_light_server_id = 0;
 
+static float clamp(float x) {
+  if(!(x > 0)) return 0; /* NaN too */
+  if(x > 1) return 1;
+  return x;
+}
+
 void default_on_handler(int lightid, int clientid) {
   /* does nothing */
   printf("default\n");
@@ -45,17 +62,86 @@ void default_rgb_handler(int lightid, int clientid, float r, float g, float b) {
   /* by default, uses red channel for brightness */
   light_servers[lightid].brightness_handler(lightid, clientid, r);
 }
+
+/* hsi -> rgb, one at a time through the array version in sqcolor.c,
+   so there's only the one to get right */
+void squidlights_hsi_chroma(float h, float s, float * rgb) {
+  sq_color_hsi_to_rgb(&h, &s, NULL, &rgb[0], &rgb[1], &rgb[2], 1);
+}
+
+void squidlights_hsi_to_rgb(float h, float s, float i, float * r, float * g, float * b) {
+  sq_color_hsi_to_rgb(&h, &s, &i, r, g, b, 1);
+}
+
 void default_hsi_handler(int lightid, int clientid, float h, float s, float i) {
-  /* by default, just runs rgb handler */
-  //float angle = 2 * M_PI * h;
-  printf("should implement default hsi handler (in lights.c) to convert to rgb\n");
-  exit(1);
+  /* by default, converts to rgb and runs the rgb handler */
+  float r, g, b;
+  squidlights_hsi_to_rgb(h, s, i, &r, &g, &b);
+  light_servers[lightid].rgb_handler(lightid, clientid, r, g, b);
 }
 
 static int light_msqid; /* the msg queue for the lights in this process */
 
+/* with SQUIDLIGHTS_TRANSPORT=shm the server sends to us over this ring
+   instead of light_msqid */
+static struct sq_ring * light_ring;
+static char light_ring_name[64];
+static char light_ring_offered = 0;
+
+/* with SQUIDLIGHTS_TRANSPORT=socket everything goes over this instead */
+static int light_sock = -1;
+
 static volatile sig_atomic_t lights_keep_running;
 
+/* the stats page (see sqstats.h), which grows as lights connect */
+static struct sq_stats_lights * stats_page;
+static size_t stats_page_size;
+static char stats_name[64];
+/* the lights the message being handled has changed.  their counts go
+   to the page together with the message's, in one write. */
+static int stats_touched[SQ_BATCH_MAX];
+static int stats_ntouched = 0;
+
+static size_t stats_size(int nlights) {
+  return sizeof(struct sq_stats_lights) + nlights * sizeof(struct sq_stats_light);
+}
+
+static void stats_open(void) {
+  sprintf(stats_name, "%s%d", SQ_STATS_LIGHTS_SHM_PREFIX, (int)getpid());
+  stats_page_size = stats_size(0);
+  if((stats_page = sq_page_create(stats_name, stats_page_size)) == NULL) {
+    printf("no stats page, then.\n");
+    return;
+  }
+  stats_page->h.pid = getpid();
+  stats_page->h.islight = 1;
+  stats_page->h.size = stats_page_size;
+  __atomic_store_n(&stats_page->h.magic, SQ_STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* makes room for light lightid on the page */
+static void stats_add_light(int lightid, char * name) {
+  if(stats_page == NULL) {
+    return;
+  }
+  if(stats_size(lightid + 1) > stats_page_size) {
+    size_t size = stats_size(light_servers_cap);
+    struct sq_stats_lights * bigger = sq_page_resize(stats_page, stats_name, stats_page_size, size);
+    if(bigger == NULL) {
+      return;
+    }
+    stats_page = bigger;
+    stats_page_size = size;
+  }
+  struct sq_stats_light * sl = &sq_stats_lights_lights(stats_page)[lightid];
+  sq_stats_write_begin(&stats_page->h);
+  stats_page->h.size = stats_page_size;
+  strcpy(sl->name, name);
+  sl->live = 1;
+  stats_page->nlights = lightid + 1;
+  sq_stats_write_end(&stats_page->h);
+}
+
 void lights_sigint_handler(int sig) {
   lights_keep_running = 0;
 }
@@ -68,6 +154,14 @@ int squidlights_light_initialize(void) {
     exit(1);
   }
 
+  if(sq_transport_from_env() == SQ_TRANSPORT_SHM) {
+    sprintf(light_ring_name, "/squidlights-l%d", (int)getpid());
+    if((light_ring = sq_ring_create(light_ring_name)) == NULL) {
+      printf("couldn't make a ring.  using message queues.\n");
+    }
+  }
+  stats_open();
+
   struct sigaction sa;
   sa.sa_handler = lights_sigint_handler;
   sa.sa_flags = 0;
@@ -84,9 +178,17 @@ int squidlights_light_initialize(void) {
 static int server_msqid; /* the msg queue to squidlights */
 
 int squidlights_light_connect(char* name) {
-  if(unused_light_server_id == 256) {
-    printf("The dumb programmer didn't support more than 256 lights per process!\n");
-    return SQ_CONNECTION_ERROR;
+  if(unused_light_server_id == light_servers_cap) {
+    /* batches carry 16-bit light ids */
+    int cap = light_servers_cap ? 2*light_servers_cap : 16;
+    struct light_server * bigger;
+    if(cap > 0x10000
+       || (bigger = realloc(light_servers, cap * sizeof(struct light_server))) == NULL) {
+      printf("too many lights in this process!\n");
+      return SQ_CONNECTION_ERROR;
+    }
+    light_servers = bigger;
+    light_servers_cap = cap;
   }
  
   int lightid = unused_light_server_id++;
@@ -98,6 +200,9 @@ int squidlights_light_connect(char* name) {
   light_servers[lightid].brightness_handler = default_brightness_handler;
   light_servers[lightid].rgb_handler = default_rgb_handler;
   light_servers[lightid].hsi_handler = default_hsi_handler;
+  light_servers[lightid].fade_handler = NULL;
+  light_servers[lightid].changes_in = 0;
+  stats_add_light(lightid, name);
 
   /* connect to server */
   /* it's ok this may get called many times */
@@ -107,13 +212,40 @@ int squidlights_light_connect(char* name) {
     return SQ_CONNECTION_ERROR;
   }
 
+  if(sq_transport_from_env() == SQ_TRANSPORT_SOCKET && light_sock == -1) {
+    if((light_sock = sq_socket_connect()) == -1) {
+      return SQ_CONNECTION_ERROR;
+    }
+  }
+
+  /* the ring has to be offered before the first light so the server
+     knows where to send */
+  if(light_ring != NULL && !light_ring_offered) {
+    struct ring_attach_msg ram;
+    ram.mtype = SQ_ATTACH_RING;
+    ram.islight = 1;
+    ram.msqid = light_msqid;
+    strcpy(ram.shmname, light_ring_name);
+    if(msgsnd(server_msqid, &ram, SIZEOF_MSG(struct ring_attach_msg), 0) == -1) {
+      perror("lights.c, attach msgsnd");
+      return SQ_CONNECTION_ERROR;
+    }
+    light_ring_offered = 1;
+  }
+
   /* attach light to server */
   struct light_init_msg msg;
   msg.mtype = SQ_LIGHT_SET_NAME;
   msg.lightid = lightid;
   msg.msqid = light_msqid;
   strcpy(msg.name, name);
-  if(msgsnd(server_msqid, &msg, SIZEOF_MSG(struct light_init_msg), 0) == -1) {
+  msg.pid = getpid();
+  if(light_sock != -1) {
+    if(send(light_sock, &msg, sizeof(struct light_init_msg), MSG_NOSIGNAL) == -1) {
+      perror("lights.c, squidlights send");
+      return SQ_CONNECTION_ERROR;
+    }
+  } else if(msgsnd(server_msqid, &msg, SIZEOF_MSG(struct light_init_msg), 0) == -1) {
     perror("lights.c, squidlights msgsnd");
     return SQ_CONNECTION_ERROR;
   }
@@ -156,59 +288,183 @@ int squidlights_light_add_hsi(int lightid, void(*new_hsi_handler)(int lightid, i
   light_servers[lightid].hsi_handler = new_hsi_handler;
   return 0;
 }
+int squidlights_light_add_fade(int lightid, void(*new_fade_handler)(int lightid, int clientid, float brightness, float seconds)) {
+  light_servers[lightid].fade_handler = new_fade_handler;
+  return 0;
+}
 
-static float clamp(float x) {
-  if(x < 0) return 0;
-  if(x > 1) return 1;
-  return x;
+/* runs the handler for one light change.  v holds the brightness,
+   rgb, or hsi values, depending on type. */
+static void squidlights_handle_light(long type, int lightid, int clientid, float * v) {
+  if(lightid < 0 || lightid >= unused_light_server_id) {
+    printf("no such light %d\n", lightid);
+    return;
+  }
+  struct light_server * ls = &light_servers[lightid];
+  ls->changes_in++;
+  if(stats_ntouched < SQ_BATCH_MAX) {
+    stats_touched[stats_ntouched++] = lightid;
+  }
+  switch(type) {
+  case SQ_LIGHT_ON :
+    ls->on_handler(lightid, clientid);
+    break;
+  case SQ_LIGHT_OFF :
+    ls->off_handler(lightid, clientid);
+    break;
+  case SQ_LIGHT_BRIGHTNESS :
+    ls->brightness_handler(lightid, clientid, clamp(v[0]));
+    break;
+  case SQ_LIGHT_RGB :
+    ls->rgb_handler(lightid, clientid, clamp(v[0]), clamp(v[1]), clamp(v[2]));
+    break;
+  case SQ_LIGHT_HSI :
+    ls->hsi_handler(lightid, clientid, v[0], clamp(v[1]), clamp(v[2]));
+    break;
+  case SQ_LIGHT_FADE :
+    if(ls->fade_handler != NULL) {
+      ls->fade_handler(lightid, clientid, clamp(v[0]), v[1] > 0 ? v[1] : 0);
+    } else {
+      ls->brightness_handler(lightid, clientid, clamp(v[0]));
+    }
+    break;
+  default :
+    printf("ignoring unknown light change %ld\n", type);
+  }
+}
+
+/*** tracing ***/
+
+/* the histograms for traced batches (see sqtrace.h), made when the
+   first one comes */
+static struct sq_trace_page * trace_page;
+static size_t trace_page_size;
+static char trace_name[64];
+static char trace_failed = 0;
+
+static void trace_open(void) {
+  int nlights = unused_light_server_id;
+  trace_page_size = sizeof(struct sq_trace_page) + nlights * sizeof(trace_page->lights[0]);
+  sprintf(trace_name, "%s%d", SQ_TRACE_SHM_PREFIX, (int)getpid());
+  int fd = shm_open(trace_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if(fd == -1 || ftruncate(fd, trace_page_size) == -1) {
+    perror("lights.c, trace shm_open");
+    trace_failed = 1;
+    if(fd != -1) close(fd);
+    return;
+  }
+  trace_page = mmap(NULL, trace_page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(trace_page == MAP_FAILED) {
+    perror("lights.c, trace mmap");
+    trace_page = NULL;
+    trace_failed = 1;
+    shm_unlink(trace_name);
+    return;
+  }
+  trace_page->pid = getpid();
+  trace_page->nlights = nlights;
+  for(int k = 0; k < nlights; k++) {
+    strcpy(trace_page->lights[k].name, light_servers[k].name);
+  }
+  __atomic_store_n(&trace_page->magic, SQ_TRACE_MAGIC, __ATOMIC_RELEASE);
+  printf("tracing latency (%s)\n", trace_name);
+}
+
+static void trace_batch(struct light_traced_batch_msg * tb, long long dispatched, long long done) {
+  if(trace_page == NULL && !trace_failed) {
+    trace_open();
+  }
+  if(trace_page == NULL) {
+    return;
+  }
+  struct sq_trace * t = &tb->trace;
+  sq_trace_add(&trace_page->stages[SQ_TRACE_TO_SERVER], t->received - t->sent);
+  sq_trace_add(&trace_page->stages[SQ_TRACE_IN_SERVER], t->forwarded - t->received);
+  sq_trace_add(&trace_page->stages[SQ_TRACE_TO_LIGHT], dispatched - t->forwarded);
+  sq_trace_add(&trace_page->stages[SQ_TRACE_HANDLER], done - dispatched);
+  sq_trace_add(&trace_page->stages[SQ_TRACE_TOTAL], done - t->sent);
+  /* a light's channels are next to each other in a batch */
+  for(int i = 0; i < tb->count && i < SQ_TRACED_BATCH_MAX; i++) {
+    int lightid = tb->entries[i].lightid;
+    if(lightid < trace_page->nlights && (i == 0 || tb->entries[i-1].lightid != lightid)) {
+      sq_trace_add(&trace_page->lights[lightid].total, done - t->sent);
+    }
+  }
+}
+
+/* says how it went, and takes the histograms away */
+static void trace_close(void) {
+  if(trace_page == NULL) {
+    return;
+  }
+  printf("latency (usec)     p50      p99     p999      max    count\n");
+  for(int k = 0; k < SQ_TRACE_STAGES; k++) {
+    struct sq_trace_hist * h = &trace_page->stages[k];
+    printf("%-14s %8.1f %8.1f %8.1f %8.1f %8llu\n", sq_trace_stage_names[k],
+	   sq_trace_quantile(h, 0.5) / 1000.0, sq_trace_quantile(h, 0.99) / 1000.0,
+	   sq_trace_quantile(h, 0.999) / 1000.0, h->max / 1000.0, h->count);
+  }
+  munmap(trace_page, trace_page_size);
+  trace_page = NULL;
+  shm_unlink(trace_name);
 }
 
 static int squidlights_handle_msg_buf(struct generic_msgbuf * buf) {
   struct light_brightness_msg * lbm_buf;
   struct light_rgb_msg * lrm_buf;
   struct light_hsi_msg * lhm_buf;
+  struct light_fade_msg * lfm_buf;
+  struct light_batch_msg * batch;
+  struct light_traced_batch_msg * traced;
+  long long dispatched, start = sq_trace_now();
+  float v[3];
   switch(buf->mtype) {
   case SQ_LIGHT_ON :
-    if(buf->lightid < 0 || buf->lightid >= unused_light_server_id) {
-      printf("no such light %d\n", buf->lightid);
-    } else {
-      light_servers[buf->lightid].on_handler(buf->lightid, buf->clientid);
-    }
-    break;
   case SQ_LIGHT_OFF :
-    if(buf->lightid < 0 || buf->lightid >= unused_light_server_id) {
-      printf("no such light %d\n", buf->lightid);
-    } else {
-      light_servers[buf->lightid].off_handler(buf->lightid, buf->clientid);
-    }
+    squidlights_handle_light(buf->mtype, buf->lightid, buf->clientid, v);
     break;
   case SQ_LIGHT_BRIGHTNESS :
-    if(buf->lightid < 0 || buf->lightid >= unused_light_server_id) {
-      printf("no such light %d\n", buf->lightid);
-    } else {
-      lbm_buf = (struct light_brightness_msg *) buf;
-      light_servers[lbm_buf->lightid].brightness_handler(lbm_buf->lightid, lbm_buf->clientid,
-							 clamp(lbm_buf->brightness));
-    }
+    lbm_buf = (struct light_brightness_msg *) buf;
+    v[0] = lbm_buf->brightness;
+    squidlights_handle_light(buf->mtype, buf->lightid, buf->clientid, v);
     break;
   case SQ_LIGHT_RGB :
-    if(buf->lightid < 0 || buf->lightid >= unused_light_server_id) {
-      printf("no such light %d\n", buf->lightid);
-    } else {
-      lrm_buf = (struct light_rgb_msg *) buf;
-      light_servers[lrm_buf->lightid].rgb_handler(lrm_buf->lightid, lrm_buf->clientid,
-						  clamp(lrm_buf->r), clamp(lrm_buf->g), clamp(lrm_buf->b));
-    }
+    lrm_buf = (struct light_rgb_msg *) buf;
+    v[0] = lrm_buf->r;
+    v[1] = lrm_buf->g;
+    v[2] = lrm_buf->b;
+    squidlights_handle_light(buf->mtype, buf->lightid, buf->clientid, v);
     break;
   case SQ_LIGHT_HSI :
-    if(buf->lightid < 0 || buf->lightid >= unused_light_server_id) {
-      printf("no such light %d\n", buf->lightid);
-    } else {
-      lhm_buf = (struct light_hsi_msg *) buf;
-      light_servers[lhm_buf->lightid].hsi_handler(lhm_buf->lightid, lhm_buf->clientid,
-						  lhm_buf->h, clamp(lhm_buf->s), clamp(lhm_buf->i));
+    lhm_buf = (struct light_hsi_msg *) buf;
+    v[0] = lhm_buf->h;
+    v[1] = lhm_buf->s;
+    v[2] = lhm_buf->i;
+    squidlights_handle_light(buf->mtype, buf->lightid, buf->clientid, v);
+    break;
+  case SQ_LIGHT_FADE :
+    lfm_buf = (struct light_fade_msg *) buf;
+    v[0] = lfm_buf->brightness;
+    v[1] = lfm_buf->seconds;
+    squidlights_handle_light(buf->mtype, buf->lightid, buf->clientid, v);
+    break;
+  case SQ_LIGHT_BATCH :
+    batch = (struct light_batch_msg *) buf;
+    for(int i = 0; i < batch->count && i < SQ_BATCH_MAX; i++) {
+      squidlights_handle_light(batch->entries[i].type, batch->entries[i].lightid,
+			       batch->clientid, batch->entries[i].v);
     }
     break;
+  case SQ_LIGHT_TRACED_BATCH :
+    dispatched = sq_trace_now();
+    traced = (struct light_traced_batch_msg *) buf;
+    for(int i = 0; i < traced->count && i < SQ_TRACED_BATCH_MAX; i++) {
+      squidlights_handle_light(traced->entries[i].type, traced->entries[i].lightid,
+			       traced->clientid, traced->entries[i].v);
+    }
+    trace_batch(traced, dispatched, sq_trace_now());
+    break;
   case SQ_DIE :
     printf("Server-forced death.\nbllaaarrrrggghhh!!!\n");
     lights_keep_running = 0;
@@ -216,17 +472,146 @@ static int squidlights_handle_msg_buf(struct generic_msgbuf * buf) {
   default :
     printf("ignoring unknown message type %ld\n", buf->mtype);
   }
+  if(stats_page != NULL) {
+    unsigned long long ns = sq_trace_now() - start;
+    sq_stats_write_begin(&stats_page->h);
+    stats_page->msgs_in++;
+    stats_page->handler_ns += ns;
+    if(ns > stats_page->handler_ns_max) {
+      stats_page->handler_ns_max = ns;
+    }
+    stats_page->h.updated_usec = start / 1000;
+    struct sq_stats_light * sl = sq_stats_lights_lights(stats_page);
+    for(int k = 0; k < stats_ntouched; k++) {
+      int id = stats_touched[k];
+      if(id < stats_page->nlights) {
+	sl[id].changes_in = light_servers[id].changes_in;
+      }
+    }
+    sq_stats_write_end(&stats_page->h);
+  }
+  stats_ntouched = 0;
   return 1;
 }
 
+/*** squidlights_lights_fd ***/
+
+/* Programs with an event loop of their own want something to poll.  A
+   socket can be polled as it is, but a message queue or a ring can't,
+   so for those a thread watches for messages and writes a byte to
+   wake_pipe.  With a message queue the thread has to take the
+   messages to see them, so it moves them to inbox. */
+static int wake_pipe[2] = {-1, -1};
+static struct sq_ring * inbox;
+static pthread_t watcher_thread;
+static volatile int watcher_running = 0;
+static volatile int watcher_lost_server = 0;
+
+static void wake(void) {
+  char c = 0;
+  write(wake_pipe[1], &c, 1); /* if the pipe is full, it's awake anyway */
+}
+
+static void * queue_watcher(void * arg) {
+  struct generic_msgbuf buf;
+  while(watcher_running) {
+    if(msgrcv(light_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, 0) == -1) {
+      if(errno == EINTR) continue;
+      if(watcher_running) {
+	perror("lights.c, watcher msgrcv");
+	watcher_lost_server = 1;
+      }
+      break;
+    }
+    sq_ring_push_wait(inbox, &buf, SIZEOF_MSG(struct generic_msgbuf), NULL, -1);
+    wake();
+  }
+  wake();
+  return NULL;
+}
+
+static void * ring_watcher(void * arg) {
+  while(watcher_running) {
+    unsigned int ticket = sq_doorbell_ticket(&light_ring->bell);
+    if(sq_ring_count(light_ring) > 0) {
+      wake();
+    }
+    /* with a timeout, so cleanup can stop us */
+    sq_doorbell_wait(&light_ring->bell, ticket, 100);
+  }
+  return NULL;
+}
+
+int squidlights_lights_fd(void) {
+  sigset_t sigs, oldsigs;
+  if(light_sock != -1) {
+    return light_sock;
+  }
+  if(wake_pipe[0] != -1) {
+    return wake_pipe[0];
+  }
+  if(pipe(wake_pipe) == -1) {
+    perror("lights.c, pipe");
+    return -1;
+  }
+  fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+  if(light_ring == NULL && (inbox = sq_ring_create(NULL)) == NULL) {
+    return -1;
+  }
+  /* ^C is for the main thread */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  watcher_running = 1;
+  if(pthread_create(&watcher_thread, NULL, light_ring != NULL ? ring_watcher : queue_watcher, NULL) != 0) {
+    perror("pthread_create");
+    watcher_running = 0;
+  }
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  wake(); /* in case anything came before */
+  return watcher_running ? wake_pipe[0] : -1;
+}
+
 void squidlights_lights_cleanup(void) {
+  int watching = watcher_running;
   /* cleanup! cleanup! everybody do your share! */
   printf("killing message queue\n");
   
+  watcher_running = 0;
   /* server will detect shutdown of queue */
   if(msgctl(light_msqid, IPC_RMID, NULL) == -1) {
     perror("msgctl");
   }
+  if(watching) {
+    pthread_join(watcher_thread, NULL);
+  }
+  if(light_ring != NULL) {
+    sq_ring_detach(light_ring);
+    sq_ring_unlink(light_ring_name);
+    light_ring = NULL;
+  }
+  if(light_sock != -1) {
+    close(light_sock);
+    light_sock = -1;
+  }
+  trace_close();
+  if(stats_page != NULL) {
+    sq_page_destroy(stats_page, stats_name, stats_page_size);
+    stats_page = NULL;
+  }
+}
+
+/* handles whatever is waiting on a ring.  returns how many. */
+static int handle_ring(struct sq_ring * ring) {
+  struct generic_msgbuf * buf;
+  int n = 0;
+  while(lights_keep_running && (buf = sq_ring_peek(ring)) != NULL) {
+    squidlights_handle_msg_buf(buf);
+    sq_ring_advance(ring);
+    n++;
+  }
+  return n;
 }
 
 void squidlights_light_run(void) {
@@ -236,6 +621,23 @@ void squidlights_light_run(void) {
   
   printf("running...\n");
 
+  while(lights_keep_running && light_ring != NULL) {
+    unsigned int ticket = sq_doorbell_ticket(&light_ring->bell);
+    if(handle_ring(light_ring) == 0) {
+      sq_doorbell_wait(&light_ring->bell, ticket, -1);
+    }
+  }
+
+  while(lights_keep_running && light_sock != -1) {
+    int r = sq_socket_recv(light_sock, &buf, SIZEOF_MSG(struct generic_msgbuf), 1);
+    if(r == 1) {
+      squidlights_handle_msg_buf(&buf);
+    } else if(r == -1) {
+      printf("server disconnected?");
+      lights_keep_running = 0;
+    }
+  }
+
   while(lights_keep_running) {
     if(msgrcv(light_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, 0) == -1) {
       perror("lights.c, run msgrcv");
@@ -257,6 +659,40 @@ int squidlights_lights_handle_init(void) {
 int squidlights_lights_handle(char wait) {
   struct generic_msgbuf buf;
   struct msqid_ds msq;
+  if(wake_pipe[0] != -1) {
+    char junk[64];
+    while(read(wake_pipe[0], junk, sizeof(junk)) > 0);
+  }
+  if(light_ring != NULL) {
+    handle_ring(light_ring);
+  }
+  if(inbox != NULL) {
+    /* the watcher has the queue */
+    handle_ring(inbox);
+    if(watcher_lost_server) {
+      printf("lights deciding to shut down message queue (it went away)\n");
+      squidlights_lights_cleanup();
+      return -1;
+    }
+    if(!lights_keep_running) {
+      printf("lights deciding to shut down message queue (because interrupt)\n");
+      squidlights_lights_cleanup();
+      return -1;
+    }
+    return 0;
+  }
+  if(light_sock != -1) {
+    int r = 0;
+    while(lights_keep_running
+	  && (r = sq_socket_recv(light_sock, &buf, SIZEOF_MSG(struct generic_msgbuf), 0)) == 1) {
+      squidlights_handle_msg_buf(&buf);
+    }
+    if(r == -1) {
+      printf("lights deciding to shut down (server hung up)\n");
+      squidlights_lights_cleanup();
+      return -1;
+    }
+  }
   int ret = msgctl(light_msqid, IPC_STAT, &msq);
   while(ret != -1 && msq.msg_qnum > 0) {
     if(!msgrcv(light_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, wait?0:IPC_NOWAIT)) {
@@ -1,34 +1,157 @@
-/* test light.  Creates two "lights".  The first is on/off, the second
-   is brightness controlled. */
+/* elmolights.c
+   drives networked "elmo" fixtures, which take OSC over UDP.
 
+   usage: elmolights [-r hz] [-k keepalive_sec] [file]
+
+   The file has lines "address name [option...]", where address is a
+   host or host:port (the port defaults to ELMO_UDP_PORT).  Without a
+   file, the two original elmos are used.  The options calibrate what
+   a fixture is sent:
+
+     matrix=a,b,c,d,e,f,g,h,i  multiplies (r,g,b) by this 3x3 matrix
+                               (row by row) to fix its color balance
+     curve=spec                then puts each channel through an
+                               output curve (see sqcurve.h) */
+
+#define _GNU_SOURCE /* sendmmsg */
 #include "protocol.h"
+#include "sqcolor.h"
+#include "sqcurve.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <string.h>
-#include "lo/lo.h"
-#include <math.h>
-#include <sys/time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #define ELMO_UDP_PORT "2222"
 #define ELMO_COMMAND "/light/color/set"
+#define ELMO_MAX_DATAGRAM 1400 /* stay under the ethernet MTU */
+#define ELMO_SEND_BATCH 64 /* datagrams per sendmmsg */
+#define ELMO_KEEPALIVE_SEC 2.0 /* resend unchanged fixtures this often */
+#define ELMO_FRAME_HZ 30 /* output ticks per second */
+#define ELMO_STATS_SEC 10 /* how often to report tick timing */
 
 struct elmo_light_s {
-  lo_address addr;
+  int host; /* index into elmo_hosts */
   int lightid;
   float r, g, b, i; /* always have r+g+b=1, and i is coefficient */
+  char dirty; /* changed since it was last sent */
+  char pending; /* ELMO_PEND_*: a color not yet turned into r, g, b */
+  float pend[3]; /* that color, as rgb or hsi */
+  float * matrix; /* calibration, or NULL */
+  unsigned short * curve; /* output curve to 0..65535, or NULL */
+  double sent_at; /* when it was last sent */
+};
+
+/* grows as fixtures are added */
+static struct elmo_light_s * elmo_lights;
+static int next_handle=0, elmo_lights_cap=0;
+
+/* The handlers just note down the color they were given, and once a
+   tick convert_pending turns all of them into r, g, b with the array
+   kernels from sqcolor.h.  pend_list is which fixtures have one. */
+#define ELMO_PEND_NONE 0
+#define ELMO_PEND_RGB 1
+#define ELMO_PEND_HSI 2
+
+static int * pend_list;
+static int pend_count = 0, pend_cap = 0;
+/* structure-of-arrays scratch for the kernels */
+static float * conv_in[3], * conv_out[3];
+static int * conv_handles;
+static int conv_cap = 0;
+
+/* Each tick, the fixtures that changed are sent, along with any that
+   haven't been sent for keepalive_sec (so one that rebooted gets its
+   color back).  Fixtures at the same
+   address share datagrams: their messages go in OSC bundles of up to
+   ELMO_MAX_DATAGRAM bytes (a lone message goes as itself), and all of
+   the tick's datagrams leave in one sendmmsg call. */
+
+struct elmo_host_s {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int * lights; /* handles of the fixtures here */
+  int nlights, lights_cap;
+};
+
+static struct elmo_host_s * elmo_hosts;
+static int num_elmo_hosts = 0, elmo_hosts_cap = 0;
+static int elmo_sock = -1;
+static double keepalive_sec = ELMO_KEEPALIVE_SEC;
+static int frame_hz = ELMO_FRAME_HZ;
+static int * send_list; /* scratch for update_lights */
+static int send_list_cap = 0;
+
+/* the datagrams for one tick, and which fixtures are in each (so the
+   ones in a datagram that doesn't go can be tried again next tick) */
+static unsigned char * out_bufs; /* ELMO_MAX_DATAGRAM bytes each */
+static struct iovec * out_iovs;
+static struct mmsghdr * out_hdrs;
+static int * out_first; /* where each datagram's fixtures start in out_handles */
+static int out_count = 0, out_cap = 0;
+static int * out_handles;
+static int out_nhandles = 0, out_handles_cap = 0;
+
+struct elmo_stats_s {
+  unsigned long messages; /* fixture updates */
+  unsigned long skipped; /* fixtures not sent on a tick, being unchanged */
+  unsigned long keepalives; /* unchanged fixtures sent anyway */
+  unsigned long datagrams;
+  unsigned long syscalls;
+  unsigned long errors; /* datagrams the kernel wouldn't take */
+};
+
+static struct elmo_stats_s elmo_stats;
+
+/* how the output ticks keep time.  jitter is from when a tick was due
+   to when we got to it. */
+struct tick_stats_s {
+  long ticks;
+  long missed; /* ticks that came and went while we were busy */
+  double jitter_sum, jitter_max; /* usec */
 };
 
-static struct elmo_light_s elmo_lights[16];
-static int next_handle=0;
+static struct tick_stats_s tick_stats;
 
 void elmo_rgb_handler(int lightid, int clientid, float r, float g, float b);
-int elmo_light_send(struct elmo_light_s * handle, float r, float g, float b);
+
+static void * grow(void * p, int n, size_t size) {
+  p = realloc(p, n * size);
+  if(p == NULL) {
+    perror("elmolights.c, realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static void set_pending(struct elmo_light_s * handle, int kind, float a, float b, float c) {
+  if(handle->pending == ELMO_PEND_NONE) {
+    if(pend_count == pend_cap) {
+      pend_cap = pend_cap ? 2*pend_cap : 64;
+      pend_list = grow(pend_list, pend_cap, sizeof(int));
+    }
+    pend_list[pend_count++] = handle - elmo_lights;
+  }
+  handle->pending = kind;
+  handle->pend[0] = a;
+  handle->pend[1] = b;
+  handle->pend[2] = c;
+  handle->dirty = 1;
+}
 
 void elmo_brightness_handler(int lightid, int clientid, float brightness) {
   struct elmo_light_s * handle = &elmo_lights[squidlights_light_attached_data(lightid)];
   handle->i = brightness;
+  handle->dirty = 1;
 }
 void elmo_on_handler(int lightid, int clientid) {
   elmo_brightness_handler(lightid, clientid, 1.0);
@@ -38,64 +161,343 @@ void elmo_off_handler(int lightid, int clientid) {
 }
 void elmo_rgb_handler(int lightid, int clientid, float r, float g, float b) {
   struct elmo_light_s * handle = &elmo_lights[squidlights_light_attached_data(lightid)];
-  float sum = r+g+b;
-  if(sum == 0) { /* if black, then reset to lovely purple */
-    handle->r = 0.8;
-    handle->g = 0.0;
-    handle->b = 0.2;
-  } else {
-    handle->r = r/sum;
-    handle->g = g/sum;
-    handle->b = b/sum;
-  }
-  handle->i = sum;
+  handle->i = r+g+b; /* now, so a later brightness still wins */
+  set_pending(handle, ELMO_PEND_RGB, r, g, b);
 }
 
-static inline float deg_to_rad(float d) {
-  return d*M_PI/180.0;
-}
 void elmo_hsi_handler(int lightid, int clientid, float h, float s, float i) {
   struct elmo_light_s * handle = &elmo_lights[squidlights_light_attached_data(lightid)];
-  float r, g, b;
-  h = fmod(h, 360.0);
-  if(h < 120) {
-    r = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    g = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    b = (1-s)/3;
-  } else if(h < 240) {
-    h = h - 120;
-    g = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    b = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    r = (1-s)/3;
-  } else {
-    h = h - 240;
-    b = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    r = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    g = (1-s)/3;
+  set_pending(handle, ELMO_PEND_HSI, h, s, i);
+}
+
+/* gathers the pending colors of one kind into the scratch arrays.
+   returns how many. */
+static int gather_pending(int kind) {
+  if(pend_count > conv_cap) {
+    conv_cap = pend_count;
+    for(int j = 0; j < 3; j++) {
+      conv_in[j] = grow(conv_in[j], conv_cap, sizeof(float));
+      conv_out[j] = grow(conv_out[j], conv_cap, sizeof(float));
+    }
+    conv_handles = grow(conv_handles, conv_cap, sizeof(int));
+  }
+  int n = 0;
+  for(int k = 0; k < pend_count; k++) {
+    struct elmo_light_s * handle = &elmo_lights[pend_list[k]];
+    if(handle->pending == kind) {
+      conv_handles[n] = pend_list[k];
+      for(int j = 0; j < 3; j++) {
+	conv_in[j][n] = handle->pend[j];
+      }
+      n++;
+    }
   }
-  handle->r = r;
-  handle->g = g;
-  handle->b = b;
+  return n;
 }
 
-int update_lights() {
-  for(int i = 0; i < next_handle; i++) {
-    struct elmo_light_s * handle = &elmo_lights[i];
-    float r = handle->r, g = handle->g, b = handle->b, i = handle->i;
-    elmo_light_send(handle, r*i, g*i, b*i);
+static void convert_pending(void) {
+  int n = gather_pending(ELMO_PEND_HSI);
+  sq_color_hsi_to_rgb(conv_in[0], conv_in[1], NULL,
+		      conv_out[0], conv_out[1], conv_out[2], n);
+  for(int k = 0; k < n; k++) {
+    struct elmo_light_s * handle = &elmo_lights[conv_handles[k]];
+    handle->r = conv_out[0][k];
+    handle->g = conv_out[1][k];
+    handle->b = conv_out[2][k];
   }
+  n = gather_pending(ELMO_PEND_RGB);
+  sq_color_normalize(conv_in[0], conv_in[1], conv_in[2], conv_out[0], n);
+  for(int k = 0; k < n; k++) {
+    struct elmo_light_s * handle = &elmo_lights[conv_handles[k]];
+    if(conv_out[0][k] == 0) { /* if black, then reset to lovely purple */
+      handle->r = 0.8;
+      handle->g = 0.0;
+      handle->b = 0.2;
+    } else {
+      handle->r = conv_in[0][k];
+      handle->g = conv_in[1][k];
+      handle->b = conv_in[2][k];
+    }
+  }
+  for(int k = 0; k < pend_count; k++) {
+    elmo_lights[pend_list[k]].pending = ELMO_PEND_NONE;
+  }
+  pend_count = 0;
+}
+
+/*** OSC encoding ***/
+
+/* a message is ELMO_COMMAND and ",fff", each padded to four bytes,
+   then three big-endian floats */
+#define OSC_PAD(n) (((n) + 4) & ~3)
+#define ELMO_HEAD_LEN (OSC_PAD(sizeof(ELMO_COMMAND) - 1) + OSC_PAD(4))
+#define ELMO_MSG_LEN (ELMO_HEAD_LEN + 12)
+#define OSC_BUNDLE_HEAD_LEN 16 /* "#bundle", then the time tag */
+
+static unsigned char elmo_msg_head[ELMO_HEAD_LEN];
+
+static void osc_init(void) {
+  memset(elmo_msg_head, 0, sizeof(elmo_msg_head));
+  memcpy(elmo_msg_head, ELMO_COMMAND, sizeof(ELMO_COMMAND) - 1);
+  memcpy(elmo_msg_head + OSC_PAD(sizeof(ELMO_COMMAND) - 1), ",fff", 4);
+}
+
+static unsigned char * osc_put_int(unsigned char * p, unsigned int v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+  return p + 4;
+}
+
+static unsigned char * osc_put_float(unsigned char * p, float f) {
+  unsigned int v;
+  memcpy(&v, &f, 4);
+  return osc_put_int(p, v);
+}
+
+static unsigned char * osc_put_message(unsigned char * p, float r, float g, float b) {
+  memcpy(p, elmo_msg_head, ELMO_HEAD_LEN);
+  p += ELMO_HEAD_LEN;
+  p = osc_put_float(p, r);
+  p = osc_put_float(p, g);
+  return osc_put_float(p, b);
+}
+
+/*** sending ***/
+
+/* starts a new datagram for host h */
+static unsigned char * out_begin(int h) {
+  if(out_count == out_cap) {
+    out_cap = out_cap ? 2*out_cap : 16;
+    out_bufs = grow(out_bufs, out_cap, ELMO_MAX_DATAGRAM);
+    out_iovs = grow(out_iovs, out_cap, sizeof(struct iovec));
+    out_hdrs = grow(out_hdrs, out_cap, sizeof(struct mmsghdr));
+    out_first = grow(out_first, out_cap, sizeof(int));
+  }
+  out_first[out_count] = out_nhandles;
+  struct mmsghdr * hdr = &out_hdrs[out_count];
+  memset(hdr, 0, sizeof(struct mmsghdr));
+  hdr->msg_hdr.msg_name = &elmo_hosts[h].addr;
+  hdr->msg_hdr.msg_namelen = elmo_hosts[h].addrlen;
+  hdr->msg_hdr.msg_iovlen = 1;
+  return out_bufs + (size_t)out_count * ELMO_MAX_DATAGRAM;
+}
+
+static void out_add_handle(int handle) {
+  if(out_nhandles == out_handles_cap) {
+    out_handles_cap = out_handles_cap ? 2*out_handles_cap : 64;
+    out_handles = grow(out_handles, out_handles_cap, sizeof(int));
+  }
+  out_handles[out_nhandles++] = handle;
+}
+
+static void out_end(unsigned char * start, unsigned char * end) {
+  out_iovs[out_count].iov_len = end - start;
+  out_count++;
+  elmo_stats.datagrams++;
+}
+
+/* applies a fixture's matrix and curve to what it's about to be sent */
+static void calibrate(struct elmo_light_s * handle, float * out) {
+  if(handle->matrix != NULL) {
+    float * m = handle->matrix, v[3] = {out[0], out[1], out[2]};
+    for(int j = 0; j < 3; j++) {
+      out[j] = m[3*j]*v[0] + m[3*j+1]*v[1] + m[3*j+2]*v[2];
+    }
+  }
+  for(int j = 0; j < 3; j++) {
+    float x = out[j] > 0 ? out[j] : 0;
+    x = x < 1 ? x : 1;
+    out[j] = handle->curve != NULL ? handle->curve[sq_curve_index(x)] * (1.0f/65535) : x;
+  }
+}
+
+/* puts handles[0..n) of host h into datagrams */
+static void pack_host(int h, int * handles, int n) {
+  int per_bundle = (ELMO_MAX_DATAGRAM - OSC_BUNDLE_HEAD_LEN) / (4 + ELMO_MSG_LEN);
+  for(int k = 0; k < n; k += per_bundle) {
+    int m = n - k < per_bundle ? n - k : per_bundle;
+    unsigned char * start = out_begin(h), * p = start;
+    if(m > 1) {
+      memcpy(p, "#bundle", 8);
+      p = osc_put_int(p + 8, 0);
+      p = osc_put_int(p, 1); /* "immediately" */
+    }
+    for(int j = k; j < k + m; j++) {
+      struct elmo_light_s * handle = &elmo_lights[handles[j]];
+      float i = handle->i;
+      if(m > 1) {
+	p = osc_put_int(p, ELMO_MSG_LEN);
+      }
+      float out[3] = {handle->r*i, handle->g*i, handle->b*i};
+      if(handle->matrix != NULL || handle->curve != NULL) {
+	calibrate(handle, out);
+      }
+      p = osc_put_message(p, out[0], out[1], out[2]);
+      out_add_handle(handles[j]);
+      elmo_stats.messages++;
+    }
+    out_end(start, p);
+  }
+}
+
+/* datagrams [k, end) didn't go, so their fixtures go next tick */
+static void out_unsent(int k, int end) {
+  int last = end < out_count ? out_first[end] : out_nhandles;
+  for(int j = out_first[k]; j < last; j++) {
+    elmo_lights[out_handles[j]].dirty = 1;
+  }
+  elmo_stats.errors += end - k;
+}
+
+/* sends the datagrams collected this tick */
+static void out_flush(void) {
+  int sent = 0;
+  /* the arrays may have moved while growing, so point things now */
+  for(int k = 0; k < out_count; k++) {
+    out_iovs[k].iov_base = out_bufs + (size_t)k * ELMO_MAX_DATAGRAM;
+    out_hdrs[k].msg_hdr.msg_iov = &out_iovs[k];
+  }
+  while(sent < out_count) {
+    int n = out_count - sent < ELMO_SEND_BATCH ? out_count - sent : ELMO_SEND_BATCH;
+    int r = sendmmsg(elmo_sock, out_hdrs + sent, n, 0);
+    elmo_stats.syscalls++;
+    if(r == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+	out_unsent(sent, out_count); /* no room now for any of them */
+	break;
+      }
+      perror("elmolights.c, sendmmsg");
+      out_unsent(sent, sent + 1); /* skip the one it choked on */
+      r = 1;
+    }
+    sent += r;
+  }
+  out_count = 0;
+  out_nhandles = 0;
+}
+
+/* now is in seconds */
+int update_lights(double now) {
+  convert_pending();
+  for(int h = 0; h < num_elmo_hosts; h++) {
+    struct elmo_host_s * host = &elmo_hosts[h];
+    int n = 0;
+    if(host->nlights > send_list_cap) {
+      send_list_cap = host->nlights;
+      send_list = grow(send_list, send_list_cap, sizeof(int));
+    }
+    for(int k = 0; k < host->nlights; k++) {
+      struct elmo_light_s * handle = &elmo_lights[host->lights[k]];
+      if(handle->dirty || now - handle->sent_at >= keepalive_sec) {
+	if(!handle->dirty) {
+	  elmo_stats.keepalives++;
+	}
+	handle->dirty = 0;
+	handle->sent_at = now;
+	send_list[n++] = host->lights[k];
+      } else {
+	elmo_stats.skipped++;
+      }
+    }
+    pack_host(h, send_list, n);
+  }
+  out_flush();
   return 0;
 }
 
+void print_elmo_stats(void) {
+  printf("elmo: %lu messages in %lu datagrams, %lu sendmmsg calls, %lu errors\n",
+	 elmo_stats.messages, elmo_stats.datagrams, elmo_stats.syscalls, elmo_stats.errors);
+  printf("elmo: %lu sent (%lu of them keepalives), %lu skipped as unchanged\n",
+	 elmo_stats.messages, elmo_stats.keepalives, elmo_stats.skipped);
+}
+
+void print_tick_stats(void) {
+  struct tick_stats_s * ts = &tick_stats;
+  if(ts->ticks == 0) {
+    return;
+  }
+  printf("ticks: %ld, missed %ld, jitter avg %.0fus max %.0fus\n",
+	 ts->ticks, ts->missed, ts->jitter_sum / ts->ticks, ts->jitter_max);
+  memset(ts, 0, sizeof(struct tick_stats_s));
+}
+
+static double timespec_sec(struct timespec * t) {
+  return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/* the host for address ("host" or "host:port"), added if new.
+   Returns -1 if it doesn't resolve. */
+static int find_host(char * address) {
+  char host[256], * port = ELMO_UDP_PORT, * colon;
+  struct addrinfo hints, * res;
+  strncpy(host, address, sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  if((colon = strchr(host, ':')) != NULL) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int err = getaddrinfo(host, port, &hints, &res);
+  if(err != 0) {
+    printf("can't resolve %s: %s\n", address, gai_strerror(err));
+    return -1;
+  }
+  int h;
+  for(h = 0; h < num_elmo_hosts; h++) {
+    if(elmo_hosts[h].addrlen == res->ai_addrlen
+       && memcmp(&elmo_hosts[h].addr, res->ai_addr, res->ai_addrlen) == 0) {
+      break;
+    }
+  }
+  if(h == num_elmo_hosts) {
+    if(num_elmo_hosts == elmo_hosts_cap) {
+      elmo_hosts_cap = elmo_hosts_cap ? 2*elmo_hosts_cap : 16;
+      elmo_hosts = grow(elmo_hosts, elmo_hosts_cap, sizeof(struct elmo_host_s));
+    }
+    memset(&elmo_hosts[h], 0, sizeof(struct elmo_host_s));
+    memcpy(&elmo_hosts[h].addr, res->ai_addr, res->ai_addrlen);
+    elmo_hosts[h].addrlen = res->ai_addrlen;
+    num_elmo_hosts++;
+  }
+  freeaddrinfo(res);
+  return h;
+}
+
 int initialize_elmo_light(char * address, char * name) {
+  int h = find_host(address);
+  if(h == -1) {
+    return SQ_CONNECTION_ERROR;
+  }
+  if(next_handle == elmo_lights_cap) {
+    elmo_lights_cap = elmo_lights_cap ? 2*elmo_lights_cap : 16;
+    elmo_lights = grow(elmo_lights, elmo_lights_cap, sizeof(struct elmo_light_s));
+  }
   struct elmo_light_s * handle = elmo_lights+next_handle;
-  handle->addr = lo_address_new(address, ELMO_UDP_PORT);
+  handle->host = h;
   handle->lightid = squidlights_light_connect(name);
+  if(handle->lightid < 0) {
+    return handle->lightid;
+  }
   squidlights_light_attach_data(handle->lightid, next_handle);
+  struct elmo_host_s * host = &elmo_hosts[h];
+  if(host->nlights == host->lights_cap) {
+    host->lights_cap = host->lights_cap ? 2*host->lights_cap : 16;
+    host->lights = grow(host->lights, host->lights_cap, sizeof(int));
+  }
+  host->lights[host->nlights++] = next_handle;
   handle->r = 0.8;
   handle->g = 0.0;
   handle->b = 0.2;
   handle->i = 0.0;
+  handle->dirty = 1;
+  handle->pending = ELMO_PEND_NONE;
+  handle->matrix = NULL;
+  handle->curve = NULL;
+  handle->sent_at = 0;
 
   squidlights_light_add_on(handle->lightid, &elmo_on_handler);
   squidlights_light_add_off(handle->lightid, &elmo_off_handler);
@@ -106,37 +508,176 @@ int initialize_elmo_light(char * address, char * name) {
   return next_handle++;
 }
 
-int elmo_light_send(struct elmo_light_s * handle, float r, float g, float b) {
-  return lo_send(handle->addr, ELMO_COMMAND, "fff", r, g, b);
+/* one of the options after a fixture's name.  returns -1 if it makes
+   no sense. */
+static int set_option(struct elmo_light_s * handle, char * option) {
+  if(strncmp(option, "matrix=", 7) == 0) {
+    handle->matrix = grow(NULL, 9, sizeof(float));
+    char * p = option + 7, * end;
+    for(int k = 0; k < 9; k++) {
+      handle->matrix[k] = strtof(p, &end);
+      if(end == p || *end != (k < 8 ? ',' : '\0')) {
+	printf("matrix needs 9 numbers separated by commas\n");
+	return -1;
+      }
+      p = end + 1;
+    }
+    return 0;
+  }
+  if(strncmp(option, "curve=", 6) == 0) {
+    if(sq_curve_is_linear(option + 6)) {
+      return 0;
+    }
+    handle->curve = grow(NULL, SQ_CURVE_STEPS + 1, sizeof(unsigned short));
+    return sq_curve_build(option + 6, 65535, handle->curve);
+  }
+  printf("unknown option \"%s\"\n", option);
+  return -1;
 }
 
-int main(void) {
-  squidlights_light_initialize();
+int load_lights(char * filename) {
+  FILE * fp = fopen(filename, "r");
+  if(fp == 0) {
+    printf("couldn't open file %s\n", filename);
+    return -1;
+  }
+  char line[1024];
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    char * address = strtok(line, " \t\n");
+    char * name = strtok(NULL, " \t\n");
+    if(address == NULL) {
+      continue; /* blank line */
+    }
+    if(name == NULL) {
+      printf("parsing error for %s\n", filename);
+      fclose(fp);
+      return -1;
+    }
+    int handle = initialize_elmo_light(address, name);
+    if(handle < 0) {
+      printf("error adding \"%s\"\n", name);
+      fclose(fp);
+      return -1;
+    }
+    char * option;
+    while((option = strtok(NULL, " \t\n")) != NULL) {
+      if(set_option(&elmo_lights[handle], option)) {
+	printf("bad option for \"%s\"\n", name);
+	fclose(fp);
+	return -1;
+      }
+    }
+  }
+  fclose(fp);
+  printf("added %d lights on %d hosts (%s color math).\n", next_handle, num_elmo_hosts, sq_color_impl());
+  return 0;
+}
 
-  int elmo0 = initialize_elmo_light("18.224.0.163", "elmo0"); // scheme.mit.edu
-  if(elmo0 == SQ_CONNECTION_ERROR) exit(1);
-  int elmo1 = initialize_elmo_light("18.224.0.168", "elmo1"); // haskell.mit.edu
-  if(elmo1 == SQ_CONNECTION_ERROR) exit(1);
-  //  elmo_light_send(&elmo_lights[elmo0], 1.0, 0.1, 0.9);
-  //  squidlights_light_add_on(light0, &light0_on_handler);
-  //  squidlights_light_add_off(light0, &light0_off_handler);
+int main(int argc, char** argv) {
+  int opt;
+  while((opt = getopt(argc, argv, "r:k:")) != -1) {
+    switch(opt) {
+    case 'r' :
+      frame_hz = atoi(optarg);
+      if(frame_hz <= 0 || frame_hz > 1000) {
+	printf("bad frame rate %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'k' :
+      keepalive_sec = atof(optarg);
+      if(keepalive_sec <= 0) {
+	printf("bad keepalive %s\n", optarg);
+	exit(1);
+      }
+      break;
+    default :
+      printf("usage: %s [-r hz] [-k keepalive_sec] [file]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  squidlights_light_initialize();
 
-  //  int elmo1 = squidlights_light_connect("elmo1");
-  //  if(elmo1 == SQ_CONNECTION_ERROR) exit(1);
-  //  squidlights_light_add_on(light1, &light1_on_handler);
-  //  squidlights_light_add_off(light1, &light1_off_handler);
-  //  squidlights_light_add_brightness(light1, &light1_brightness_handler);
+  osc_init();
+  if((elmo_sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    perror("elmolights.c, socket");
+    exit(1);
+  }
+  fcntl(elmo_sock, F_SETFL, O_NONBLOCK);
 
+  if(optind < argc) {
+    if(load_lights(argv[optind])) exit(1);
+  } else {
+    int elmo0 = initialize_elmo_light("18.224.0.163", "elmo0"); // scheme.mit.edu
+    if(elmo0 < 0) exit(1);
+    int elmo1 = initialize_elmo_light("18.224.0.168", "elmo1"); // haskell.mit.edu
+    if(elmo1 < 0) exit(1);
+  }
   squidlights_lights_handle_init();
 
-  struct timeval tv, tv2;
-  gettimeofday(&tv, NULL);
-  while(squidlights_lights_handle(1) != -1) {
-    gettimeofday(&tv2, NULL);
-    if(tv2.tv_sec>tv.tv_sec || tv2.tv_usec-tv.tv_usec >= 33000) {
-      update_lights();
-      tv = tv2;
+  /* wait for either messages or the next tick */
+  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  long period = 1000000000L / frame_hz;
+  struct itimerspec its;
+  if(tfd == -1) {
+    perror("timerfd_create");
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+  its.it_interval.tv_sec = period / 1000000000L;
+  its.it_interval.tv_nsec = period % 1000000000L;
+  double next_tick = timespec_sec(&its.it_value);
+  if(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    perror("timerfd_settime");
+    exit(1);
+  }
+  struct pollfd fds[2];
+  fds[0].fd = squidlights_lights_fd();
+  fds[0].events = POLLIN;
+  fds[1].fd = tfd;
+  fds[1].events = POLLIN;
+  if(fds[0].fd == -1) {
+    exit(1);
+  }
+
+  for(;;) {
+    if(poll(fds, 2, -1) == -1) {
+      if(errno != EINTR) {
+	perror("elmolights.c, poll");
+	break;
+      }
+      fds[0].revents = POLLIN; /* probably ^C.  let handle see it */
+      fds[1].revents = 0;
+    }
+    if(fds[0].revents && squidlights_lights_handle(0) == -1) {
+      break;
+    }
+    if(fds[1].revents & POLLIN) {
+      unsigned long long expirations;
+      struct timespec now;
+      if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+	continue;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      /* the latest of the ticks that went by */
+      next_tick += (expirations - 1) / (double)frame_hz;
+      double jitter = (timespec_sec(&now) - next_tick) * 1e6;
+      next_tick += 1.0 / frame_hz;
+
+      update_lights(timespec_sec(&now));
+
+      struct tick_stats_s * ts = &tick_stats;
+      ts->ticks++;
+      ts->missed += expirations - 1;
+      ts->jitter_sum += jitter;
+      if(jitter > ts->jitter_max) ts->jitter_max = jitter;
+      if(ts->ticks >= (long)frame_hz * ELMO_STATS_SEC) {
+	print_tick_stats();
+      }
     }
   }
+  print_tick_stats();
   squidlights_lights_cleanup();
+  print_elmo_stats();
 }
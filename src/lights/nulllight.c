@@ -0,0 +1,75 @@
+/* null light, for benchmarks.  Creates some lights (null0, null1,
+   ..., or the names it's given, as "sqreplay names" lists them) which
+   take every kind of change and throw it away.  lights.c
+   counts them on the stats page, and when the changes come traced
+   (sqload and sqreplay send them so) keeps the latency histograms. */
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NULLLIGHT_MAX 4096
+
+void null_handler(int lightid, int clientid) {
+}
+void null1_handler(int lightid, int clientid, float a) {
+}
+void null2_handler(int lightid, int clientid, float a, float b) {
+}
+void null3_handler(int lightid, int clientid, float a, float b, float c) {
+}
+
+void print_usage(char * name) {
+  printf("usage: %s [-n lights] [-p prefix] [name ...]\n", name);
+  printf("makes lights prefix0 through prefix<lights-1> (default null, 16 of them),\n"
+	 "or the lights named\n");
+}
+
+int main(int argc, char ** argv) {
+  int nlights = 16;
+  char * prefix = "null";
+  int opt;
+  while((opt = getopt(argc, argv, "n:p:")) != -1) {
+    switch(opt) {
+    case 'n' :
+      nlights = atoi(optarg);
+      break;
+    case 'p' :
+      prefix = optarg;
+      break;
+    default :
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+  if(optind < argc) {
+    nlights = argc - optind;
+  }
+  if(nlights < 1 || nlights > NULLLIGHT_MAX || strlen(prefix) > 24) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  squidlights_light_initialize();
+  for(int k = 0; k < nlights; k++) {
+    char name[32];
+    if(optind < argc) {
+      snprintf(name, sizeof(name), "%s", argv[optind + k]);
+    } else {
+      sprintf(name, "%s%d", prefix, k);
+    }
+    int light = squidlights_light_connect(name);
+    if(light == SQ_CONNECTION_ERROR) exit(1);
+    squidlights_light_add_on(light, &null_handler);
+    squidlights_light_add_off(light, &null_handler);
+    squidlights_light_add_brightness(light, &null1_handler);
+    squidlights_light_add_rgb(light, &null3_handler);
+    squidlights_light_add_hsi(light, &null3_handler);
+    squidlights_light_add_fade(light, &null2_handler);
+  }
+  printf("%d null lights\n", nlights);
+  fflush(stdout);
+  squidlights_light_run();
+}
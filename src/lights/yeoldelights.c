@@ -1,21 +1,370 @@
 /* yeoldelights.c
    this program controls the "old" light show (that is, the serial-controlled lights */
 
-/* yeoldelights.conf has the format "a b c d" where a=0,1 for whether
-   can handle different brightnesses, b&c are the address on the
-   serial controller, and d is a unique whitespace-less string name
-   for the light */
+/* yeoldelights.conf has the format "a b c d [e]" where a=0,1 for
+   whether can handle different brightnesses, b&c are the address on
+   the serial controller, d is a unique whitespace-less string name
+   for the light, and e is an optional output curve for dimmable ones
+   (see sqcurve.h, like gamma:2.2).  Without one, brightness goes out
+   linearly. */
 
 #include "protocol.h"
+#include "sqcurve.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <termios.h>
 
 static int leitshow_handle;
 
+/* The serial port is slow: at 19200 baud the controller takes about
+   480 packets a second, shared by every light.  So handlers don't
+   write to it.  They only record what each address should be showing,
+   and a writer thread decides what goes out next:
+
+   - it sends at most SERIAL_PACKET_RATE packets a second, and keeps
+     only a couple of packets ahead of the port, so a change never
+     waits behind a long backlog;
+   - it goes round-robin over the addresses whose wanted state differs
+     from what was last sent, so a light that changes constantly gets
+     one packet per round like everybody else;
+   - an address whose change is big (SCHED_BIG_CHANGE or more) goes
+     ahead of the small ones, unless some address has been waiting for
+     more than SCHED_MAX_WAIT packets, in which case the longest
+     waiting goes first.
+
+   Packets are written from serial_buf.  The writer hands the port as
+   much of the buffer as it will take at a time and waits with poll()
+   when it's full.  If the buffer fills up, a new packet is dropped
+   whole, so the stream stays framed.
+
+   Fades.  The last byte of a packet is a period: the controller fades
+   to the new brightness over period*LEITSHOW_PERIOD_MSEC by itself.
+   So a fade is one packet.  A fade longer than the byte can hold is
+   cut into equal segments, each one packet, sent when the previous
+   segment is due to finish.  The controller fades in a straight line,
+   so a fade on a light with a curve is also cut up, into at least
+   FADE_CURVE_SEGMENTS pieces following the curve. */
+
+#define SERIAL_BUF_SIZE 4096 /* bytes.  must be a power of two */
+#define SERIAL_PACKET_RATE 480 /* packets per second the controller can take */
+#define SERIAL_BURST 4 /* packets we may send back to back */
+#define SERIAL_LOW_WATER 8 /* bytes buffered before we stop adding more */
+#define SCHED_BIG_CHANGE 64 /* out of LEITSHOW_MAX_LEVEL */
+#define SCHED_MAX_WAIT 48 /* packets (100ms) */
+#define NUM_ADDRS 256
+#define LEITSHOW_PERIOD_MSEC 10 /* the controller's unit of fade time */
+#define LEITSHOW_MAX_LEVEL 254 /* 0xFF is the packet start */
+#define LEITSHOW_MAX_PERIOD 254 /* likewise */
+#define FADE_CURVE_SEGMENTS 8
+
+static unsigned char serial_buf[SERIAL_BUF_SIZE];
+static unsigned long serial_head = 0, serial_tail = 0; /* bytes in and out, ever */
+static int serial_running = 0;
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serial_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t serial_thread;
+
+/* what each address on the controller should show, and what it was
+   last sent */
+struct addr_state_s {
+  int want, sent; /* brightness, or -1 if never sent */
+  unsigned char period, sent_period;
+  char dirty;
+  unsigned long since; /* packets_sent when it became dirty */
+  /* a fade too long for one packet (or along a curve) */
+  int fade_from, fade_to; /* levels, or fade_curve indices */
+  const unsigned short * fade_curve;
+  int fade_seg, fade_nseg; /* segment in progress (from 1), or 0 if none */
+  double fade_start, fade_seg_secs;
+  unsigned char fade_period;
+};
+
+static struct addr_state_s addrs[NUM_ADDRS];
+static int sched_next = 0; /* the round-robin cursor */
+static double sched_tokens = SERIAL_BURST;
+static struct timespec sched_last;
+static int num_fading = 0; /* addresses with fade_seg != 0 */
+
+struct serial_stats_s {
+  unsigned long queued; /* bytes put in the buffer */
+  unsigned long written; /* bytes the port took */
+  unsigned long dropped; /* bytes thrown away because the buffer was full */
+  unsigned long short_writes; /* writes the port only took part of */
+  unsigned long packets; /* packets scheduled */
+  unsigned long superseded; /* changes replaced by newer ones before going out */
+  unsigned long max_wait; /* longest an address waited, in packets */
+  unsigned long fades; /* fade commands */
+  unsigned long fade_packets; /* packets they took */
+};
+
+static struct serial_stats_s serial_stats;
+
+/* each light's output curve, by lightid.  NULL for linear (and for
+   on/off lights). */
+static unsigned short ** light_curves;
+static int light_curves_cap = 0;
+
+/* queues bytes for the port, all or nothing.  serial_lock is held. */
+static void serial_queue(unsigned char * bytes, size_t len) {
+  if(SERIAL_BUF_SIZE - (serial_head - serial_tail) < len) {
+    serial_stats.dropped += len;
+    return;
+  }
+  for(size_t i = 0; i < len; i++) {
+    serial_buf[(serial_head + i) & (SERIAL_BUF_SIZE - 1)] = bytes[i];
+  }
+  serial_head += len;
+  serial_stats.queued += len;
+}
+
+static void queue_leitshow_packet(unsigned char lightaddr, int brightness, unsigned char period) {
+  unsigned char buffer[4] = {0xFF, 0x00, 0x00, 0x00};
+  buffer[1] = lightaddr;
+  buffer[2] = (unsigned char)brightness;
+  buffer[3] = period;
+  serial_queue(buffer, 4);
+}
+
+/* the next address to send, or -1 if nothing is dirty.  serial_lock
+   is held. */
+static int sched_pick(void) {
+  int first = -1, big = -1, oldest = -1;
+  for(int k = 0; k < NUM_ADDRS; k++) {
+    int a = (sched_next + k) % NUM_ADDRS;
+    struct addr_state_s * st = &addrs[a];
+    if(!st->dirty) {
+      continue;
+    }
+    if(first == -1) {
+      first = a;
+    }
+    if(big == -1 && (st->sent < 0 || abs(st->want - st->sent) >= SCHED_BIG_CHANGE)) {
+      big = a;
+    }
+    if(serial_stats.packets - st->since > SCHED_MAX_WAIT
+       && (oldest == -1 || st->since < addrs[oldest].since)) {
+      oldest = a;
+    }
+  }
+  if(oldest != -1) return oldest;
+  if(big != -1) return big;
+  return first;
+}
+
+/* refills the token bucket from the clock.  serial_lock is held. */
+static void sched_refill(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sched_tokens += ((now.tv_sec - sched_last.tv_sec)
+		   + (now.tv_nsec - sched_last.tv_nsec) / 1e9) * SERIAL_PACKET_RATE;
+  if(sched_tokens > SERIAL_BURST) {
+    sched_tokens = SERIAL_BURST;
+  }
+  sched_last = now;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sets what address a should show.  serial_lock is held. */
+static void set_state_locked(int a, int brightness, unsigned char period) {
+  struct addr_state_s * st = &addrs[a];
+  if(st->dirty) {
+    serial_stats.superseded++;
+  }
+  st->want = brightness;
+  st->period = period;
+  int differs = st->sent < 0 || st->want != st->sent || st->period != st->sent_period;
+  if(differs && !st->dirty) {
+    st->dirty = 1;
+    st->since = serial_stats.packets;
+    pthread_cond_signal(&serial_cond);
+  } else if(!differs) {
+    st->dirty = 0; /* changed back before it went out */
+  }
+}
+
+/* the level segment seg of address a's fade ends at */
+static int fade_level(int a, int seg) {
+  struct addr_state_s * st = &addrs[a];
+  int x = st->fade_from + (st->fade_to - st->fade_from) * seg / st->fade_nseg;
+  return st->fade_curve != NULL ? st->fade_curve[x] : x;
+}
+
+static void stop_fade(int a) {
+  if(addrs[a].fade_seg != 0) {
+    addrs[a].fade_seg = 0;
+    num_fading--;
+  }
+}
+
+/* starts the next segment of any long fade whose current segment is
+   done.  Returns the time the next one is due, or 0 if no fades.
+   serial_lock is held. */
+static double sched_fades(void) {
+  double next = 0, now = now_sec();
+  for(int a = 0; num_fading > 0 && a < NUM_ADDRS; a++) {
+    struct addr_state_s * st = &addrs[a];
+    if(st->fade_seg == 0) {
+      continue;
+    }
+    double due = st->fade_start + st->fade_seg * st->fade_seg_secs;
+    if(now >= due) {
+      st->fade_seg++;
+      set_state_locked(a, fade_level(a, st->fade_seg), st->fade_period);
+      serial_stats.fade_packets++;
+      if(st->fade_seg == st->fade_nseg) {
+	stop_fade(a);
+	continue;
+      }
+      due += st->fade_seg_secs;
+    }
+    if(next == 0 || due < next) {
+      next = due;
+    }
+  }
+  return next;
+}
+
+/* moves dirty addresses into serial_buf as the budget allows.
+   Returns 1 if something is dirty but has to wait for the budget.
+   serial_lock is held. */
+static int sched_fill(void) {
+  sched_refill();
+  while(serial_head - serial_tail < SERIAL_LOW_WATER) {
+    int a = sched_pick();
+    if(a == -1) {
+      return 0;
+    }
+    if(sched_tokens < 1) {
+      return 1;
+    }
+    struct addr_state_s * st = &addrs[a];
+    unsigned long waited = serial_stats.packets - st->since;
+    if(waited > serial_stats.max_wait) {
+      serial_stats.max_wait = waited;
+    }
+    queue_leitshow_packet(a, st->want, st->period);
+    st->sent = st->want;
+    st->sent_period = st->period;
+    st->dirty = 0;
+    sched_tokens -= 1;
+    sched_next = (a + 1) % NUM_ADDRS;
+    serial_stats.packets++;
+  }
+  return 0;
+}
+
+static void * serial_writer(void * arg) {
+  pthread_mutex_lock(&serial_lock);
+  for(;;) {
+    double fade_due = sched_fades();
+    int waiting = sched_fill();
+    if(serial_head == serial_tail) {
+      if(!serial_running && !waiting) {
+	break; /* stopped, and everything is out */
+      }
+      if(waiting || fade_due != 0) {
+	/* until the next packet's worth of budget, or the next fade
+	   segment */
+	double wait = 1.0 / SERIAL_PACKET_RATE;
+	if(!waiting || (fade_due != 0 && fade_due - now_sec() < wait)) {
+	  wait = fade_due - now_sec();
+	}
+	if(wait < 0) {
+	  wait = 0;
+	}
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += (long)wait;
+	until.tv_nsec += (long)((wait - (long)wait) * 1e9);
+	if(until.tv_nsec >= 1000000000L) {
+	  until.tv_nsec -= 1000000000L;
+	  until.tv_sec++;
+	}
+	pthread_cond_timedwait(&serial_cond, &serial_lock, &until);
+      } else {
+	pthread_cond_wait(&serial_cond, &serial_lock);
+      }
+      continue;
+    }
+    /* the contiguous run from the tail */
+    unsigned long tail = serial_tail;
+    size_t off = tail & (SERIAL_BUF_SIZE - 1);
+    size_t len = serial_head - tail;
+    if(len > SERIAL_BUF_SIZE - off) {
+      len = SERIAL_BUF_SIZE - off;
+    }
+    pthread_mutex_unlock(&serial_lock);
+
+    ssize_t n = write(leitshow_handle, serial_buf + off, len);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = {leitshow_handle, POLLOUT, 0};
+      poll(&pfd, 1, 100);
+    } else if(n == -1 && errno != EINTR) {
+      perror("yeoldelights.c, serial write");
+      struct timespec nap = {0, 100000000};
+      nanosleep(&nap, NULL);
+    }
+
+    pthread_mutex_lock(&serial_lock);
+    if(n > 0) {
+      serial_tail += n;
+      serial_stats.written += n;
+      if((size_t)n < len) {
+	serial_stats.short_writes++;
+      }
+    }
+    if(!serial_running && n <= 0) {
+      break; /* the port is stuck and we're quitting anyway */
+    }
+  }
+  pthread_mutex_unlock(&serial_lock);
+  return NULL;
+}
+
+int start_serial_writer(void) {
+  for(int a = 0; a < NUM_ADDRS; a++) {
+    addrs[a].want = -1;
+    addrs[a].sent = -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &sched_last);
+  serial_running = 1;
+  if(pthread_create(&serial_thread, NULL, serial_writer, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+/* lets the writer finish what's dirty and buffered, then stops it */
+void stop_serial_writer(void) {
+  pthread_mutex_lock(&serial_lock);
+  serial_running = 0;
+  pthread_cond_signal(&serial_cond);
+  pthread_mutex_unlock(&serial_lock);
+  pthread_join(serial_thread, NULL);
+}
+
+void print_serial_stats(void) {
+  printf("serial: %lu bytes queued, %lu written, %lu dropped, %lu short writes\n",
+	 serial_stats.queued, serial_stats.written, serial_stats.dropped,
+	 serial_stats.short_writes);
+  printf("serial: %lu packets, %lu changes superseded, longest wait %lu packets\n",
+	 serial_stats.packets, serial_stats.superseded, serial_stats.max_wait);
+  printf("serial: %lu fades in %lu packets\n", serial_stats.fades, serial_stats.fade_packets);
+}
+
 /* Returns the handle for the serial port */
 int connect_to_leitshow(char* device) {
   struct termios options;
@@ -35,21 +384,87 @@ int connect_to_leitshow(char* device) {
   return 0;
 }
 
-void send_leitshow_packet(char lightaddr, int brightness, unsigned char period) {
-  unsigned char buffer[4] = {0xFF, 0x00, 0x00, 0x00};
-  if(brightness > 254) {
-    brightness = 254;
-  }
+static int clamp_level(int brightness) {
+  if(brightness > LEITSHOW_MAX_LEVEL) return LEITSHOW_MAX_LEVEL;
+  if(brightness < 0) return 0;
+  return brightness;
+}
+
+/* records what the light at lightaddr should show.  The writer
+   thread sends it when its turn comes. */
+void set_leitshow_state(unsigned char lightaddr, int brightness, unsigned char period) {
   if(period == 0xFF) period = 0xFE;
-  buffer[1] = lightaddr;
-  buffer[2] = (unsigned char)brightness;
-  buffer[3] = period;
-  write(leitshow_handle, buffer, 4);
+  pthread_mutex_lock(&serial_lock);
+  stop_fade(lightaddr);
+  set_state_locked(lightaddr, clamp_level(brightness), period);
+  pthread_mutex_unlock(&serial_lock);
+}
+
+/* starts a fade of address a from from to to, which are levels, or
+   indices into curve if there is one.  serial_lock is held. */
+static void start_fade_locked(int a, const unsigned short * curve, int from, int to, float seconds) {
+  int units = (int)(seconds * 1000 / LEITSHOW_PERIOD_MSEC + 0.5);
+  struct addr_state_s * st = &addrs[a];
+  int nseg = (units + LEITSHOW_MAX_PERIOD - 1) / LEITSHOW_MAX_PERIOD;
+  if(curve != NULL && nseg < FADE_CURVE_SEGMENTS) {
+    nseg = units < FADE_CURVE_SEGMENTS ? units : FADE_CURVE_SEGMENTS;
+  }
+  stop_fade(a);
+  serial_stats.fades++;
+  serial_stats.fade_packets++;
+  if(nseg <= 1) {
+    set_state_locked(a, curve != NULL ? curve[to] : to, units);
+  } else {
+    st->fade_from = from;
+    st->fade_to = to;
+    st->fade_curve = curve;
+    st->fade_nseg = nseg;
+    st->fade_seg = 1;
+    st->fade_start = now_sec();
+    st->fade_seg_secs = seconds / nseg;
+    st->fade_period = (units + nseg - 1) / nseg;
+    num_fading++;
+    set_state_locked(a, fade_level(a, 1), st->fade_period);
+  }
+}
+
+/* fades the light at lightaddr to brightness over some seconds, in as
+   few packets as the period byte allows */
+void set_leitshow_fade(unsigned char lightaddr, int brightness, float seconds) {
+  pthread_mutex_lock(&serial_lock);
+  int from = addrs[lightaddr].want < 0 ? 0 : addrs[lightaddr].want; /* never sent: off */
+  start_fade_locked(lightaddr, NULL, from, clamp_level(brightness), seconds);
+  pthread_mutex_unlock(&serial_lock);
+}
+
+/* the same along an output curve, brightness being in [0,1].  The fade
+   starts from the point on the curve nearest what the light shows. */
+void set_leitshow_curve_fade(unsigned char lightaddr, const unsigned short * curve,
+			     float brightness, float seconds) {
+  pthread_mutex_lock(&serial_lock);
+  int want = addrs[lightaddr].want, from = 0;
+  for(int k = 1; k <= SQ_CURVE_STEPS; k++) {
+    if(abs(curve[k] - want) < abs(curve[from] - want)) {
+      from = k;
+    }
+  }
+  start_fade_locked(lightaddr, curve, from, sq_curve_index(brightness), seconds);
+  pthread_mutex_unlock(&serial_lock);
 }
 
 /* brightness-able light controllers */
 void ba_yelight_brightness_handler(int lightid, int clientid, float brightness) {
-  send_leitshow_packet(squidlights_light_attached_data(lightid), (int)(254*brightness), 0);
+  unsigned short * curve = light_curves[lightid];
+  int level = curve != NULL ? curve[sq_curve_index(brightness)] : (int)(LEITSHOW_MAX_LEVEL*brightness);
+  set_leitshow_state(squidlights_light_attached_data(lightid), level, 0);
+}
+void ba_yelight_fade_handler(int lightid, int clientid, float brightness, float seconds) {
+  if(light_curves[lightid] != NULL) {
+    set_leitshow_curve_fade(squidlights_light_attached_data(lightid), light_curves[lightid],
+			    brightness, seconds);
+  } else {
+    set_leitshow_fade(squidlights_light_attached_data(lightid), (int)(LEITSHOW_MAX_LEVEL*brightness), seconds);
+  }
 }
 void ba_yelight_on_handler(int lightid, int clientid) {
   ba_yelight_brightness_handler(lightid, clientid, 1.0);
@@ -61,10 +476,10 @@ void ba_yelight_off_handler(int lightid, int clientid) {
 /* brightness-unable light controllers */
 /* "of" means "on/off" */
 void of_yelight_on_handler(int lightid, int clientid) {
-  send_leitshow_packet(squidlights_light_attached_data(lightid), 254, 0);
+  set_leitshow_state(squidlights_light_attached_data(lightid), LEITSHOW_MAX_LEVEL, 0);
 }
 void of_yelight_off_handler(int lightid, int clientid) {
-  send_leitshow_packet(squidlights_light_attached_data(lightid), 0, 0);
+  set_leitshow_state(squidlights_light_attached_data(lightid), 0, 0);
 }
 
 int load_lights(char * filename) {
@@ -73,16 +488,23 @@ int load_lights(char * filename) {
     printf("couldn't open file %s\n", filename);
     return -1;
   }
-  char name[256];
+  char line[600], name[256], curvespec[256];
   int addr1, addr2;
   int hasbrightness;
   int ret;
-  while((ret=fscanf(fp, "%d %d %d %s", &hasbrightness, &addr1, &addr2, name)) != EOF) {
-    if(ret < 3) {
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    ret = sscanf(line, "%d %d %d %255s %255s", &hasbrightness, &addr1, &addr2, name, curvespec);
+    if(ret == EOF) {
+      continue; /* blank line */
+    }
+    if(ret < 4) {
       printf("parsing error for %s\n", filename);
       fclose(fp);
       return -1;
     }
+    if(ret < 5) {
+      strcpy(curvespec, "linear");
+    }
     printf("adding light \"%s\"\n", name);
     /* create the light */
     int lightid = squidlights_light_connect(name);
@@ -92,16 +514,39 @@ int load_lights(char * filename) {
     }
     /* attach its address on the serial controller */
     squidlights_light_attach_data(lightid, 32*addr1 + addr2);
+    /* and work out its curve */
+    if(lightid >= light_curves_cap) {
+      int cap = light_curves_cap ? 2*light_curves_cap : 64;
+      while(cap <= lightid) cap *= 2;
+      light_curves = realloc(light_curves, cap * sizeof(unsigned short *));
+      if(light_curves == NULL) {
+	perror("yeoldelights.c, realloc");
+	exit(1);
+      }
+      memset(light_curves + light_curves_cap, 0, (cap - light_curves_cap) * sizeof(unsigned short *));
+      light_curves_cap = cap;
+    }
+    if(hasbrightness && !sq_curve_is_linear(curvespec)) {
+      light_curves[lightid] = malloc((SQ_CURVE_STEPS + 1) * sizeof(unsigned short));
+      if(light_curves[lightid] == NULL
+	 || sq_curve_build(curvespec, LEITSHOW_MAX_LEVEL, light_curves[lightid])) {
+	printf("bad curve for \"%s\"\n", name);
+	fclose(fp);
+	return -1;
+      }
+    }
     /* attach the appropriate handlers */
     if(hasbrightness) {
       squidlights_light_add_on(lightid, &ba_yelight_on_handler);
       squidlights_light_add_off(lightid, &ba_yelight_off_handler);
       squidlights_light_add_brightness(lightid, &ba_yelight_brightness_handler);
+      squidlights_light_add_fade(lightid, &ba_yelight_fade_handler);
     } else {
       squidlights_light_add_on(lightid, &of_yelight_on_handler);
       squidlights_light_add_off(lightid, &of_yelight_off_handler);
     }
   }
+  fclose(fp);
   printf("finished adding lights.\n");
   return 0;
 }
@@ -111,6 +556,10 @@ int main(int argc, char** argv) {
     printf("serial error\n");
     exit(1);
   }
+  if(start_serial_writer()) {
+    printf("couldn't start the serial writer\n");
+    exit(1);
+  }
   if(squidlights_light_initialize()) {
     printf("couldn't initialize squidlights\n");
     exit(1);
@@ -124,4 +573,6 @@ int main(int argc, char** argv) {
     exit(1);
   }
   squidlights_light_run();
+  stop_serial_writer();
+  print_serial_stats();
 }
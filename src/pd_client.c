@@ -15,12 +15,16 @@ typedef struct _sqlight {
   t_symbol * i_light;
   t_int i_connected;
   t_int i_clientid;
-  t_int i_type; /* 0=on/off 1=brightness 2=rgb 3=hsi */
+  t_int i_type; /* 0=on/off 1=brightness 2=rgb 3=hsi 4=fade */
   t_int i_main_type; /* for data going into active inlet */
   t_int i_onq; /* is it on? */
   t_float i_bright; /* brightness */
+  t_float i_fade_secs; /* how long a fade to i_bright takes */
   t_float i_cr, i_cg, i_cb; /* rgb colors */
   t_float i_ch, i_cs, i_ci; /* hsi colors */
+  t_symbol * i_cached_light; /* i_light when i_cached_id was looked up */
+  t_int i_cached_id;
+  unsigned int i_cached_gen; /* squidlights_client_generation() then */
 } t_sqlight;
 
 #define SQLIGHT_NO_TYPE (-1)
@@ -28,6 +32,7 @@ typedef struct _sqlight {
 #define SQLIGHT_BRIGHT 1
 #define SQLIGHT_RGB 2
 #define SQLIGHT_HSI 3
+#define SQLIGHT_FADE 4
 
 static t_clock * sqlight_clock;
 
@@ -43,13 +48,22 @@ void sqlight_client_switch(t_sqlight *x, t_floatarg onq);
 void sqlight_client_set(t_sqlight *x, t_floatarg b);
 void sqlight_client_rgb(t_sqlight *x, t_floatarg r, t_floatarg g, t_floatarg b);
 void sqlight_client_hsi(t_sqlight *x, t_floatarg h, t_floatarg s, t_floatarg i);
+void sqlight_client_fade(t_sqlight *x, t_floatarg b, t_floatarg secs);
 
 void sqlight_send_data(t_sqlight *x) {
   if(x->i_connected < sqlight_reconnected_id) {
     sqlight_connect(x);
   }
   if(x->i_connected == sqlight_reconnected_id) {
-    int lightid = squidlights_client_getlight(x->i_light->s_name);
+    /* the lookup only has to be redone if the light's name changed
+       or some light came or went */
+    if(x->i_cached_light != x->i_light
+       || x->i_cached_gen != squidlights_client_generation()) {
+      x->i_cached_id = squidlights_client_getlight(x->i_light->s_name);
+      x->i_cached_light = x->i_light;
+      x->i_cached_gen = squidlights_client_generation();
+    }
+    int lightid = x->i_cached_id;
     if(lightid == SQ_UNDEFINED_LIGHT) {
       post("sqlight: no such light \"%s\"", x->i_light->s_name);
       return;
@@ -71,6 +85,9 @@ void sqlight_send_data(t_sqlight *x) {
     case SQLIGHT_HSI :
       squidlights_client_light_hsi(x->i_clientid, lightid, x->i_ch, x->i_cs, x->i_ci);
       break;
+    case SQLIGHT_FADE :
+      squidlights_client_light_fade(x->i_clientid, lightid, x->i_bright, x->i_fade_secs);
+      break;
     default :
       error("sqlight: no such light type %d", (int)x->i_type);
     }
@@ -86,7 +103,7 @@ void sqlight_bang(t_sqlight *x) {
 void sqlight_client_print_lights(t_sqlight *x) {
   post("Hello world \"%s\"!!", x->i_light->s_name);
   post("Lights:");
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
+  for(int i = 0; i < squidlights_client_num_lights(); i++) {
     char* lightname = squidlights_client_lightname(i);
     if(lightname[0] != '\0') {
       post("%d. %s", i, lightname);
@@ -148,6 +165,12 @@ void sqlight_client_hsi(t_sqlight *x, t_floatarg h, t_floatarg s, t_floatarg i)
   x->i_cs = s;
   x->i_ci = i;
 }
+/* instead of a line~ into bright, which sends every step */
+void sqlight_client_fade(t_sqlight *x, t_floatarg b, t_floatarg secs) {
+  x->i_type = SQLIGHT_FADE;
+  x->i_bright = b;
+  x->i_fade_secs = secs;
+}
 
 void sqlight_connect(t_sqlight *x) {
   if(x->i_connected == sqlight_reconnected_id) {
@@ -172,6 +195,7 @@ void sqlight_connect(t_sqlight *x) {
 void *sqlight_new(t_symbol * light, t_symbol * method) {
   t_sqlight *x = (t_sqlight *)pd_new(sqlight_class);
   x->i_light = light;
+  x->i_cached_light = NULL;
   
   if(sqlight_initialized) {
     sqlight_connect(x);
@@ -251,5 +275,6 @@ void sqlight_setup(void) {
   class_addmethod(sqlight_class, (t_method)sqlight_client_set, gensym("set"), A_DEFFLOAT, 0);
   class_addmethod(sqlight_class, (t_method)sqlight_client_rgb, gensym("rgb"), A_DEFFLOAT, A_DEFFLOAT, A_DEFFLOAT, 0);
   class_addmethod(sqlight_class, (t_method)sqlight_client_hsi, gensym("hsi"), A_DEFFLOAT, A_DEFFLOAT, A_DEFFLOAT, 0);
+  class_addmethod(sqlight_class, (t_method)sqlight_client_fade, gensym("fade"), A_DEFFLOAT, A_DEFFLOAT, 0);
   //  class_addlist(sqlight_class, (t_method)sqlight_setsignal);
 }
@@ -2,206 +2,2428 @@
    servers.  The point is to make sure things go where they're
    supposed to go. */
 
+#define _GNU_SOURCE /* accept4, recvmmsg, sync_file_range */
 #include "protocol.h"
+#include "shmring.h"
+#include "sqhash.h"
+#include "sqrecord.h"
+#include "sqtrace.h"
+#include "sqstats.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 
-struct client_s {
-  char name[32];
-  int isclient;
-  int clientid; /* not used yet */
-  int client_msqid;
+#define SERVER_RING_BURST 64 /* messages taken from a ring before moving on */
+#define SERVER_RETRY_MSEC 2 /* how soon to retry a light process that was full */
+#define SERVER_MAX_QUEUED 4 /* messages a light process may have waiting */
+#define SERVER_STATS_SEC 10 /* how often the frame clock reports timing */
+#define SERVER_PROC_QUEUE 64 /* batches held for a process under the drop policy */
+#define SERVER_PROCS 16 /* light process slots to start with */
+#define SERVER_STALL_MSEC 2000 /* how long a full process lasts under the disconnect policy */
+#define SERVER_EFFECT_HZ 40 /* how often effects are worked out without a frame clock */
+#define SERVER_LATE_USEC 1000 /* how far past its time a timed change is late */
+#define SERVER_PUBLISH_MSEC 100 /* how often the stats page is brought up to date */
+#define SERVER_REAP_MSEC 1000 /* how often rings are checked for owners that died */
+
+/* The routing tables.  Each is a structure of arrays, so the forward
+   path only touches the columns it needs (a light's local id and its
+   process) and never the names.  Free slots are kept on a free list,
+   live clients on a dense list for broadcasting, light names in a hash
+   index, and light processes by message queue in another.  All of
+   them grow as needed. */
+
+struct client_table_s {
+  int cap;
+  char (*name)[32];
+  char * isclient;
+  int * clientid; /* not used yet */
+  int * msqid;
+  int * sock; /* the socket peer, if the client connected that way, or -1 */
+  struct sq_ring ** ring; /* if the client sends over shared memory */
+  unsigned long long * msgs_in; /* for the stats page */
+  int * next_free;
+  int free_head;
+  int * live; /* dense list of live client ids */
+  int * live_pos; /* where each client is in live */
+  int nlive;
+};
+
+static struct client_table_s clients;
+
+/* a light process, which owns a message queue (and maybe a ring) and
+   any number of lights.  one on a socket is found through its peer. */
+struct proc_table_s {
+  int cap;
+  char * live;
+  int * msqid;
+  int * sock; /* the socket peer, if the process connected that way, or -1 */
+  int * pid; /* 0 until it adds a light */
+  struct sq_ring ** ring;
+  int ** dirty; /* lights with pending changes for this process */
+  int * ndirty;
+  int * dirty_cap;
+  char * policy; /* what to do when the process can't keep up */
+  long * full_since; /* msec when it last ran out of room, or 0 */
+  /* the process's own queue of batches, for POLICY_DROP */
+  struct light_batch_msg ** outq;
+  int * outq_head;
+  int * outq_count;
+  int * next_free;
+  int free_head;
+  int * hash_next; /* chains for the msqid index */
+  int * buckets;
+  int nbuckets;
+};
+
+static struct proc_table_s procs;
+
+struct light_counts_s {
+  unsigned long long in, out, coalesced;
+  int batched; /* entries in the batch flush_proc is putting together */
+};
+
+struct light_table_s {
+  int cap;
+  char * islight;
+  int * lightid; /* this is for the light server.  the client refers to
+		    a different id */
+  int * proc;
+  char (*name)[32];
+  int * next_free;
+  int free_head;
+  int * hash_next; /* chains for the name index */
+  int * buckets;
+  int nbuckets;
+  struct pending_s * pending;
+  struct pending_s * sent; /* what the light was last sent */
+  int * queued; /* the process whose dirty list has the light, or -1 */
+  struct sq_trace * trace; /* stamps of the latest traced change not yet
+			      sent (sent is 0 if none) */
+  struct light_counts_s * counts; /* for the stats page */
+};
+
+static struct light_table_s lights;
+
+/* Coalescing.  Light changes aren't forwarded as they come; they're
+   written over a light's pending state, one slot per channel, and the
+   pending states are flushed to a process whenever it has room.  So a
+   slow light process sees only the latest values, and its queue never
+   holds more than one batch per flush. */
+
+#define CHAN_SWITCH 0 /* on/off */
+#define CHAN_BRIGHT 1
+#define CHAN_RGB 2
+#define CHAN_HSI 3
+#define CHAN_FADE 4 /* replaces, and is replaced by, CHAN_BRIGHT */
+#define NUM_CHANS 5
+
+struct pending_s {
+  unsigned char mask; /* which channels have something */
+  unsigned char on;
+  float v[NUM_CHANS][3];
+  int clientid[NUM_CHANS];
+  unsigned int seq[NUM_CHANS]; /* so channels go out in the order written */
+};
+
+static unsigned int pending_seq = 0;
+
+/* Overflow policies, for when a light process has no room:
+   POLICY_COALESCE keeps only the latest value of each channel (the
+   pending states above), POLICY_DROP queues every change, throwing
+   away the oldest batch when the queue is full, and POLICY_DISCONNECT
+   coalesces but gives up on a process that stays full for
+   SERVER_STALL_MSEC. */
+#define POLICY_COALESCE 0
+#define POLICY_DROP 1
+#define POLICY_DISCONNECT 2
+
+static const char * policy_names[] = {"coalesce", "drop", "disconnect"};
+static int default_policy = POLICY_COALESCE;
+
+/* how often each policy fired */
+struct overflow_stats_s {
+  long coalesced; /* pending values written over before they went out */
+  long dropped; /* batches thrown away */
+  long disconnected; /* processes given up on */
+};
+
+static struct overflow_stats_s overflow_stats;
+
+/* the rest of what goes on the stats page */
+struct loop_stats_s {
+  unsigned long long loops;
+  unsigned long long loop_ns, loop_ns_max;
+  unsigned long long msgs_in, queue_msgs_in;
+  unsigned long long batches_out;
+  unsigned long long changes; /* taken, in all */
+};
+
+static struct loop_stats_s loop_stats;
+
+/* With a frame clock (-r), pending states only go out on ticks, and
+   only the channels that differ from what the light was last sent. */
+static int frame_hz = 0;
+
+/* Once a client sends traced batches (sqtrace.h), batches to lights
+   are kept short enough to carry the stamps, and the ones holding a
+   traced change carry the stamps of the oldest. */
+static char tracing = 0;
+
+/* processes with dirty lights */
+static int * dirty_procs;
+static int num_dirty_procs, dirty_procs_cap;
+static char * proc_queued;
+
+static void * grow(void * p, int n, size_t size) {
+  p = realloc(p, n * size);
+  if(p == NULL) {
+    printf("server.c: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void grow_clients(void) {
+  int old = clients.cap;
+  int cap = old ? 2*old : NUM_CLIENTS;
+  clients.name = grow(clients.name, cap, sizeof(*clients.name));
+  clients.isclient = grow(clients.isclient, cap, sizeof(char));
+  clients.clientid = grow(clients.clientid, cap, sizeof(int));
+  clients.msqid = grow(clients.msqid, cap, sizeof(int));
+  clients.sock = grow(clients.sock, cap, sizeof(int));
+  clients.ring = grow(clients.ring, cap, sizeof(struct sq_ring *));
+  clients.msgs_in = grow(clients.msgs_in, cap, sizeof(unsigned long long));
+  clients.next_free = grow(clients.next_free, cap, sizeof(int));
+  clients.live = grow(clients.live, cap, sizeof(int));
+  clients.live_pos = grow(clients.live_pos, cap, sizeof(int));
+  /* new slots go on the free list in order */
+  for(int i = cap-1; i >= old; i--) {
+    clients.isclient[i] = 0;
+    clients.ring[i] = NULL;
+    clients.next_free[i] = clients.free_head;
+    clients.free_head = i;
+  }
+  clients.cap = cap;
+}
+
+static void rehash_lights(void) {
+  lights.nbuckets = 2*lights.cap;
+  free(lights.buckets);
+  lights.buckets = grow(NULL, lights.nbuckets, sizeof(int));
+  for(int i = 0; i < lights.nbuckets; i++) {
+    lights.buckets[i] = -1;
+  }
+  for(int i = 0; i < lights.cap; i++) {
+    if(lights.islight[i]) {
+      int b = sq_name_hash(lights.name[i]) % lights.nbuckets;
+      lights.hash_next[i] = lights.buckets[b];
+      lights.buckets[b] = i;
+    }
+  }
+}
+
+static void grow_lights(void) {
+  int old = lights.cap;
+  int cap = old ? 2*old : NUM_LIGHT_SERVERS;
+  if(cap > 0x10000) {
+    cap = 0x10000; /* batches carry 16-bit ids */
+  }
+  lights.islight = grow(lights.islight, cap, sizeof(char));
+  lights.lightid = grow(lights.lightid, cap, sizeof(int));
+  lights.proc = grow(lights.proc, cap, sizeof(int));
+  lights.name = grow(lights.name, cap, sizeof(*lights.name));
+  lights.next_free = grow(lights.next_free, cap, sizeof(int));
+  lights.hash_next = grow(lights.hash_next, cap, sizeof(int));
+  lights.pending = grow(lights.pending, cap, sizeof(struct pending_s));
+  lights.sent = grow(lights.sent, cap, sizeof(struct pending_s));
+  lights.queued = grow(lights.queued, cap, sizeof(int));
+  lights.trace = grow(lights.trace, cap, sizeof(struct sq_trace));
+  lights.counts = grow(lights.counts, cap, sizeof(struct light_counts_s));
+  for(int i = cap-1; i >= old; i--) {
+    lights.islight[i] = 0;
+    lights.pending[i].mask = 0;
+    lights.queued[i] = -1;
+    lights.trace[i].sent = 0;
+    lights.next_free[i] = lights.free_head;
+    lights.free_head = i;
+  }
+  lights.cap = cap;
+  rehash_lights();
+}
+
+/* only processes on message queues are in the index */
+static void hash_proc(int p) {
+  if(procs.sock[p] == -1 && procs.msqid[p] != -1) {
+    int b = (unsigned int)procs.msqid[p] % procs.nbuckets;
+    procs.hash_next[p] = procs.buckets[b];
+    procs.buckets[b] = p;
+  }
+}
+
+static void unhash_proc(int p) {
+  if(procs.sock[p] == -1 && procs.msqid[p] != -1) {
+    int * q = &procs.buckets[(unsigned int)procs.msqid[p] % procs.nbuckets];
+    while(*q != -1 && *q != p) {
+      q = &procs.hash_next[*q];
+    }
+    if(*q == p) {
+      *q = procs.hash_next[p];
+    }
+  }
+}
+
+static void grow_procs(void) {
+  int old = procs.cap;
+  int cap = old ? 2*old : SERVER_PROCS;
+  procs.live = grow(procs.live, cap, sizeof(char));
+  procs.msqid = grow(procs.msqid, cap, sizeof(int));
+  procs.sock = grow(procs.sock, cap, sizeof(int));
+  procs.pid = grow(procs.pid, cap, sizeof(int));
+  procs.ring = grow(procs.ring, cap, sizeof(struct sq_ring *));
+  procs.dirty = grow(procs.dirty, cap, sizeof(int *));
+  procs.ndirty = grow(procs.ndirty, cap, sizeof(int));
+  procs.dirty_cap = grow(procs.dirty_cap, cap, sizeof(int));
+  proc_queued = grow(proc_queued, cap, sizeof(char));
+  procs.policy = grow(procs.policy, cap, sizeof(char));
+  procs.full_since = grow(procs.full_since, cap, sizeof(long));
+  procs.outq = grow(procs.outq, cap, sizeof(struct light_batch_msg *));
+  procs.outq_head = grow(procs.outq_head, cap, sizeof(int));
+  procs.outq_count = grow(procs.outq_count, cap, sizeof(int));
+  procs.next_free = grow(procs.next_free, cap, sizeof(int));
+  procs.hash_next = grow(procs.hash_next, cap, sizeof(int));
+  for(int i = cap-1; i >= old; i--) {
+    procs.live[i] = 0;
+    procs.msqid[i] = procs.sock[i] = -1;
+    procs.ring[i] = NULL;
+    procs.dirty[i] = NULL;
+    procs.ndirty[i] = procs.dirty_cap[i] = 0;
+    proc_queued[i] = 0;
+    procs.outq[i] = NULL;
+    procs.outq_count[i] = 0;
+    procs.next_free[i] = procs.free_head;
+    procs.free_head = i;
+  }
+  procs.cap = cap;
+  procs.nbuckets = 2*cap;
+  free(procs.buckets);
+  procs.buckets = grow(NULL, procs.nbuckets, sizeof(int));
+  for(int i = 0; i < procs.nbuckets; i++) {
+    procs.buckets[i] = -1;
+  }
+  for(int i = 0; i < procs.cap; i++) {
+    if(procs.live[i]) {
+      hash_proc(i);
+    }
+  }
+}
+
+static void init_tables(void) {
+  clients.free_head = -1;
+  lights.free_head = -1;
+  procs.free_head = -1;
+  grow_clients();
+  grow_lights();
+  grow_procs();
+}
+
+/* the time, wherever it's needed here, is sq_trace_now (CLOCK_MONOTONIC
+   in nsec), which is the clock clients stamp their changes with */
+
+/*** the recorder ***/
+
+/* With -o, every light change the server takes is written to a log
+   (see sqrecord.h).  The file is mapped in, so recording a change is
+   a store into memory.  A thread keeps the file grown (and its pages
+   mapped) ahead of where the main thread is writing, and pushes what's
+   been written out to the disk.  If the main thread ever catches up
+   with it, changes are dropped and counted rather than waited on. */
+
+#define RECORD_MAX_BYTES (1LL << 30) /* how much of the file is mapped */
+#define RECORD_CHUNK_BYTES (1 << 20) /* how much the file is grown by at a time */
+#define RECORD_AHEAD_BYTES (8 << 20) /* how far ahead of the records it's kept */
+#define RECORD_FLUSH_MSEC 100 /* how often written records go to disk */
+#define RECORD_NICE 10 /* for the thread */
+
+struct recorder_s {
+  char * path;
+  int fd;
+  struct sq_record_header * header; /* the start of the mapping */
+  struct sq_record * records;
+  unsigned long long count; /* records written */
+  unsigned long long ready; /* records the file has room for (from the thread) */
+  unsigned long long dropped;
+  char full; /* ran out of RECORD_MAX_BYTES */
+  volatile int running;
+  struct sq_doorbell bell; /* wakes the thread early */
+  pthread_t thread;
+};
+
+static struct recorder_s rec = { .fd = -1 };
+
+#define RECORD_MAX_COUNT ((RECORD_MAX_BYTES - sizeof(struct sq_record_header)) / sizeof(struct sq_record))
+
+void * recorder_thread(void * arg) {
+  off_t size = sizeof(struct sq_record_header);
+  off_t synced = 0; /* bytes whose writes have been started */
+  sigset_t sigs;
+  /* ^C is for the main thread, and this shouldn't take a cpu away
+     from it */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), RECORD_NICE);
+  for(;;) {
+    unsigned int ticket = sq_doorbell_ticket(&rec.bell);
+    int running = rec.running;
+    unsigned long long count = __atomic_load_n(&rec.header->count, __ATOMIC_ACQUIRE);
+    /* keep the file well ahead of the records, and touch the new
+       pages so the main thread doesn't fault on them */
+    off_t want = sizeof(struct sq_record_header) + count * sizeof(struct sq_record) + RECORD_AHEAD_BYTES;
+    if(want > RECORD_MAX_BYTES) {
+      want = RECORD_MAX_BYTES;
+    }
+    while(running && want > size) {
+      off_t next = (size + RECORD_CHUNK_BYTES) & ~(off_t)(RECORD_CHUNK_BYTES - 1);
+      if(next > RECORD_MAX_BYTES) {
+	next = RECORD_MAX_BYTES;
+      }
+      if(fallocate(rec.fd, 0, size, next - size) == -1 && ftruncate(rec.fd, next) == -1) {
+	perror("server.c, recorder ftruncate");
+	break;
+      }
+#ifdef MADV_POPULATE_WRITE
+      madvise((char *)rec.header + (size & ~4095L), next - (size & ~4095L), MADV_POPULATE_WRITE);
+#endif
+      size = next;
+      __atomic_store_n(&rec.ready, (size - sizeof(struct sq_record_header)) / sizeof(struct sq_record),
+		       __ATOMIC_RELEASE);
+    }
+    /* start the disk writes for the pages that have been filled.  the
+       one being written to is left alone, since writing it out would
+       make the main thread fault (or wait) on its next store. */
+    off_t filled = (sizeof(struct sq_record_header) + count * sizeof(struct sq_record)) & ~4095L;
+    if(filled > synced) {
+      sync_file_range(rec.fd, synced, filled - synced, SYNC_FILE_RANGE_WRITE);
+      synced = filled;
+    }
+    if(!running) {
+      break;
+    }
+    sq_doorbell_wait(&rec.bell, ticket, RECORD_FLUSH_MSEC);
+  }
+  return NULL;
+}
+
+int start_recorder(void) {
+  rec.fd = open(rec.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(rec.fd == -1) {
+    perror(rec.path);
+    return -1;
+  }
+  if(ftruncate(rec.fd, sizeof(struct sq_record_header)) == -1) {
+    perror(rec.path);
+    close(rec.fd);
+    return -1;
+  }
+  rec.header = mmap(NULL, RECORD_MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, rec.fd, 0);
+  if(rec.header == MAP_FAILED) {
+    perror("server.c, recorder mmap");
+    rec.header = NULL;
+    close(rec.fd);
+    return -1;
+  }
+  memcpy(rec.header->magic, SQ_RECORD_MAGIC, sizeof(SQ_RECORD_MAGIC));
+  rec.header->record_size = sizeof(struct sq_record);
+  rec.header->count = 0;
+  rec.header->start_usec = sq_trace_now() / 1000;
+  rec.records = (struct sq_record *)(rec.header + 1);
+  rec.running = 1;
+  if(pthread_create(&rec.thread, NULL, recorder_thread, NULL) != 0) {
+    perror("pthread_create");
+    munmap(rec.header, RECORD_MAX_BYTES);
+    rec.header = NULL;
+    close(rec.fd);
+    return -1;
+  }
+  /* don't start the show until there's some room */
+  while(__atomic_load_n(&rec.ready, __ATOMIC_ACQUIRE) == 0) {
+    usleep(1000);
+  }
+  printf("recording to %s\n", rec.path);
+  return 0;
+}
+
+void stop_recorder(void) {
+  if(rec.header == NULL) {
+    return;
+  }
+  rec.running = 0;
+  sq_doorbell_ring(&rec.bell);
+  pthread_join(rec.thread, NULL);
+  off_t size = sizeof(struct sq_record_header) + rec.count * sizeof(struct sq_record);
+  munmap(rec.header, RECORD_MAX_BYTES);
+  rec.header = NULL;
+  if(ftruncate(rec.fd, size) == -1 || fdatasync(rec.fd) == -1) {
+    perror(rec.path);
+  }
+  close(rec.fd);
+  printf("recorded %llu records to %s (%llu changes dropped)\n", rec.count, rec.path, rec.dropped);
+}
+
+/* room for n records, or NULL if there isn't any right now */
+static inline struct sq_record * record_slots(int n) {
+  unsigned long long ready = __atomic_load_n(&rec.ready, __ATOMIC_ACQUIRE);
+  if(rec.count + n + RECORD_AHEAD_BYTES / 2 / sizeof(struct sq_record) > ready && !rec.full) {
+    sq_doorbell_ring(&rec.bell); /* getting close */
+  }
+  if(rec.count + n > ready) {
+    if(rec.count + n > RECORD_MAX_COUNT && !rec.full) {
+      printf("the recording is full.  not recording any more.\n");
+      rec.full = 1;
+    }
+    rec.dropped++;
+    return NULL;
+  }
+  return &rec.records[rec.count];
+}
+
+static inline void record_commit(int n) {
+  rec.count += n;
+  __atomic_store_n(&rec.header->count, rec.count, __ATOMIC_RELEASE);
+}
+
+static void record_change(int id, int type, int clientid, float * v) {
+  struct sq_record * r = record_slots(1);
+  if(r == NULL) {
+    return;
+  }
+  r->usec = sq_trace_now() / 1000;
+  r->clientid = clientid;
+  r->light = id;
+  r->type = type;
+  r->more = 0;
+  if(v != NULL) {
+    memcpy(r->v, v, sizeof(r->v));
+  } else {
+    memset(r->v, 0, sizeof(r->v));
+  }
+  r->pad = 0;
+  record_commit(1);
+}
+
+/* light id came (islight=1) or went */
+static void record_light(int id, int islight) {
+  struct sq_record * r = rec.header ? record_slots(2) : NULL;
+  if(r == NULL) {
+    return;
+  }
+  memset(r, 0, 2 * sizeof(struct sq_record));
+  r->usec = sq_trace_now() / 1000;
+  r->light = id;
+  r->type = SQ_LIGHT_SET_NAME;
+  r->more = 1;
+  r->v[0] = islight;
+  memcpy(r + 1, lights.name[id], sizeof(lights.name[id]));
+  record_commit(2);
+}
+
+int get_free_light_id(void) {
+  if(lights.free_head == -1) {
+    if(lights.cap == 0x10000) {
+      return -1;
+    }
+    grow_lights();
+  }
+  int id = lights.free_head;
+  lights.free_head = lights.next_free[id];
+  return id;
+}
+
+int get_free_client_id(void) {
+  if(clients.free_head == -1) {
+    grow_clients();
+  }
+  int id = clients.free_head;
+  clients.free_head = clients.next_free[id];
+  return id;
+}
+
+/* the light called name, or -1 */
+int find_light(char * name) {
+  int i = lights.buckets[sq_name_hash(name) % lights.nbuckets];
+  while(i != -1 && strcmp(lights.name[i], name) != 0) {
+    i = lights.hash_next[i];
+  }
+  return i;
+}
+
+void add_light(int id, char * name, int lightid, int proc) {
+  snprintf(lights.name[id], sizeof(lights.name[id]), "%s", name);
+  lights.islight[id] = 1;
+  lights.lightid[id] = lightid;
+  lights.proc[id] = proc;
+  lights.pending[id].mask = 0;
+  lights.sent[id].mask = 0;
+  lights.queued[id] = -1;
+  lights.trace[id].sent = 0;
+  memset(&lights.counts[id], 0, sizeof(struct light_counts_s));
+  int b = sq_name_hash(lights.name[id]) % lights.nbuckets;
+  lights.hash_next[id] = lights.buckets[b];
+  lights.buckets[b] = id;
+  record_light(id, 1);
+}
+
+static void unhash_light(int id) {
+  int * p = &lights.buckets[sq_name_hash(lights.name[id]) % lights.nbuckets];
+  while(*p != id) {
+    p = &lights.hash_next[*p];
+  }
+  *p = lights.hash_next[id];
+}
+
+void remove_light(int id) {
+  record_light(id, 0);
+  unhash_light(id);
+  lights.islight[id] = 0;
+  lights.pending[id].mask = 0;
+  lights.queued[id] = -1;
+  lights.next_free[id] = lights.free_head;
+  lights.free_head = id;
+}
+
+/* a client can be dropped while we're draining its ring, so rings
+   are only unmapped between rounds of the main loop */
+static struct sq_ring ** retired_rings;
+static int num_retired_rings, retired_rings_cap;
+
+static void retire_ring(struct sq_ring * ring) {
+  if(num_retired_rings == retired_rings_cap) {
+    retired_rings_cap = retired_rings_cap ? 2*retired_rings_cap : 16;
+    retired_rings = grow(retired_rings, retired_rings_cap, sizeof(struct sq_ring *));
+  }
+  retired_rings[num_retired_rings++] = ring;
+}
+
+static void detach_retired_rings(void) {
+  while(num_retired_rings > 0) {
+    sq_ring_detach(retired_rings[--num_retired_rings]);
+  }
+}
+
+void add_client(int id, char * name, int clientid, int msqid, int sock) {
+  clients.msgs_in[id] = 0;
+  snprintf(clients.name[id], sizeof(clients.name[id]), "%s", name);
+  clients.isclient[id] = 1;
+  clients.clientid[id] = clientid;
+  clients.msqid[id] = msqid;
+  clients.sock[id] = sock;
+  clients.ring[id] = NULL;
+  clients.live_pos[id] = clients.nlive;
+  clients.live[clients.nlive++] = id;
+}
+
+void remove_client(int id) {
+  int last = clients.live[--clients.nlive];
+  clients.live[clients.live_pos[id]] = last;
+  clients.live_pos[last] = clients.live_pos[id];
+  clients.isclient[id] = 0;
+  if(clients.ring[id] != NULL) {
+    retire_ring(clients.ring[id]);
+    clients.ring[id] = NULL;
+  }
+  clients.next_free[id] = clients.free_head;
+  clients.free_head = id;
+}
+
+
+static int server_msqid;
+
+static volatile sig_atomic_t lights_keep_running;
+
+void server_sigint_handler(int sig) {
+  lights_keep_running = 0;
+}
+
+/* Everything that wakes the server rings the hub's doorbell: clients
+   on shared memory ring it directly, and the old message queue gets a
+   thread of its own which copies into legacy_ring and rings it. */
+static struct sq_hub * hub;
+static struct sq_ring * legacy_ring;
+
+/*** unix socket peers ***/
+
+/* Clients and light processes can also connect over a SOCK_SEQPACKET
+   unix socket, one message per packet.  A thread runs an epoll loop
+   over the sockets: it accepts connections, reads whatever each peer
+   has (recvmmsg, several messages per wakeup) into that peer's ring,
+   and tells the main loop about connects, hangups and writability
+   through peer_events.  Only the main thread writes to the sockets;
+   each peer has an outbound buffer for when its socket is full. */
+
+#define SERVER_MAX_PEERS 1024
+#define SERVER_PEER_BUFFER 256 /* messages buffered for a peer that's behind */
+#define PEER_RECV_BATCH 16
+
+#define PEER_CONNECTED 1
+#define PEER_GONE 2
+#define PEER_WRITABLE 3
+
+struct peer_s {
+  int fd; /* -1 if the slot is free */
+  struct sq_ring * in; /* filled by the socket thread */
+  /* the rest belongs to the main thread */
+  struct generic_msgbuf * out;
+  int * out_size;
+  int out_head, out_count;
+  int client; /* the client on this peer, or -1 */
+  int proc; /* the light process on this peer, or -1 */
+};
+
+static struct peer_s peers[SERVER_MAX_PEERS];
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER; /* for fd */
+static struct sq_ring * peer_events;
+static int live_peers[SERVER_MAX_PEERS]; /* main thread's list */
+static int num_live_peers = 0;
+static int listen_fd = -1, epoll_fd = -1;
+
+/* the process with queue msqid (or on socket peer sock, if that's
+   not -1), made if needed */
+int find_proc(int msqid, int sock) {
+  int p;
+  if(sock != -1) {
+    p = peers[sock].proc;
+    if(p != -1 && procs.live[p] && procs.sock[p] == sock) {
+      return p;
+    }
+  } else {
+    for(p = procs.buckets[(unsigned int)msqid % procs.nbuckets]; p != -1; p = procs.hash_next[p]) {
+      if(procs.msqid[p] == msqid) {
+	return p;
+      }
+    }
+  }
+  if(procs.free_head == -1) {
+    grow_procs();
+  }
+  p = procs.free_head;
+  procs.free_head = procs.next_free[p];
+  procs.live[p] = 1;
+  procs.msqid[p] = sock == -1 ? msqid : -1;
+  procs.sock[p] = sock;
+  procs.pid[p] = 0;
+  procs.ring[p] = NULL;
+  procs.ndirty[p] = 0;
+  procs.policy[p] = default_policy;
+  procs.full_since[p] = 0;
+  procs.outq_head[p] = 0;
+  procs.outq_count[p] = 0;
+  hash_proc(p);
+  return p;
+}
+
+/* puts process p's slot back (its lights are gone by now).  it may
+   still be on dirty_procs, which is fine: it has nothing to flush. */
+static void free_proc(int p) {
+  unhash_proc(p);
+  if(procs.ring[p] != NULL) {
+    retire_ring(procs.ring[p]);
+    procs.ring[p] = NULL;
+  }
+  procs.live[p] = 0;
+  procs.msqid[p] = procs.sock[p] = -1;
+  procs.ndirty[p] = 0;
+  procs.outq_count[p] = 0;
+  procs.next_free[p] = procs.free_head;
+  procs.free_head = p;
+}
+
+static void post_peer_event(int type, int pi) {
+  struct generic_msgbuf ev;
+  ev.mtype = type;
+  ev.lightid = pi;
+  ev.clientid = 0;
+  sq_ring_push_wait(peer_events, &ev, SIZEOF_MSG(struct generic_msgbuf), &hub->bell, -1);
+}
+
+static void accept_peers(void) {
+  int fd;
+  while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    int pi;
+    pthread_mutex_lock(&peers_lock);
+    for(pi = 0; pi < SERVER_MAX_PEERS && peers[pi].fd != -1; pi++);
+    if(pi < SERVER_MAX_PEERS) {
+      peers[pi].fd = fd;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    if(pi == SERVER_MAX_PEERS) {
+      printf("can't.  too many socket peers already.\n");
+      close(fd);
+      continue;
+    }
+    if(peers[pi].in == NULL) {
+      peers[pi].in = sq_ring_create(NULL);
+    }
+    post_peer_event(PEER_CONNECTED, pi);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = pi;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  if(errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("server.c, accept");
+  }
+}
+
+/* reads everything peer pi has sent.  Returns -1 if it hung up. */
+static int read_peer(int pi) {
+  struct generic_msgbuf bufs[PEER_RECV_BATCH];
+  struct mmsghdr hdrs[PEER_RECV_BATCH];
+  struct iovec iovs[PEER_RECV_BATCH];
+  for(int i = 0; i < PEER_RECV_BATCH; i++) {
+    iovs[i].iov_base = &bufs[i];
+    iovs[i].iov_len = sizeof(struct generic_msgbuf);
+    memset(&hdrs[i].msg_hdr, 0, sizeof(struct msghdr));
+    hdrs[i].msg_hdr.msg_iov = &iovs[i];
+    hdrs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for(;;) {
+    int n = recvmmsg(peers[pi].fd, hdrs, PEER_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if(n == -1) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    if(n == 0) {
+      return -1;
+    }
+    for(int i = 0; i < n; i++) {
+      if(hdrs[i].msg_len == 0) {
+	return -1; /* orderly shutdown */
+      }
+      if(hdrs[i].msg_len >= sizeof(long) + 2*sizeof(int)) {
+	sq_ring_push_wait(peers[pi].in, &bufs[i], hdrs[i].msg_len - sizeof(long), &hub->bell, -1);
+      }
+    }
+  }
+}
+
+void * socket_thread(void * arg) {
+  struct epoll_event evs[64];
+  while(lights_keep_running) {
+    int n = epoll_wait(epoll_fd, evs, 64, -1);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      perror("server.c, epoll_wait");
+      break;
+    }
+    for(int i = 0; i < n; i++) {
+      if(evs[i].data.u32 == SERVER_MAX_PEERS) {
+	accept_peers();
+	continue;
+      }
+      int pi = evs[i].data.u32;
+      int gone = 0;
+      if(evs[i].events & EPOLLIN) {
+	gone = read_peer(pi) == -1;
+      }
+      if(evs[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+	if(!gone) read_peer(pi);
+	gone = 1;
+      }
+      if(gone) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peers[pi].fd, NULL);
+	post_peer_event(PEER_GONE, pi);
+      } else if(evs[i].events & EPOLLOUT) {
+	post_peer_event(PEER_WRITABLE, pi);
+      }
+    }
+  }
+  return NULL;
+}
+
+int start_socket_core(void) {
+  struct sockaddr_un addr;
+  pthread_t sock_thread;
+  for(int i = 0; i < SERVER_MAX_PEERS; i++) {
+    peers[i].fd = -1;
+  }
+  if((peer_events = sq_ring_create(NULL)) == NULL) {
+    return -1;
+  }
+  if((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+    perror("server.c, socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, SQ_SERVER_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  unlink(SQ_SERVER_SOCKET_PATH);
+  if(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+     || listen(listen_fd, 64) == -1) {
+    perror("server.c, bind/listen");
+    return -1;
+  }
+  chmod(SQ_SERVER_SOCKET_PATH, 0666);
+  if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u32 = SERVER_MAX_PEERS; /* means the listening socket */
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  if(pthread_create(&sock_thread, NULL, socket_thread, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  printf("listening on %s\n", SQ_SERVER_SOCKET_PATH);
+  return 0;
+}
+
+void stop_socket_core(void) {
+  if(listen_fd != -1) {
+    close(listen_fd);
+    unlink(SQ_SERVER_SOCKET_PATH);
+  }
+}
+
+/* writes out what peer pi has buffered.  returns -1 on a socket error. */
+static int flush_peer(int pi) {
+  struct peer_s * pe = &peers[pi];
+  while(pe->out_count > 0) {
+    if(send(pe->fd, &pe->out[pe->out_head], pe->out_size[pe->out_head],
+	    MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return 0; /* wait for PEER_WRITABLE */
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    pe->out_head = (pe->out_head + 1) % SERVER_PEER_BUFFER;
+    pe->out_count--;
+  }
+  return 0;
+}
+
+/* sends a message to peer pi, buffering it if the socket is full.  A
+   peer that falls SERVER_PEER_BUFFER messages behind is cut off. */
+int peer_send(int pi, void * msg, int size) {
+  struct peer_s * pe = &peers[pi];
+  if(pe->fd == -1) {
+    return -1;
+  }
+  if(pe->out_count == 0) {
+    if(send(pe->fd, msg, size + sizeof(long), MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+      return 0;
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      shutdown(pe->fd, SHUT_RDWR);
+      return -1;
+    }
+  }
+  if(pe->out_count == SERVER_PEER_BUFFER) {
+    printf("socket peer %d is too far behind.  cutting it off.\n", pi);
+    shutdown(pe->fd, SHUT_RDWR); /* the socket thread will see the hangup */
+    return -1;
+  }
+  int slot = (pe->out_head + pe->out_count) % SERVER_PEER_BUFFER;
+  memcpy(&pe->out[slot], msg, size + sizeof(long));
+  pe->out_size[slot] = size + sizeof(long);
+  pe->out_count++;
+  return 0;
+}
+
+/* sends to client id, however it's connected */
+int send_to_client(int id, void * msg, int size) {
+  if(clients.sock[id] != -1) {
+    return peer_send(clients.sock[id], msg, size);
+  }
+  return msgsnd(clients.msqid[id], msg, size, 0);
+}
+
+/* Sends to light process p without waiting.  Returns 0 if sent, 1 if
+   the process has no room right now, and -1 if it's gone.  "Room"
+   means fewer than SERVER_MAX_QUEUED messages waiting: a deep queue
+   only delays the latest values behind stale ones. */
+int try_send_to_proc(int p, void * msg, int size) {
+  struct sq_ring * ring = procs.ring[p];
+  struct msqid_ds msq;
+  if(procs.sock[p] != -1) {
+    struct peer_s * pe = &peers[procs.sock[p]];
+    if(pe->out_count > 0) {
+      return 1;
+    }
+    if(send(pe->fd, msg, size + sizeof(long), MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+      return 0;
+    }
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+  }
+  if(ring != NULL) {
+    if(sq_ring_count(ring) < SERVER_MAX_QUEUED
+       && sq_ring_push(ring, msg, size, &ring->bell) == 0) {
+      return 0;
+    }
+    return msgctl(procs.msqid[p], IPC_STAT, &msq) == -1 ? -1 : 1;
+  }
+  if(msgctl(procs.msqid[p], IPC_STAT, &msq) == -1) {
+    return -1;
+  }
+  if(msq.msg_qnum >= SERVER_MAX_QUEUED) {
+    return 1;
+  }
+  if(msgsnd(procs.msqid[p], msg, size, IPC_NOWAIT) == 0) {
+    return 0;
+  }
+  return errno == EAGAIN ? 1 : -1;
+}
+
+void kill_lights_and_clients(void) {
+  struct generic_msgbuf msg;
+  msg.mtype = SQ_DIE;
+  while(clients.nlive > 0) {
+    int id = clients.live[0];
+    send_to_client(id, &msg, SIZEOF_MSG(struct generic_msgbuf));
+    remove_client(id);
+  }
+  /* once per process, and without waiting on any that are stuck */
+  for(int i = 0; i < lights.cap; i++) {
+    if(lights.islight[i]) {
+      int p = lights.proc[i];
+      if(procs.sock[p] != -1) {
+	peer_send(procs.sock[p], &msg, SIZEOF_MSG(struct generic_msgbuf));
+	procs.sock[p] = -1;
+      } else if(procs.msqid[p] != -1) {
+	struct sq_ring * ring = procs.ring[p];
+	if(ring == NULL || sq_ring_push(ring, &msg, SIZEOF_MSG(struct generic_msgbuf), &ring->bell) == -1) {
+	  msgsnd(procs.msqid[p], &msg, SIZEOF_MSG(struct generic_msgbuf), IPC_NOWAIT);
+	}
+	procs.msqid[p] = -1;
+      }
+      remove_light(i);
+    }
+  }
+  for(int k = 0; k < num_live_peers; k++) {
+    flush_peer(live_peers[k]);
+  }
+}
+
+
+void * legacy_receiver(void * arg) {
+  struct generic_msgbuf buf;
+  int tries = 0;
+  while(lights_keep_running && tries < 5) {
+    if(msgrcv(server_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, 0) == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EIDRM || errno == EINVAL) break; /* we're shutting down */
+      perror("server.c, run msgrcv");
+      printf("something catastrophic happened to the message queue?\n");
+      tries++;
+    } else {
+      tries = 0;
+      sq_ring_push_wait(legacy_ring, &buf, SIZEOF_MSG(struct generic_msgbuf), &hub->bell, -1);
+    }
+  }
+  if(tries >= 5) {
+    lights_keep_running = 0;
+    sq_doorbell_ring(&hub->bell);
+  }
+  return NULL;
+}
+
+void attach_ring(struct ring_attach_msg * ram) {
+  struct sq_ring * ring = sq_ring_attach(ram->shmname);
+  if(ring == NULL) {
+    printf("couldn't attach ring %s\n", ram->shmname);
+    return;
+  }
+  if(ram->islight) {
+    /* a light process offers its ring before it adds any lights */
+    int p = find_proc(ram->msqid, -1);
+    if(procs.ring[p] != NULL) {
+      sq_ring_detach(procs.ring[p]);
+    }
+    procs.ring[p] = ring;
+    printf("Attached light ring %s.\n", ram->shmname);
+  } else {
+    for(int k = 0; k < clients.nlive; k++) {
+      int i = clients.live[k];
+      if(clients.msqid[i] == ram->msqid) {
+	if(clients.ring[i] != NULL) {
+	  retire_ring(clients.ring[i]);
+	}
+	clients.ring[i] = ring;
+	printf("Attached ring %s to client \"%s\".\n", ram->shmname, clients.name[i]);
+	return;
+      }
+    }
+    printf("no client for ring %s\n", ram->shmname);
+    sq_ring_detach(ring);
+  }
+}
+
+void lose_client(int id) {
+  printf("lost client %s\n", clients.name[id]);
+  remove_client(id);
+}
+
+/* tells every client that light id came (islight=1) or went (0) */
+void announce_light(int id, int islight) {
+  struct light_init_msg lim;
+  lim.mtype = SQ_LIGHT_SET_NAME;
+  lim.lightid = id;
+  lim.msqid = islight;
+  strcpy(lim.name, lights.name[id]);
+  for(int k = 0; k < clients.nlive; k++) {
+    int i = clients.live[k];
+    if(send_to_client(i, &lim, SIZEOF_MSG(struct light_init_msg)) == -1) {
+      lose_client(i);
+      k--; /* the last live client took its place */
+    }
+  }
+}
+
+void lose_light(int id) {
+  printf("Lost light %d. Removing...\n", id);
+  printf("telling clients...\n");
+  announce_light(id, 0);
+  remove_light(id);
+}
+
+/* the whole process is gone, so all of its lights are */
+void lose_proc(int p) {
+  if(!procs.live[p]) {
+    return;
+  }
+  for(int id = 0; id < lights.cap; id++) {
+    if(lights.islight[id] && lights.proc[id] == p) {
+      lose_light(id);
+    }
+  }
+  free_proc(p);
+}
+
+/* whether light process p has gone without telling us: its queue is
+   gone, or it is */
+static int proc_gone(int p) {
+  struct msqid_ds msq;
+  if(procs.sock[p] != -1) {
+    return 0; /* we'd have seen the socket hang up */
+  }
+  if(procs.msqid[p] == -1 || msgctl(procs.msqid[p], IPC_STAT, &msq) == -1) {
+    return 1;
+  }
+  return procs.pid[p] > 0 && kill(procs.pid[p], 0) == -1 && errno == ESRCH;
+}
+
+static int chan_of(int type) {
+  switch(type) {
+  case SQ_LIGHT_ON :
+  case SQ_LIGHT_OFF : return CHAN_SWITCH;
+  case SQ_LIGHT_BRIGHTNESS : return CHAN_BRIGHT;
+  case SQ_LIGHT_RGB : return CHAN_RGB;
+  case SQ_LIGHT_HSI : return CHAN_HSI;
+  case SQ_LIGHT_FADE : return CHAN_FADE;
+  }
+  return -1;
+}
+
+static void mark_proc_dirty(int p) {
+  if(!proc_queued[p]) {
+    proc_queued[p] = 1;
+    if(num_dirty_procs == dirty_procs_cap) {
+      dirty_procs_cap = dirty_procs_cap ? 2*dirty_procs_cap : 16;
+      dirty_procs = grow(dirty_procs, dirty_procs_cap, sizeof(int));
+    }
+    dirty_procs[num_dirty_procs++] = p;
+  }
+}
+
+/* POLICY_DROP: adds a change to the end of process p's queue */
+static void enqueue(int p, int id, int type, int clientid, float * v) {
+  if(procs.outq[p] == NULL) {
+    procs.outq[p] = grow(NULL, SERVER_PROC_QUEUE, sizeof(struct light_batch_msg));
+  }
+  struct light_batch_msg * last = NULL;
+  if(procs.outq_count[p] > 0) {
+    last = &procs.outq[p][(procs.outq_head[p] + procs.outq_count[p] - 1) % SERVER_PROC_QUEUE];
+  }
+  if(last == NULL || last->count == SQ_BATCH_MAX || last->clientid != clientid) {
+    if(procs.outq_count[p] == SERVER_PROC_QUEUE) {
+      /* full: lose the oldest */
+      procs.outq_head[p] = (procs.outq_head[p] + 1) % SERVER_PROC_QUEUE;
+      procs.outq_count[p]--;
+      overflow_stats.dropped++;
+    }
+    last = &procs.outq[p][(procs.outq_head[p] + procs.outq_count[p]) % SERVER_PROC_QUEUE];
+    procs.outq_count[p]++;
+    last->mtype = SQ_LIGHT_BATCH;
+    last->count = 0;
+    last->clientid = clientid;
+  }
+  struct light_batch_entry * e = &last->entries[last->count++];
+  e->lightid = lights.lightid[id];
+  e->type = type;
+  e->pad = 0;
+  if(v != NULL) {
+    memcpy(e->v, v, sizeof(e->v));
+  } else {
+    memset(e->v, 0, sizeof(e->v));
+  }
+  lights.counts[id].out++;
+  mark_proc_dirty(p);
+}
+
+/* writes a change for light id (a client's id) over its pending state */
+void pend(int id, int type, int clientid, float * v) {
+  if(id < 0 || id >= lights.cap || !lights.islight[id]) {
+    printf("not a light: %d\n", id);
+    return;
+  }
+  int c = chan_of(type);
+  if(c == -1) {
+    printf("ignoring unknown light change %d\n", type);
+    return;
+  }
+  if(rec.header != NULL) {
+    record_change(id, type, clientid, c == CHAN_SWITCH ? NULL : v);
+  }
+  lights.counts[id].in++;
+  loop_stats.changes++;
+  if(procs.policy[lights.proc[id]] == POLICY_DROP) {
+    enqueue(lights.proc[id], id, type, clientid, c == CHAN_SWITCH ? NULL : v);
+    return;
+  }
+  struct pending_s * ps = &lights.pending[id];
+  /* a brightness cancels a fade that hasn't gone out yet, and the
+     other way around */
+  int over = 1 << c;
+  if(c == CHAN_BRIGHT) {
+    over |= 1 << CHAN_FADE;
+  } else if(c == CHAN_FADE) {
+    over |= 1 << CHAN_BRIGHT;
+  }
+  if(ps->mask & over) {
+    int n = __builtin_popcount(ps->mask & over);
+    overflow_stats.coalesced += n;
+    lights.counts[id].coalesced += n;
+  }
+  ps->mask = (ps->mask & ~over) | 1 << c;
+  ps->clientid[c] = clientid;
+  ps->seq[c] = pending_seq++;
+  if(c == CHAN_SWITCH) {
+    ps->on = (type == SQ_LIGHT_ON);
+  } else {
+    /* just the values the change has (a lone brightness message has
+       one), so same_as_sent doesn't compare whatever came after */
+    int nv = c == CHAN_BRIGHT ? 1 : c == CHAN_FADE ? 2 : 3;
+    memset(ps->v[c], 0, sizeof(ps->v[c]));
+    memcpy(ps->v[c], v, nv * sizeof(float));
+  }
+
+  int p = lights.proc[id];
+  if(lights.queued[id] != p) {
+    lights.queued[id] = p;
+    if(procs.ndirty[p] == procs.dirty_cap[p]) {
+      procs.dirty_cap[p] = procs.dirty_cap[p] ? 2*procs.dirty_cap[p] : 16;
+      procs.dirty[p] = grow(procs.dirty[p], procs.dirty_cap[p], sizeof(int));
+    }
+    procs.dirty[p][procs.ndirty[p]++] = id;
+    mark_proc_dirty(p);
+  }
+}
+
+static int same_as_sent(int id, int c) {
+  struct pending_s * ps = &lights.pending[id];
+  struct pending_s * ss = &lights.sent[id];
+  if(!(ss->mask & (1 << c))) {
+    return 0;
+  }
+  if(c == CHAN_SWITCH) {
+    return ps->on == ss->on;
+  }
+  return memcmp(ps->v[c], ss->v[c], sizeof(ps->v[c])) == 0;
+}
+
+/* the channel that undoes c on the light, or -1 */
+static int partner_of(int c) {
+  switch(c) {
+  case CHAN_BRIGHT : return CHAN_FADE;
+  case CHAN_FADE : return CHAN_BRIGHT;
+  case CHAN_RGB : return CHAN_HSI;
+  case CHAN_HSI : return CHAN_RGB;
+  }
+  return -1;
+}
+
+/* the channels chans of light id's pending state have been sent.  A
+   channel sent now replaces its partner in what the light was sent,
+   unless the partner went (or is still to go) out after it. */
+static void mark_sent(int id, int chans) {
+  struct pending_s * ps = &lights.pending[id];
+  struct pending_s * ss = &lights.sent[id];
+  for(int c = 0; c < NUM_CHANS; c++) {
+    if(!(ps->mask & chans & (1 << c))) {
+      continue;
+    }
+    int o = partner_of(c);
+    if(o != -1 && (ps->mask & (1 << o)) && (int)(ps->seq[o] - ps->seq[c]) > 0) {
+      continue;
+    }
+    ss->on = ps->on;
+    memcpy(ss->v[c], ps->v[c], sizeof(ps->v[c]));
+    ss->mask |= 1 << c;
+    if(o != -1) {
+      ss->mask &= ~(1 << o);
+    }
+  }
+  ps->mask &= ~chans;
+}
+
+/* A batch carries one clientid, so a light written by more than one
+   client goes out in pieces: this is its oldest pending channel and
+   the ones after it from the same client, up to the first from
+   another.  Sets *clientid to whose they are. */
+static int first_run(int id, int * clientid) {
+  struct pending_s * ps = &lights.pending[id];
+  int first = -1;
+  for(int c = 0; c < NUM_CHANS; c++) {
+    if((ps->mask & (1 << c)) && (first == -1 || (int)(ps->seq[c] - ps->seq[first]) < 0)) {
+      first = c;
+    }
+  }
+  *clientid = ps->clientid[first];
+  int cut = -1; /* the oldest channel from someone else */
+  for(int c = 0; c < NUM_CHANS; c++) {
+    if((ps->mask & (1 << c)) && ps->clientid[c] != *clientid
+       && (cut == -1 || (int)(ps->seq[c] - ps->seq[cut]) < 0)) {
+      cut = c;
+    }
+  }
+  int run = 0;
+  for(int c = 0; c < NUM_CHANS; c++) {
+    if((ps->mask & (1 << c)) && ps->clientid[c] == *clientid
+       && (cut == -1 || (int)(ps->seq[c] - ps->seq[cut]) < 0)) {
+      run |= 1 << c;
+    }
+  }
+  return run;
+}
+
+/* appends the channels chans of light id's pending state to a batch,
+   oldest first.  returns how many went in. */
+static int append_pending(struct light_batch_msg * out, int id, int chans) {
+  struct pending_s * ps = &lights.pending[id];
+  int order[NUM_CHANS], n = 0;
+  for(int c = 0; c < NUM_CHANS; c++) {
+    if(ps->mask & chans & (1 << c)) {
+      int k = n++;
+      while(k > 0 && (int)(ps->seq[order[k-1]] - ps->seq[c]) > 0) {
+	order[k] = order[k-1];
+	k--;
+      }
+      order[k] = c;
+    }
+  }
+  int appended = 0;
+  for(int k = 0; k < n; k++) {
+    int c = order[k];
+    if(frame_hz && same_as_sent(id, c)) {
+      continue;
+    }
+    appended++;
+    struct light_batch_entry * e = &out->entries[out->count++];
+    e->lightid = lights.lightid[id];
+    e->pad = 0;
+    switch(c) {
+    case CHAN_SWITCH : e->type = ps->on ? SQ_LIGHT_ON : SQ_LIGHT_OFF; break;
+    case CHAN_BRIGHT : e->type = SQ_LIGHT_BRIGHTNESS; break;
+    case CHAN_RGB : e->type = SQ_LIGHT_RGB; break;
+    case CHAN_HSI : e->type = SQ_LIGHT_HSI; break;
+    case CHAN_FADE : e->type = SQ_LIGHT_FADE; break;
+    }
+    memcpy(e->v, ps->v[c], sizeof(e->v));
+  }
+  return appended;
+}
+
+static int pending_entries(int id) {
+  return __builtin_popcount(lights.pending[id].mask);
+}
+
+/* POLICY_DROP: sends process p as much of its queue as it has room
+   for.  Returns 1 if anything is left over. */
+static int flush_queue(int p) {
+  while(procs.outq_count[p] > 0) {
+    int ret = try_send_to_proc(p, &procs.outq[p][procs.outq_head[p]], SIZEOF_MSG(struct light_batch_msg));
+    if(ret == 1) {
+      return 1;
+    }
+    if(ret == -1) {
+      lose_proc(p);
+      return 0;
+    }
+    procs.outq_head[p] = (procs.outq_head[p] + 1) % SERVER_PROC_QUEUE;
+    procs.outq_count[p]--;
+    loop_stats.batches_out++;
+  }
+  return 0;
+}
+
+/* sends process p as much of its pending state as it has room for.
+   Returns 1 if anything is left over. */
+int flush_proc(int p) {
+  struct light_batch_msg out;
+  struct light_traced_batch_msg traced;
+  int max = tracing ? SQ_TRACED_BATCH_MAX : SQ_BATCH_MAX;
+  if(procs.outq_count[p] > 0 && flush_queue(p)) {
+    return 1;
+  }
+  int * dirty = procs.dirty[p];
+  int done = 0; /* lights before this in dirty have been sent */
+  int next = 0;
+  while(next < procs.ndirty[p]) {
+    int part = 0; /* the channels of dirty[next] in the batch, if not all of them are */
+    out.mtype = SQ_LIGHT_BATCH;
+    out.count = 0;
+    out.clientid = 0;
+    traced.trace.sent = 0;
+    /* pack whole lights from one client, so a light's channels stay
+       in order and each change goes out with whoever made it */
+    while(next < procs.ndirty[p]) {
+      int id = dirty[next], clientid;
+      if(lights.queued[id] != p || !lights.islight[id] || lights.pending[id].mask == 0) {
+	lights.counts[id].batched = 0;
+	next++; /* stale */
+	continue;
+      }
+      int run = first_run(id, &clientid);
+      if(out.count > 0 && (clientid != out.clientid || out.count + __builtin_popcount(run) > max)) {
+	break;
+      }
+      out.clientid = clientid;
+      lights.counts[id].batched = append_pending(&out, id, run);
+      if(lights.trace[id].sent != 0
+	 && (traced.trace.sent == 0 || lights.trace[id].sent < traced.trace.sent)) {
+	traced.trace = lights.trace[id];
+      }
+      if(run != lights.pending[id].mask) {
+	part = run; /* the rest goes in the next batch */
+	break;
+      }
+      next++;
+    }
+    if(out.count == 0) {
+      /* nothing that differs from what was sent */
+      for(int k = done; k < next; k++) {
+	if(lights.queued[dirty[k]] == p) {
+	  lights.counts[dirty[k]].coalesced += pending_entries(dirty[k]);
+	  lights.pending[dirty[k]].mask = 0;
+	  lights.queued[dirty[k]] = -1;
+	  lights.trace[dirty[k]].sent = 0;
+	}
+      }
+      if(part) {
+	lights.counts[dirty[next]].coalesced += __builtin_popcount(part);
+	lights.pending[dirty[next]].mask &= ~part;
+      }
+      done = next;
+      if(next < procs.ndirty[p]) continue;
+      break;
+    }
+    int ret;
+    if(traced.trace.sent != 0) {
+      traced.mtype = SQ_LIGHT_TRACED_BATCH;
+      traced.count = out.count;
+      traced.clientid = out.clientid;
+      memcpy(traced.entries, out.entries, out.count * sizeof(struct light_batch_entry));
+      traced.trace.forwarded = sq_trace_now();
+      ret = try_send_to_proc(p, &traced, SIZEOF_MSG(struct light_traced_batch_msg));
+    } else {
+      ret = try_send_to_proc(p, &out, SIZEOF_MSG(struct light_batch_msg));
+    }
+    if(ret == 1) {
+      break;
+    }
+    if(ret == -1) {
+      lose_proc(p);
+      return 0;
+    }
+    loop_stats.batches_out++;
+    for(int k = done; k < next; k++) {
+      int id = dirty[k];
+      if(lights.queued[id] == p) {
+	/* what wasn't batched was the same as what had gone out */
+	lights.counts[id].out += lights.counts[id].batched;
+	lights.counts[id].coalesced += pending_entries(id) - lights.counts[id].batched;
+	mark_sent(id, lights.pending[id].mask);
+	lights.queued[id] = -1;
+	lights.trace[id].sent = 0;
+      }
+    }
+    if(part) {
+      int id = dirty[next];
+      lights.counts[id].out += lights.counts[id].batched;
+      lights.counts[id].coalesced += __builtin_popcount(part) - lights.counts[id].batched;
+      mark_sent(id, part);
+      lights.trace[id].sent = 0;
+    }
+    done = next;
+  }
+  /* keep what's left */
+  memmove(dirty, dirty + done, (procs.ndirty[p] - done) * sizeof(int));
+  procs.ndirty[p] -= done;
+  return procs.ndirty[p] > 0;
+}
+
+/* POLICY_DISCONNECT: tells a stuck process to die and forgets it */
+static void disconnect_proc(int p) {
+  struct generic_msgbuf msg;
+  msg.mtype = SQ_DIE;
+  printf("light process %d has been full for %dms.  disconnecting it.\n", p, SERVER_STALL_MSEC);
+  overflow_stats.disconnected++;
+  if(procs.sock[p] != -1) {
+    shutdown(peers[procs.sock[p]].fd, SHUT_RDWR);
+  } else if(procs.msqid[p] != -1) {
+    msgsnd(procs.msqid[p], &msg, SIZEOF_MSG(struct generic_msgbuf), IPC_NOWAIT);
+  }
+  lose_proc(p);
+}
+
+/* flushes every process with pending changes.  Returns 1 if some
+   process couldn't take everything. */
+int flush_pending(void) {
+  int n = 0;
+  long now = 0;
+  for(int k = 0; k < num_dirty_procs; k++) {
+    int p = dirty_procs[k];
+    if(flush_proc(p)) {
+      if(procs.full_since[p] == 0) {
+	procs.full_since[p] = now ? now : (now = sq_trace_now() / 1000000);
+      } else if(procs.policy[p] == POLICY_DISCONNECT
+		&& (now ? now : (now = sq_trace_now() / 1000000)) - procs.full_since[p] > SERVER_STALL_MSEC) {
+	disconnect_proc(p);
+	proc_queued[p] = 0;
+	continue;
+      }
+      dirty_procs[n++] = p;
+    } else {
+      procs.full_since[p] = 0;
+      proc_queued[p] = 0;
+    }
+  }
+  num_dirty_procs = n;
+  return n > 0;
+}
+
+void print_overflow_stats(void) {
+  printf("overflow (%s): coalesced %ld, dropped %ld, disconnected %ld\n",
+	 policy_names[default_policy], overflow_stats.coalesced,
+	 overflow_stats.dropped, overflow_stats.disconnected);
+}
+
+/*** effects ***/
+
+/* The effects that are running (see SQ_EFFECT in protocol.h).  Each
+   remembers what it last gave each of its lights, so that it only
+   pends the ones that changed. */
+struct effect_s {
+  struct effect_msg msg;
+  double start; /* seconds */
+  char sent[SQ_EFFECT_MAX_LIGHTS];
+  float last[SQ_EFFECT_MAX_LIGHTS][3];
+};
+
+static struct effect_s * effects[SQ_MAX_EFFECTS]; /* NULL if not running */
+static int num_effects = 0;
+static double effects_next = 0; /* when they're due without a frame clock */
+
+static const char * effect_names[] = {"stop", "chase", "strobe", "pulse", "rainbow"};
+
+void start_effect(struct effect_msg * em) {
+  if(em->effectid < 0 || em->effectid >= SQ_MAX_EFFECTS
+     || em->kind < SQ_EFFECT_STOP || em->kind > SQ_EFFECT_RAINBOW) {
+    printf("bad effect %d (kind %d)\n", em->effectid, em->kind);
+    return;
+  }
+  struct effect_s * e = effects[em->effectid];
+  if(em->kind == SQ_EFFECT_STOP) {
+    if(e != NULL) {
+      printf("stopping effect %d\n", em->effectid);
+      free(e);
+      effects[em->effectid] = NULL;
+      num_effects--;
+    }
+    return;
+  }
+  if(e == NULL) {
+    e = effects[em->effectid] = grow(NULL, 1, sizeof(struct effect_s));
+    num_effects++;
+  }
+  e->msg = *em;
+  if(e->msg.nlights < 0) e->msg.nlights = 0;
+  if(e->msg.nlights > SQ_EFFECT_MAX_LIGHTS) e->msg.nlights = SQ_EFFECT_MAX_LIGHTS;
+  e->start = sq_trace_now() / 1e9;
+  memset(e->sent, 0, sizeof(e->sent));
+  printf("effect %d: %s of %d lights at %g Hz\n", em->effectid, effect_names[em->kind],
+	 e->msg.nlights, e->msg.rate);
+}
+
+/* works out every effect at time now (seconds) and pends what changed */
+void run_effects(double now) {
+  for(int k = 0; k < SQ_MAX_EFFECTS && num_effects > 0; k++) {
+    struct effect_s * e = effects[k];
+    if(e == NULL) {
+      continue;
+    }
+    struct effect_msg * em = &e->msg;
+    int n = em->nlights;
+    double cycle = (now - e->start) * em->rate + em->phase;
+    float spread = em->kind == SQ_EFFECT_CHASE ? 1.0f / n : em->spread;
+    float duty = em->kind == SQ_EFFECT_CHASE ? 1.0f / n : em->duty;
+    for(int j = 0; j < n; j++) {
+      int id = em->lights[j];
+      if(id >= lights.cap || !lights.islight[id]) {
+	continue; /* it may come back */
+      }
+      double x = cycle - j * spread;
+      x -= floor(x);
+      float v[3], level;
+      int type;
+      switch(em->kind) {
+      case SQ_EFFECT_PULSE :
+	level = em->i * (1 - cos(2 * M_PI * x)) / 2;
+	break;
+      case SQ_EFFECT_RAINBOW :
+	level = em->i;
+	break;
+      default : /* chase, strobe */
+	level = x < duty ? em->i : 0;
+      }
+      if(em->kind != SQ_EFFECT_RAINBOW && em->s == 0) {
+	type = SQ_LIGHT_BRIGHTNESS;
+	v[0] = level;
+	v[1] = v[2] = 0;
+      } else {
+	type = SQ_LIGHT_HSI;
+	v[0] = em->kind == SQ_EFFECT_RAINBOW ? em->h + 360 * x : em->h;
+	v[1] = em->s;
+	v[2] = level;
+      }
+      if(e->sent[j] && memcmp(v, e->last[j], sizeof(v)) == 0) {
+	continue;
+      }
+      e->sent[j] = 1;
+      memcpy(e->last[j], v, sizeof(v));
+      pend(id, type, em->clientid, v);
+    }
+  }
+}
+
+/* without a frame clock: runs the effects if they're due, and returns
+   how many msec until they're due again (-1 if there are none) */
+int run_effects_if_due(void) {
+  if(num_effects == 0) {
+    return -1;
+  }
+  double now = sq_trace_now() / 1e9;
+  if(now >= effects_next) {
+    run_effects(now);
+    effects_next = now + 1.0 / SERVER_EFFECT_HZ;
+  }
+  return (int)((effects_next - now) * 1000) + 1;
+}
+
+/*** timed changes ***/
+
+/* Timed batches (SQ_LIGHT_TIMED_BATCH) wait in a hierarchical timing
+   wheel until they're due, and are then pended like any other change.
+   The wheel turns in WHEEL_TICK_USEC steps.  Level 0 has a slot for
+   each of the next WHEEL_SIZE ticks, level 1 a slot for each
+   WHEEL_SIZE of those, and so on; when level 0 comes round, the next
+   slot of level 1 is spread out over it (and likewise up the levels).
+   So adding and releasing are constant time however many are
+   waiting.  A batch is due in the first tick at or after its time. */
+
+#define WHEEL_TICK_USEC 1000
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* 2^32 ticks, about 50 days */
+
+struct timed_s {
+  struct timed_s * next;
+  unsigned long long tick; /* when it's due */
+  struct light_timed_batch_msg msg;
 };
 
-struct client_s clients[NUM_CLIENTS];
+static struct timed_s * wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long long wheel_now = 0; /* ticks up to here are done */
+static int wheel_count = 0;
+static struct timed_s * timed_free; /* spare nodes */
 
-struct light_server_s {
-  char name[32];
-  char islight;
-  int lightid; /* this is for the light server.  the client refers to
-		  a different id */
-  int light_msqid;
+/* what became of timed changes */
+struct timed_stats_s {
+  long scheduled; /* held for later */
+  long on_time; /* arrived at about their time */
+  long late; /* arrived more than SERVER_LATE_USEC after it */
+  long dropped; /* late ones thrown away (-l drop) */
+  double late_max; /* usec */
 };
 
-struct light_server_s light_servers[NUM_LIGHT_SERVERS];
+static struct timed_stats_s timed_stats;
+static char late_drop = 0; /* -l drop */
 
-int get_free_light_id(void) {
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
-    if(!light_servers[i].islight) {
-      return i;
+static void wheel_insert(struct timed_s * t) {
+  unsigned long long delta = t->tick > wheel_now ? t->tick - wheel_now : 0;
+  int level = 0;
+  while(level < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  if(level == WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_BITS * WHEEL_LEVELS)) {
+    t->tick = wheel_now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1; /* that's far enough */
+  }
+  struct timed_s ** slot = &wheel[level][(t->tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+  t->next = *slot;
+  *slot = t;
+}
+
+static void release_timed(struct timed_s * t) {
+  struct light_timed_batch_msg * tb = &t->msg;
+  for(int i = 0; i < tb->count && i < SQ_TIMED_BATCH_MAX; i++) {
+    pend(tb->entries[i].lightid, tb->entries[i].type, tb->clientid, tb->entries[i].v);
+  }
+  t->next = timed_free;
+  timed_free = t;
+  wheel_count--;
+}
+
+/* moves level's slot for wheel_now down the wheel */
+static void wheel_cascade(int level) {
+  int idx = (wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+  if(idx == 0 && level + 1 < WHEEL_LEVELS) {
+    wheel_cascade(level + 1);
+  }
+  struct timed_s * t = wheel[level][idx];
+  wheel[level][idx] = NULL;
+  while(t != NULL) {
+    struct timed_s * next = t->next;
+    wheel_insert(t);
+    t = next;
+  }
+}
+
+/* releases everything that's due.  Returns how many msec until the
+   wheel needs turning again, or -1 if nothing is waiting. */
+int run_wheel(void) {
+  unsigned long long now = sq_trace_now() / 1000 / WHEEL_TICK_USEC;
+  if(wheel_count == 0) {
+    wheel_now = now;
+    return -1;
+  }
+  while(wheel_now < now) {
+    wheel_now++;
+    int idx = wheel_now & (WHEEL_SIZE - 1);
+    if(idx == 0) {
+      wheel_cascade(1);
+    }
+    struct timed_s * t = wheel[0][idx];
+    wheel[0][idx] = NULL;
+    while(t != NULL) {
+      struct timed_s * next = t->next;
+      release_timed(t);
+      t = next;
     }
   }
-  return -1;
+  if(wheel_count == 0) {
+    return -1;
+  }
+  /* the next full slot of level 0, or else the next cascade */
+  int k = 1;
+  while(k < WHEEL_SIZE - (int)(wheel_now & (WHEEL_SIZE - 1))
+	&& wheel[0][(wheel_now + k) & (WHEEL_SIZE - 1)] == NULL) {
+    k++;
+  }
+  long long wait = (long long)(wheel_now + k) * WHEEL_TICK_USEC - sq_trace_now() / 1000;
+  return wait > 0 ? (int)((wait + 999) / 1000) : 0;
 }
 
-int get_free_client_id(void) {
-  for(int i = 0; i < NUM_CLIENTS; i++) {
-    if(!clients[i].isclient) {
-      return i;
+void handle_timed_batch(struct light_timed_batch_msg * tb) {
+  long long now = sq_trace_now() / 1000;
+  if(tb->at > now) {
+    struct timed_s * t = timed_free;
+    if(t != NULL) {
+      timed_free = t->next;
+    } else {
+      t = grow(NULL, 1, sizeof(struct timed_s));
     }
+    t->msg = *tb;
+    t->tick = (tb->at + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC;
+    if(wheel_count == 0) {
+      wheel_now = now / WHEEL_TICK_USEC;
+    }
+    wheel_insert(t);
+    wheel_count++;
+    timed_stats.scheduled++;
+    return;
+  }
+  double late = now - tb->at;
+  if(late > timed_stats.late_max) {
+    timed_stats.late_max = late;
+  }
+  if(late <= SERVER_LATE_USEC) {
+    timed_stats.on_time++;
+  } else {
+    timed_stats.late++;
+    if(late_drop) {
+      timed_stats.dropped++;
+      return;
+    }
+  }
+  for(int i = 0; i < tb->count && i < SQ_TIMED_BATCH_MAX; i++) {
+    pend(tb->entries[i].lightid, tb->entries[i].type, tb->clientid, tb->entries[i].v);
   }
-  return -1;
 }
 
-void kill_lights_and_clients(void) {
-  struct generic_msgbuf msg;
-  msg.mtype = SQ_DIE;
-  for(int i = 0; i < NUM_CLIENTS; i++) {
-    if(clients[i].isclient) {
-      clients[i].isclient = 0;
-      msgsnd(clients[i].client_msqid, &msg, SIZEOF_MSG(struct generic_msgbuf), 0);
+void print_timed_stats(void) {
+  struct timed_stats_s * ts = &timed_stats;
+  if(ts->scheduled + ts->on_time + ts->late == 0) {
+    return;
+  }
+  printf("timed: %ld held, %ld on time, %ld late (%ld dropped), latest by %.0fus, %d waiting\n",
+	 ts->scheduled, ts->on_time, ts->late, ts->dropped, ts->late_max, wheel_count);
+}
+
+/* peer is the socket peer buf came from, or -1 if it came from a
+   queue or ring */
+void handle_msg(struct generic_msgbuf * buf, int peer) {
+  int id;
+  switch(buf->mtype) {
+  case SQ_LIGHT_SET_NAME : {
+    struct light_init_msg * buf2 = (struct light_init_msg *) buf;
+    printf("adding light...\n");
+    id = find_light(buf2->name);
+    if(id != -1 && !proc_gone(lights.proc[id])) {
+      printf("there's already a light \"%s\".  ignoring the new one.\n", buf2->name);
+      break;
+    }
+    if(id != -1) {
+      /* its process died without us noticing.  keep the id so clients
+	 don't have to look it up again. */
+      printf("light \"%s\" is back.\n", buf2->name);
+      unhash_light(id);
+    } else {
+      id = get_free_light_id();
+    }
+    if(id == -1) {
+      printf("can't.  too many lights already.\n");
+    } else {
+      int p = find_proc(buf2->msqid, peer);
+      if(peer != -1) {
+	peers[peer].proc = p;
+      }
+      procs.pid[p] = buf2->pid;
+      add_light(id, buf2->name, buf2->lightid, p);
+
+      printf("Added light %d \"%s\" with id %d.\n", id, lights.name[id],
+	     lights.lightid[id]);
+	  
+      printf("telling clients...\n");
+      announce_light(id, 1);
+    }
+    break;
+  }
+  case SQ_LIGHT_ON :
+  case SQ_LIGHT_OFF :
+  case SQ_LIGHT_BRIGHTNESS :
+  case SQ_LIGHT_RGB :
+  case SQ_LIGHT_HSI :
+  case SQ_LIGHT_FADE :
+    /* the values (if any) come right after the ids in all of these */
+    pend(buf->lightid, buf->mtype, buf->clientid, (float *) buf->mtext);
+    break;
+  case SQ_LIGHT_BATCH : {
+    struct light_batch_msg * batch = (struct light_batch_msg *) buf;
+    for(int i = 0; i < batch->count && i < SQ_BATCH_MAX; i++) {
+      pend(batch->entries[i].lightid, batch->entries[i].type, batch->clientid,
+	   batch->entries[i].v);
     }
+    break;
   }
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
-    if(light_servers[i].islight) {
-      light_servers[i].islight = 0;
-      msgsnd(light_servers[i].light_msqid, &msg, SIZEOF_MSG(struct generic_msgbuf), 0);
+  case SQ_LIGHT_TRACED_BATCH : {
+    struct light_traced_batch_msg * batch = (struct light_traced_batch_msg *) buf;
+    batch->trace.received = sq_trace_now();
+    tracing = 1;
+    for(int i = 0; i < batch->count && i < SQ_TRACED_BATCH_MAX; i++) {
+      id = batch->entries[i].lightid;
+      pend(id, batch->entries[i].type, batch->clientid, batch->entries[i].v);
+      if(id < lights.cap && lights.islight[id]) {
+	lights.trace[id] = batch->trace; /* the value that will go out is this one */
+      }
+    }
+    break;
+  }
+  case SQ_CLIENT_SET_NAME : {
+    struct client_init_msg * buf2 = (struct client_init_msg *) buf;
+    printf("adding client...\n");
+    id = get_free_client_id();
+    add_client(id, buf2->name, buf2->clientid, buf2->msqid, peer);
+    if(peer != -1) {
+      peers[peer].client = id;
+    }
+
+    printf("Added client %d \"%s\" with id %d.\n", id, clients.name[id], clients.clientid[id]);
+    printf("Sending light info...\n");
+    struct light_init_msg lim;
+    for(int i = 0; i < lights.cap; i++) {
+      if(lights.islight[i]) {
+	lim.mtype = SQ_LIGHT_SET_NAME;
+	lim.lightid = i;
+	lim.msqid = 1;
+	strcpy(lim.name, lights.name[i]);
+	printf("%d ", i);
+	send_to_client(id, &lim, SIZEOF_MSG(struct light_init_msg));
+      }
+    }
+    lim.mtype = SQ_LIGHT_SET_NAME;
+    lim.lightid = -1; /* sentinel */
+    lim.name[0] = '\0';
+    send_to_client(id, &lim, SIZEOF_MSG(struct light_init_msg));
+    printf(" done\n");
+    break;
+  }
+  case SQ_EFFECT :
+    start_effect((struct effect_msg *) buf);
+    break;
+  case SQ_LIGHT_TIMED_BATCH :
+    handle_timed_batch((struct light_timed_batch_msg *) buf);
+    break;
+  case SQ_ATTACH_RING :
+    if(peer == -1) {
+      attach_ring((struct ring_attach_msg *) buf);
     }
+    break;
+	
+    //      case SQ_DIE :
+    //	break;
+	
+  default :
+    printf("Unknown message %ld...", buf->mtype);
+    break;
   }
 }
 
-static int server_msqid;
+/*** the frame clock ***/
 
-static volatile sig_atomic_t lights_keep_running;
+/* A thread reads the timerfd and rings the doorbell; the main loop
+   takes the ticks from frame_ticks. */
+static int frame_timerfd = -1;
+static unsigned long frame_ticks = 0;
 
-void server_sigint_handler(int sig) {
-  lights_keep_running = 0;
+struct frame_stats_s {
+  long frames;
+  long missed; /* ticks that came and went while we were busy */
+  double late_sum, late_max; /* usec from the ideal tick time to the flush */
+  double flush_sum, flush_max; /* usec spent flushing */
+};
+
+static struct frame_stats_s frame_stats;
+static struct timespec frame_next; /* ideal time of the next tick */
+
+static double usec_between(struct timespec * a, struct timespec * b) {
+  return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+static void timespec_add_nsec(struct timespec * t, long nsec) {
+  t->tv_nsec += nsec;
+  while(t->tv_nsec >= 1000000000L) {
+    t->tv_nsec -= 1000000000L;
+    t->tv_sec++;
+  }
+}
+
+void * frame_clock(void * arg) {
+  unsigned long long expirations;
+  while(lights_keep_running) {
+    if(read(frame_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      if(errno == EINTR) continue;
+      perror("server.c, frame clock read");
+      break;
+    }
+    __atomic_add_fetch(&frame_ticks, expirations, __ATOMIC_SEQ_CST);
+    sq_doorbell_ring(&hub->bell);
+  }
+  return NULL;
+}
+
+int start_frame_clock(void) {
+  struct itimerspec its;
+  long period = 1000000000L / frame_hz;
+  pthread_t clock_thread;
+  if((frame_timerfd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+    perror("timerfd_create");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+  timespec_add_nsec(&its.it_value, period);
+  its.it_interval.tv_sec = period / 1000000000L;
+  its.it_interval.tv_nsec = period % 1000000000L;
+  frame_next = its.it_value;
+  if(timerfd_settime(frame_timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    perror("timerfd_settime");
+    return -1;
+  }
+  if(pthread_create(&clock_thread, NULL, frame_clock, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  printf("frame clock at %d Hz\n", frame_hz);
+  return 0;
+}
+
+void print_frame_stats(void) {
+  struct frame_stats_s * fs = &frame_stats;
+  printf("frames: %ld, missed %ld, late avg %.0fus max %.0fus, flush avg %.0fus max %.0fus\n",
+	 fs->frames, fs->missed, fs->late_sum / fs->frames, fs->late_max,
+	 fs->flush_sum / fs->frames, fs->flush_max);
+  print_overflow_stats();
+  print_timed_stats();
+  memset(fs, 0, sizeof(struct frame_stats_s));
+}
+
+/* sends out the frame (once, however many ticks went by) */
+void frame_tick(unsigned long ticks) {
+  struct timespec now, done;
+  long period = 1000000000L / frame_hz;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* how late we are for the most recent of these ticks */
+  timespec_add_nsec(&frame_next, (ticks - 1) * period);
+  double late = usec_between(&frame_next, &now);
+  timespec_add_nsec(&frame_next, period);
+
+  run_wheel();
+  if(num_effects > 0) {
+    run_effects(now.tv_sec + now.tv_nsec / 1e9);
+  }
+  flush_pending();
+
+  clock_gettime(CLOCK_MONOTONIC, &done);
+  double flush = usec_between(&now, &done);
+  struct frame_stats_s * fs = &frame_stats;
+  fs->frames++;
+  fs->missed += ticks - 1;
+  fs->late_sum += late;
+  fs->flush_sum += flush;
+  if(late > fs->late_max) fs->late_max = late;
+  if(flush > fs->flush_max) fs->flush_max = flush;
+  if(fs->frames >= (long)frame_hz * SERVER_STATS_SEC) {
+    print_frame_stats();
+  }
+}
+
+/* handles up to max messages from a ring (from socket peer, or -1).
+   returns how many it handled. */
+int drain_ring(struct sq_ring * ring, int peer, int max) {
+  struct generic_msgbuf * buf;
+  int n = 0;
+  while(n < max && (buf = sq_ring_peek(ring)) != NULL) {
+    handle_msg(buf, peer);
+    sq_ring_advance(ring);
+    n++;
+  }
+  return n;
+}
+
+void drop_peer(int pi) {
+  struct peer_s * pe = &peers[pi];
+  int n = drain_ring(pe->in, pi, SQ_RING_SLOTS); /* what it said before hanging up */
+  loop_stats.msgs_in += n;
+  if(pe->client != -1 && clients.isclient[pe->client] && clients.sock[pe->client] == pi) {
+    clients.msgs_in[pe->client] += n;
+    lose_client(pe->client);
+  }
+  if(pe->proc != -1 && procs.live[pe->proc] && procs.sock[pe->proc] == pi) {
+    lose_proc(pe->proc);
+  }
+  for(int k = 0; k < num_live_peers; k++) {
+    if(live_peers[k] == pi) {
+      live_peers[k] = live_peers[--num_live_peers];
+      break;
+    }
+  }
+  close(pe->fd);
+  pthread_mutex_lock(&peers_lock);
+  pe->fd = -1;
+  pthread_mutex_unlock(&peers_lock);
+}
+
+/* handles connects, hangups and writability from the socket thread */
+int handle_peer_events(void) {
+  struct generic_msgbuf * ev;
+  int n = 0;
+  while((ev = sq_ring_peek(peer_events)) != NULL) {
+    int pi = ev->lightid;
+    struct peer_s * pe = &peers[pi];
+    switch(ev->mtype) {
+    case PEER_CONNECTED :
+      if(pe->out == NULL) {
+	pe->out = grow(NULL, SERVER_PEER_BUFFER, sizeof(struct generic_msgbuf));
+	pe->out_size = grow(NULL, SERVER_PEER_BUFFER, sizeof(int));
+      }
+      pe->out_head = pe->out_count = 0;
+      pe->client = pe->proc = -1;
+      live_peers[num_live_peers++] = pi;
+      break;
+    case PEER_GONE :
+      drop_peer(pi);
+      break;
+    case PEER_WRITABLE :
+      if(flush_peer(pi) == -1) {
+	shutdown(pe->fd, SHUT_RDWR);
+      }
+      break;
+    }
+    sq_ring_advance(peer_events);
+    n++;
+  }
+  return n;
+}
+
+/*** the stats page ***/
+
+/* Counted as things happen, in the tables above and in loop_stats, and
+   copied to the page (see sqstats.h) every SERVER_PUBLISH_MSEC while
+   anything is going on.  Readers never slow down the forward loop. */
+static struct sq_stats_server * stats_page;
+static size_t stats_page_size;
+static unsigned long long stats_published_changes = ~0ULL;
+static long stats_next = 0; /* msec when the page is next due */
+static int * proc_depth;
+static int proc_depth_cap;
+
+static size_t stats_size(void) {
+  return sizeof(struct sq_stats_server) + clients.cap * sizeof(struct sq_stats_client)
+    + lights.cap * sizeof(struct sq_stats_light);
+}
+
+int start_stats(void) {
+  stats_page_size = stats_size();
+  stats_page = sq_page_create(SQ_STATS_SERVER_SHM, stats_page_size);
+  if(stats_page == NULL) {
+    return -1;
+  }
+  stats_page->h.pid = getpid();
+  stats_page->h.islight = 0;
+  stats_page->h.size = stats_page_size;
+  __atomic_store_n(&stats_page->h.magic, SQ_STATS_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void stop_stats(void) {
+  if(stats_page != NULL) {
+    sq_page_destroy(stats_page, SQ_STATS_SERVER_SHM, stats_page_size);
+    stats_page = NULL;
+  }
+}
+
+/* messages waiting for process p */
+static int proc_queue_depth(int p) {
+  struct msqid_ds msq;
+  if(procs.sock[p] != -1) {
+    return peers[procs.sock[p]].out_count;
+  }
+  if(procs.ring[p] != NULL) {
+    return sq_ring_count(procs.ring[p]);
+  }
+  if(procs.msqid[p] != -1 && msgctl(procs.msqid[p], IPC_STAT, &msq) == 0) {
+    return msq.msg_qnum;
+  }
+  return 0;
+}
+
+static void publish_stats(void) {
+  if(stats_size() > stats_page_size) {
+    struct sq_stats_server * bigger = sq_page_resize(stats_page, SQ_STATS_SERVER_SHM,
+						     stats_page_size, stats_size());
+    if(bigger == NULL) {
+      return;
+    }
+    stats_page = bigger;
+    stats_page_size = stats_size();
+  }
+  /* the syscalls happen outside the write */
+  if(procs.cap > proc_depth_cap) {
+    proc_depth_cap = procs.cap;
+    proc_depth = grow(proc_depth, proc_depth_cap, sizeof(int));
+  }
+  for(int p = 0; p < procs.cap; p++) {
+    proc_depth[p] = procs.live[p] ? proc_queue_depth(p) : 0;
+  }
+
+  struct sq_stats_server * s = stats_page;
+  sq_stats_write_begin(&s->h);
+  s->h.size = stats_page_size;
+  s->h.updated_usec = sq_trace_now() / 1000;
+  s->loops = loop_stats.loops;
+  s->loop_ns = loop_stats.loop_ns;
+  s->loop_ns_max = loop_stats.loop_ns_max;
+  s->msgs_in = loop_stats.msgs_in;
+  s->queue_msgs_in = loop_stats.queue_msgs_in;
+  s->batches_out = loop_stats.batches_out;
+  s->coalesced = overflow_stats.coalesced;
+  s->dropped = overflow_stats.dropped;
+  s->disconnected = overflow_stats.disconnected;
+  s->timed_late = timed_stats.late;
+  s->timed_dropped = timed_stats.dropped;
+  s->record_dropped = rec.dropped;
+  s->nclients = clients.cap;
+  s->nlights = lights.cap;
+  struct sq_stats_client * sc = sq_stats_server_clients(s);
+  for(int i = 0; i < clients.cap; i++) {
+    sc[i].live = clients.isclient[i];
+    if(sc[i].live) {
+      memcpy(sc[i].name, clients.name[i], sizeof(sc[i].name));
+      sc[i].msgs_in = clients.msgs_in[i];
+    }
+  }
+  struct sq_stats_light * sl = sq_stats_server_lights(s);
+  for(int i = 0; i < lights.cap; i++) {
+    sl[i].live = lights.islight[i];
+    if(sl[i].live) {
+      memcpy(sl[i].name, lights.name[i], sizeof(sl[i].name));
+      sl[i].queued = proc_depth[lights.proc[i]];
+      sl[i].changes_in = lights.counts[i].in;
+      sl[i].changes_out = lights.counts[i].out;
+      sl[i].coalesced = lights.counts[i].coalesced;
+    }
+  }
+  sq_stats_write_end(&s->h);
+  loop_stats.loop_ns_max = 0;
+}
+
+/* publishes the page if it's due.  returns how many msec until it's
+   next due, or -1 if nothing has happened since it last was. */
+int publish_stats_if_due(void) {
+  if(stats_page == NULL) {
+    return -1;
+  }
+  unsigned long long changes = loop_stats.changes + loop_stats.msgs_in + loop_stats.batches_out;
+  if(changes == stats_published_changes) {
+    return -1;
+  }
+  long now = sq_trace_now() / 1000000;
+  if(now < stats_next) {
+    return stats_next - now;
+  }
+  publish_stats();
+  stats_published_changes = changes;
+  stats_next = now + SERVER_PUBLISH_MSEC;
+  return SERVER_PUBLISH_MSEC;
+}
+
+/* A process on shared memory that dies without saying so leaves its
+   ring mapped and itself in our tables, so now and then we look for
+   rings whose owners are gone, and drop them (and their message
+   queues, which nobody else will). */
+static long reap_next;
+
+/* returns how long until the next look, or -1 if there are no rings
+   to look at */
+int reap_dead_rings_if_due(void) {
+  int rings = 0;
+  long now = sq_trace_now() / 1000000;
+  if(now < reap_next) {
+    return reap_next - now;
+  }
+  for(int k = 0; k < clients.nlive; k++) {
+    int id = clients.live[k];
+    if(clients.ring[id] == NULL) {
+      continue;
+    }
+    if(!sq_ring_owner_alive(clients.ring[id])) {
+      msgctl(clients.msqid[id], IPC_RMID, NULL);
+      lose_client(id);
+      k--; /* the last live client took its place */
+    } else {
+      rings++;
+    }
+  }
+  for(int p = 0; p < procs.cap; p++) {
+    if(!procs.live[p] || procs.ring[p] == NULL) {
+      continue;
+    }
+    if(!sq_ring_owner_alive(procs.ring[p])) {
+      printf("light process %d died.\n", p);
+      msgctl(procs.msqid[p], IPC_RMID, NULL);
+      lose_proc(p);
+    } else {
+      rings++;
+    }
+  }
+  reap_next = now + SERVER_REAP_MSEC;
+  return rings ? SERVER_REAP_MSEC : -1;
 }
 
 void run(void) {
-  int id;
-  struct generic_msgbuf buf;
-  int tries = 0;
+  pthread_t legacy_thread;
+  sigset_t sigs, oldsigs;
   printf("server running...\n");
   lights_keep_running = 1;
-  while(lights_keep_running && tries < 5) {
-    if(msgrcv(server_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0, 0) == -1) {
-      perror("server.c, run msgrcv");
-      printf("something catastrophic happened to the message queue?\n");
-      tries++;
+
+  /* only the main thread should see ^C, so that it interrupts the
+     doorbell wait */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  if(pthread_create(&legacy_thread, NULL, legacy_receiver, NULL) != 0) {
+    perror("pthread_create");
+    return;
+  }
+  if(start_socket_core() == -1) {
+    printf("no socket connections, then.\n");
+  }
+  if(frame_hz && start_frame_clock() == -1) {
+    printf("couldn't start the frame clock.\n");
+    lights_keep_running = 0;
+  }
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+  while(lights_keep_running) {
+    unsigned int ticket = sq_doorbell_ticket(&hub->bell);
+    long long loop_start = sq_trace_now();
+    int handled = drain_ring(legacy_ring, -1, SERVER_RING_BURST);
+    loop_stats.queue_msgs_in += handled;
+    for(int k = 0; k < clients.nlive; k++) {
+      int id = clients.live[k];
+      if(clients.ring[id] != NULL) {
+	int n = drain_ring(clients.ring[id], -1, SERVER_RING_BURST);
+	clients.msgs_in[id] += n;
+	handled += n;
+      }
+    }
+    int events = handle_peer_events();
+    for(int k = 0; k < num_live_peers; k++) {
+      int pi = live_peers[k];
+      int n = drain_ring(peers[pi].in, pi, SERVER_RING_BURST);
+      if(peers[pi].client != -1) {
+	clients.msgs_in[peers[pi].client] += n;
+      }
+      handled += n;
+    }
+    loop_stats.msgs_in += handled;
+    handled += events;
+    int reap_wait = reap_dead_rings_if_due();
+    detach_retired_rings();
+    /* a process that was full gets tried again after a short nap,
+       since nothing tells us when it has room, and effects are due
+       SERVER_EFFECT_HZ times a second.  With a frame clock, both
+       happen on the next tick. */
+    int wait = -1;
+    if(frame_hz == 0) {
+      wait = run_wheel();
+      int effects_wait = run_effects_if_due();
+      if(effects_wait != -1 && (wait == -1 || effects_wait < wait)) {
+	wait = effects_wait;
+      }
+      if(flush_pending() && (wait == -1 || wait > SERVER_RETRY_MSEC)) {
+	wait = SERVER_RETRY_MSEC;
+      }
     } else {
-      tries = 0;
-      switch(buf.mtype) {
-      case SQ_LIGHT_SET_NAME :
-	printf("adding light...\n");
-	id = get_free_light_id();
-	if(id == -1) {
-	  printf("can't.  too many lights already.\n");
-	} else {
-	  struct light_init_msg * buf2 = (struct light_init_msg *) &buf;
-	  strcpy(light_servers[id].name, buf2->name);
-	  light_servers[id].islight = 1;
-	  light_servers[id].lightid = buf2->lightid;
-	  light_servers[id].light_msqid = buf2->msqid;
-
-	  printf("Added light %d \"%s\" with id %d.\n", id, light_servers[id].name,
-		 light_servers[id].lightid);
-	  
-	  printf("telling clients...\n");
-	  struct light_init_msg lim;
-	  lim.mtype = SQ_LIGHT_SET_NAME;
-	  lim.lightid = id;
-	  lim.msqid = 1;
-	  strcpy(lim.name, light_servers[id].name);
-	  for(int i = 0; i < NUM_CLIENTS; i++) {
-	    if(clients[i].isclient) {
-	      if(msgsnd(clients[i].client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0) == -1) {
-		printf("lost client %s\n", clients[i].name);
-		clients[i].isclient = 0;
-	      }
-	    }
-	  }
-	}
-	break;
-      case SQ_LIGHT_ON :
-      case SQ_LIGHT_OFF :
-      case SQ_LIGHT_BRIGHTNESS :
-      case SQ_LIGHT_RGB :
-      case SQ_LIGHT_HSI :
-	//printf("forwarding...\n");
-	if(buf.lightid >= 0 && buf.lightid < NUM_LIGHT_SERVERS
-	   && !light_servers[buf.lightid].islight) {
-	  printf("not a light: %d\n", buf.lightid);
-	} else {
-	  /* change the id to something the light server understands
-	     (and reuse the data structure). */
-	  id = buf.lightid;
-	  buf.lightid = light_servers[id].lightid;
-	  //printf("sending to \"%s\" id=%d lightid=%d\n", light_servers[id].name, id, buf.lightid);
-	  if(msgsnd(light_servers[id].light_msqid, &buf, SIZEOF_MSG(struct generic_msgbuf), 0) == -1) {
-	    printf("Lost light %d. Removing...\n", id);
-	    light_servers[id].islight = 0;
-	    printf("telling clients...\n");
-	    struct light_init_msg lim;
-	    lim.mtype = SQ_LIGHT_SET_NAME;
-	    lim.lightid = id;
-	    lim.msqid = 0;
-	    strcpy(lim.name, light_servers[id].name);
-	    for(int i = 0; i < NUM_CLIENTS; i++) {
-	      if(clients[i].isclient) {
-		if(msgsnd(clients[i].client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0) == -1) {
-		  printf("lost client %s\n", clients[i].name);
-		  clients[i].isclient = 0;
-		}
-	      }
-	    }
-	  }
-	}
-	break;
-      case SQ_CLIENT_SET_NAME :
-	printf("adding client...\n");
-	id = get_free_client_id();
-	if(id == -1) {
-	  printf("can't. too many clients already.\n");
-	} else {
-	  struct client_init_msg * buf2 = (struct client_init_msg *) &buf;
-	  strcpy(clients[id].name, buf2->name);
-	  clients[id].isclient = 1;
-	  clients[id].clientid = buf2->clientid;
-	  clients[id].client_msqid = buf2->msqid;
-
-	  printf("Added client %d \"%s\" with id %d.\n", id, clients[id].name, clients[id].clientid);
-	  printf("Sending light info...\n");
-	  struct light_init_msg lim;
-	  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
-	    if(light_servers[i].islight) {
-	      lim.mtype = SQ_LIGHT_SET_NAME;
-	      lim.lightid = i;
-	      lim.msqid = 1;
-	      strcpy(lim.name, light_servers[i].name);
-	      printf("%d ", i);
-	      msgsnd(clients[id].client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0);
-	    }
-	  }
-	  lim.mtype = SQ_LIGHT_SET_NAME;
-	  lim.lightid = -1; /* sentinel */
-	  lim.name[0] = '\0';
-	  msgsnd(clients[id].client_msqid, &lim, SIZEOF_MSG(struct light_init_msg), 0);
-	  printf(" done\n");
-	}
-	break;
-	
-	//      case SQ_DIE :
-	//	break;
-	
-      default :
-	printf("Unknown message %ld...", buf.mtype);
-	break;
+      unsigned long ticks = __atomic_exchange_n(&frame_ticks, 0, __ATOMIC_SEQ_CST);
+      if(ticks > 0) {
+	frame_tick(ticks);
       }
     }
+    long long loop_ns = sq_trace_now() - loop_start;
+    loop_stats.loops++;
+    loop_stats.loop_ns += loop_ns;
+    if(loop_ns > loop_stats.loop_ns_max) {
+      loop_stats.loop_ns_max = loop_ns;
+    }
+    int stats_wait = publish_stats_if_due();
+    if(stats_wait != -1 && (wait == -1 || stats_wait < wait)) {
+      wait = stats_wait;
+    }
+    if(reap_wait != -1 && (wait == -1 || reap_wait < wait)) {
+      wait = reap_wait;
+    }
+    if(handled == 0) {
+      sq_doorbell_wait(&hub->bell, ticket, wait);
+    }
   }
   kill_lights_and_clients();
+  stop_socket_core();
+  stop_recorder();
+  stop_stats();
+  print_overflow_stats();
+  print_timed_stats();
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [-r hz] [-q policy] [-l late] [-o file]\n"
+	 "\t-r hz\tsend to lights on a frame clock at this rate (e.g. 30, 44, 60)\n"
+	 "\t-q policy\twhat to do with a light process that can't keep up:\n"
+	 "\t\tcoalesce (keep the latest values, the default), drop (queue\n"
+	 "\t\tchanges, dropping the oldest), or disconnect (after %d ms)\n"
+	 "\t-l late\twhat to do with a timed change that comes after its time:\n"
+	 "\t\tnow (apply it anyway, the default) or drop\n"
+	 "\t-o file\trecord every light change taken to file (see sqrecord.h)\n",
+	 prgname, SERVER_STALL_MSEC);
 }
 
-int main(void) {
+int main(int argc, char** argv) {
+  int opt;
+  while((opt = getopt(argc, argv, "r:q:l:o:")) != -1) {
+    switch(opt) {
+    case 'r' :
+      frame_hz = atoi(optarg);
+      if(frame_hz <= 0 || frame_hz > 1000) {
+	printf("bad frame rate %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'q' :
+      for(default_policy = 0; default_policy < 3; default_policy++) {
+	if(strcmp(optarg, policy_names[default_policy]) == 0) break;
+      }
+      if(default_policy == 3) {
+	printf("unknown policy %s\n", optarg);
+	print_usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'l' :
+      if(strcmp(optarg, "now") == 0 || strcmp(optarg, "drop") == 0) {
+	late_drop = optarg[0] == 'd';
+      } else {
+	printf("unknown late policy %s\n", optarg);
+	print_usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'o' :
+      rec.path = optarg;
+      break;
+    default :
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
   struct sigaction sa;
   sa.sa_handler = server_sigint_handler;
   sa.sa_flags = 0;
@@ -211,6 +2433,11 @@ int main(void) {
     perror("sigaction");
   }
 
+  if(rec.path != NULL && start_recorder() == -1) {
+    printf("Server couldn't start recording...");
+    exit(1);
+  }
+
   server_msqid = msgget(SQ_SERVER_MSG_ID, 0666 | IPC_CREAT);
   if(server_msqid == -1) {
     perror("msgget");
@@ -218,8 +2445,16 @@ int main(void) {
     exit(1);
   }
 
-  for(int i = 0; i < NUM_LIGHT_SERVERS; i++) {
-    light_servers[i].islight = 0;
+  hub = sq_hub_create();
+  legacy_ring = sq_ring_create(NULL);
+  if(hub == NULL || legacy_ring == NULL) {
+    printf("Server couldn't set up shared memory...");
+    exit(1);
+  }
+
+  init_tables();
+  if(start_stats() == -1) {
+    printf("no stats page, then.\n");
   }
 
   run();
@@ -228,4 +2463,5 @@ int main(void) {
   if(msgctl(server_msqid, IPC_RMID, NULL) == -1) {
     perror("msgctl");
   }
+  sq_hub_destroy(hub);
 }
@@ -0,0 +1,293 @@
+/* shared memory rings and doorbells (see shmring.h) */
+
+#include "shmring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+int sq_transport_from_env(void) {
+  char * t = getenv(SQ_TRANSPORT_ENV);
+  if(t != NULL && strcmp(t, "shm") == 0) {
+    return SQ_TRANSPORT_SHM;
+  }
+  if(t != NULL && strcmp(t, "socket") == 0) {
+    return SQ_TRANSPORT_SOCKET;
+  }
+  return SQ_TRANSPORT_MSG;
+}
+
+/* segments are only for processes of the same user.  a ring's name
+   has its maker's pid in it, and there's one server for the hub, so a
+   segment that's already there when we make one is left over from a
+   crash. */
+static void * map_segment(const char * shmname, size_t size, int create) {
+  if(create) {
+    shm_unlink(shmname);
+  }
+  int fd = shm_open(shmname, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+  if(fd == -1) {
+    perror("shmring.c, shm_open");
+    return NULL;
+  }
+  if(create && ftruncate(fd, size) == -1) {
+    perror("shmring.c, ftruncate");
+    close(fd);
+    shm_unlink(shmname);
+    return NULL;
+  }
+  void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    perror("shmring.c, mmap");
+    return NULL;
+  }
+  return p;
+}
+
+struct sq_ring * sq_ring_create(const char * shmname) {
+  struct sq_ring * ring;
+  if(shmname == NULL) {
+    ring = calloc(1, sizeof(struct sq_ring));
+  } else {
+    ring = map_segment(shmname, sizeof(struct sq_ring), 1);
+  }
+  if(ring == NULL) {
+    return NULL;
+  }
+  ring->slots = SQ_RING_SLOTS;
+  ring->owner = getpid();
+  ring->head = 0;
+  ring->tail = 0;
+  ring->bell.seq = 0;
+  ring->bell.waiting = 0;
+  ring->space.seq = 0;
+  ring->space.waiting = 0;
+  __atomic_store_n(&ring->magic, SQ_RING_MAGIC, __ATOMIC_RELEASE);
+  return ring;
+}
+
+struct sq_ring * sq_ring_attach(const char * shmname) {
+  struct sq_ring * ring = map_segment(shmname, sizeof(struct sq_ring), 0);
+  if(ring == NULL) {
+    return NULL;
+  }
+  if(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SQ_RING_MAGIC
+     || ring->slots != SQ_RING_SLOTS) {
+    printf("shmring.c: %s is not a ring\n", shmname);
+    munmap(ring, sizeof(struct sq_ring));
+    return NULL;
+  }
+  return ring;
+}
+
+/* only for rings made with a name */
+void sq_ring_detach(struct sq_ring * ring) {
+  munmap(ring, sizeof(struct sq_ring));
+}
+
+void sq_ring_unlink(const char * shmname) {
+  shm_unlink(shmname);
+}
+
+int sq_ring_owner_alive(struct sq_ring * ring) {
+  return kill(ring->owner, 0) == 0 || errno != ESRCH;
+}
+
+int sq_ring_push(struct sq_ring * ring, const void * msg, int size, struct sq_doorbell * bell) {
+  unsigned long long head = ring->head;
+  unsigned long long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if(head - tail >= SQ_RING_SLOTS) {
+    return -1;
+  }
+  memcpy(&ring->msgs[head & (SQ_RING_SLOTS-1)], msg, size + sizeof(long));
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  if(bell != NULL) {
+    sq_doorbell_ring(bell);
+  }
+  return 0;
+}
+
+int sq_ring_push_wait(struct sq_ring * ring, const void * msg, int size, struct sq_doorbell * bell, int msqid) {
+  struct msqid_ds msq;
+  while(sq_ring_push(ring, msg, size, bell) == -1) {
+    if(sq_ring_wait_below(ring, SQ_RING_SLOTS, SQ_RING_CHECK_MSEC) == -1
+       && msqid != -1 && msgctl(msqid, IPC_STAT, &msq) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static long long now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* like the consumer's side of a doorbell, but what we wait for is the
+   tail to move.  waiting has to be up before we look at the tail, so
+   that either the consumer sees it and rings, or we see the tail it
+   left. */
+int sq_ring_wait_below(struct sq_ring * ring, int count, int timeout_ms) {
+  long long give_up = now_msec() + timeout_ms;
+  int r = -1;
+  for(;;) {
+    __atomic_store_n(&ring->space.waiting, 1, __ATOMIC_SEQ_CST);
+    unsigned int ticket = sq_doorbell_ticket(&ring->space);
+    if(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) < (unsigned long long)count) {
+      r = 0;
+      break;
+    }
+    long long left = give_up - now_msec();
+    if(left <= 0) {
+      break;
+    }
+    sq_doorbell_wait(&ring->space, ticket, left);
+  }
+  __atomic_store_n(&ring->space.waiting, 0, __ATOMIC_SEQ_CST);
+  return r;
+}
+
+struct generic_msgbuf * sq_ring_peek(struct sq_ring * ring) {
+  unsigned long long tail = ring->tail;
+  if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+    return NULL;
+  }
+  return &ring->msgs[tail & (SQ_RING_SLOTS-1)];
+}
+
+void sq_ring_advance(struct sq_ring * ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&ring->space.waiting, __ATOMIC_SEQ_CST)) {
+    sq_doorbell_ring(&ring->space);
+  }
+}
+
+int sq_ring_count(struct sq_ring * ring) {
+  return (int)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+	       - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+/*** doorbells ***/
+
+/* The consumer takes a ticket (the current seq) before it drains, then
+   marks itself waiting and sleeps on seq==ticket.  A producer bumps
+   seq after publishing, so anything published after the ticket was
+   taken makes the wait return at once.  Both sides use sequentially
+   consistent operations on seq and waiting, so either the producer
+   sees waiting and wakes us, or we see the new seq and don't sleep. */
+
+unsigned int sq_doorbell_ticket(struct sq_doorbell * bell) {
+  return __atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST);
+}
+
+void sq_doorbell_ring(struct sq_doorbell * bell) {
+  __atomic_add_fetch(&bell->seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&bell->waiting, __ATOMIC_SEQ_CST)) {
+#ifdef __linux__
+    syscall(SYS_futex, &bell->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+  }
+}
+
+void sq_doorbell_wait(struct sq_doorbell * bell, unsigned int ticket, int timeout_ms) {
+  __atomic_store_n(&bell->waiting, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST) == ticket) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, &bell->seq, FUTEX_WAIT, ticket, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#else
+    /* no futexes here.  poll instead. */
+    struct timespec nap = {0, 500000};
+    int naps = timeout_ms < 0 ? -1 : timeout_ms * 2;
+    while(__atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST) == ticket && naps-- != 0) {
+      if(nanosleep(&nap, NULL) == -1) break; /* interrupted */
+    }
+#endif
+  }
+  __atomic_store_n(&bell->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/*** the server socket ***/
+
+int sq_socket_connect(void) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if(fd == -1) {
+    perror("shmring.c, socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, SQ_SERVER_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    perror("server not running? connect");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int sq_socket_recv(int fd, void * buf, int size, int wait) {
+  ssize_t n = recv(fd, buf, size + sizeof(long), wait ? 0 : MSG_DONTWAIT);
+  if(n > 0) {
+    return 1;
+  }
+  if(n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  return -1;
+}
+
+/*** the hub ***/
+
+struct sq_hub * sq_hub_create(void) {
+  struct sq_hub * hub = map_segment(SQ_SHM_HUB_NAME, sizeof(struct sq_hub), 1);
+  if(hub == NULL) {
+    return NULL;
+  }
+  hub->server_pid = getpid();
+  hub->bell.seq = 0;
+  hub->bell.waiting = 0;
+  __atomic_store_n(&hub->magic, SQ_RING_MAGIC, __ATOMIC_RELEASE);
+  return hub;
+}
+
+struct sq_hub * sq_hub_attach(void) {
+  struct sq_hub * hub = map_segment(SQ_SHM_HUB_NAME, sizeof(struct sq_hub), 0);
+  if(hub == NULL) {
+    return NULL;
+  }
+  if(__atomic_load_n(&hub->magic, __ATOMIC_ACQUIRE) != SQ_RING_MAGIC) {
+    printf("shmring.c: hub not initialized\n");
+    munmap(hub, sizeof(struct sq_hub));
+    return NULL;
+  }
+  return hub;
+}
+
+void sq_hub_detach(struct sq_hub * hub) {
+  munmap(hub, sizeof(struct sq_hub));
+}
+
+void sq_hub_destroy(struct sq_hub * hub) {
+  sq_hub_detach(hub);
+  shm_unlink(SQ_SHM_HUB_NAME);
+}
@@ -0,0 +1,144 @@
+/* reading back benchmark runs (see sqbench.h) */
+
+#include "sqbench.h"
+#include "sqstats.h"
+#include "shmring.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+static void * stats_copy;
+static size_t stats_copy_cap;
+
+static void add_hist(struct sq_trace_hist * to, struct sq_trace_hist * h) {
+  for(int b = 0; b < SQ_TRACE_BUCKETS; b++) {
+    to->buckets[b] += h->buckets[b];
+  }
+  to->count += h->count;
+  if(h->max > to->max) {
+    to->max = h->max;
+  }
+}
+
+static void add_light_stats(struct sq_bench_snapshot * snap, char * shmname,
+			    int (*pick)(const char *, void *), void * arg) {
+  if(!sq_stats_read(shmname, &stats_copy, &stats_copy_cap)) {
+    return;
+  }
+  struct sq_stats_lights * s = stats_copy;
+  struct sq_stats_light * sl = sq_stats_lights_lights(s);
+  for(int i = 0; i < s->nlights; i++) {
+    if(sl[i].live && pick(sl[i].name, arg)) {
+      snap->handled += sl[i].changes_in;
+    }
+  }
+}
+
+static void add_trace(struct sq_bench_snapshot * snap, char * shmname,
+		      int (*pick)(const char *, void *), void * arg) {
+  size_t size;
+  struct sq_trace_page * tp = sq_page_map(shmname, &size);
+  int picked = 0;
+  if(tp == NULL) {
+    return;
+  }
+  if(tp->magic == SQ_TRACE_MAGIC
+     && size >= sizeof(struct sq_trace_page) + tp->nlights * sizeof(tp->lights[0])) {
+    for(int i = 0; i < tp->nlights; i++) {
+      if(pick(tp->lights[i].name, arg)) {
+	add_hist(&snap->latency, &tp->lights[i].total);
+	picked = 1;
+      }
+    }
+    for(int k = 0; picked && k < SQ_TRACE_STAGES; k++) {
+      add_hist(&snap->stages[k], &tp->stages[k]);
+    }
+  }
+  sq_page_unmap(tp, size);
+}
+
+int sq_bench_snapshot(struct sq_bench_snapshot * snap, int (*pick)(const char * name, void * arg), void * arg) {
+  memset(snap, 0, sizeof(*snap));
+  if(!sq_stats_read(SQ_STATS_SERVER_SHM, &stats_copy, &stats_copy_cap)) {
+    return -1;
+  }
+  struct sq_stats_server * s = stats_copy;
+  struct sq_stats_light * sl = sq_stats_server_lights(s);
+  for(int i = 0; i < s->nlights; i++) {
+    if(sl[i].live && pick(sl[i].name, arg)) {
+      snap->server_lights++;
+      snap->server_in += sl[i].changes_in;
+      snap->server_out += sl[i].changes_out;
+      snap->coalesced += sl[i].coalesced;
+    }
+  }
+  snap->dropped = s->dropped;
+  snap->loops = s->loops;
+  snap->loop_ns = s->loop_ns;
+
+  /* the light processes' pages */
+  DIR * dir = opendir("/dev/shm");
+  struct dirent * de;
+  const char * stats_prefix = SQ_STATS_LIGHTS_SHM_PREFIX + 1;
+  const char * trace_prefix = SQ_TRACE_SHM_PREFIX + 1;
+  size_t slen = strlen(stats_prefix), tlen = strlen(trace_prefix);
+  char shmname[sizeof(de->d_name) + 1];
+  if(dir == NULL) {
+    perror("opendir /dev/shm");
+    return 0;
+  }
+  while((de = readdir(dir)) != NULL) {
+    snprintf(shmname, sizeof(shmname), "/%s", de->d_name);
+    if(strncmp(de->d_name, stats_prefix, slen) == 0 && de->d_name[slen] >= '0' && de->d_name[slen] <= '9') {
+      add_light_stats(snap, shmname, pick, arg);
+    } else if(strncmp(de->d_name, trace_prefix, tlen) == 0) {
+      add_trace(snap, shmname, pick, arg);
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+void sq_bench_settle(struct sq_bench_snapshot * before, struct sq_bench_snapshot * after,
+		     int (*pick)(const char * name, void * arg), void * arg) {
+  struct sq_bench_snapshot last;
+  time_t give_up = time(NULL) + SQ_BENCH_SETTLE_MAX_SEC;
+  sq_bench_snapshot(after, pick, arg);
+  do {
+    last = *after;
+    usleep(SQ_BENCH_SETTLE_MSEC * 1000);
+    sq_bench_snapshot(after, pick, arg);
+  } while((after->handled != last.handled || after->server_out != last.server_out
+	   || after->handled - before->handled < after->server_out - before->server_out)
+	  && time(NULL) < give_up);
+}
+
+static void hist_since(struct sq_trace_hist * after, struct sq_trace_hist * before) {
+  unsigned long long max = 0;
+  after->count -= before->count;
+  for(int b = 0; b < SQ_TRACE_BUCKETS; b++) {
+    after->buckets[b] -= before->buckets[b];
+    if(after->buckets[b] > 0) {
+      max = sq_trace_bucket_top(b);
+    }
+  }
+  if(max < after->max) {
+    after->max = max;
+  }
+}
+
+void sq_bench_since(struct sq_bench_snapshot * after, struct sq_bench_snapshot * before) {
+  after->server_in -= before->server_in;
+  after->server_out -= before->server_out;
+  after->coalesced -= before->coalesced;
+  after->dropped -= before->dropped;
+  after->handled -= before->handled;
+  after->loops -= before->loops;
+  after->loop_ns -= before->loop_ns;
+  for(int k = 0; k < SQ_TRACE_STAGES; k++) {
+    hist_since(&after->stages[k], &before->stages[k]);
+  }
+  hist_since(&after->latency, &before->latency);
+}
@@ -0,0 +1,316 @@
+/* array color kernels (see sqcolor.h)
+
+   Each kernel comes three ways: plain C, SSE2 (4 at a time) and AVX2
+   (8 at a time).  The vector ones do the leftover tail with the plain
+   C one.  All three use the same arithmetic, so they agree to within
+   float rounding.
+
+   hsi: after wrapping h into [0,360) (a NaN or infinite h is 0), the sector is which 120 degrees
+   it's in, and with y = h - 120*sector - 60 (in [-60,60) degrees) the
+   leading color gets (1 + s*f)/3 with
+
+     f = cos(y+60)/cos(y) = 1/2 - (sqrt(3)/2) tan(y)
+
+   tan being sin/cos, each a short polynomial since |y| <= pi/3.  The
+   next color round gets (1 + s*(1-f))/3 and the last (1 - s)/3.
+
+   The vector ones wrap h with a floor, which is only exact while
+   360*floor(h/360) is, so a vector with any |h| past HSI_WRAP_MAX goes
+   through the plain C one, which uses fmodf.  Otherwise the floor can
+   only be off by a whole turn, landing h just outside [0,360), which
+   the sector clamps soak up (the colors are continuous across the
+   sector edges). */
+
+#include "sqcolor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SQ_COLOR_X86 1
+#include <immintrin.h>
+#endif
+
+#define DEG (3.14159265358979f/180.0f)
+#define HALF_SQRT3 0.866025403784439f
+#define HSI_WRAP_MAX 1048576.0f /* 2^20 */
+
+/* sin and cos on [-pi/3,pi/3], good to about 1e-7 */
+#define SIN_POLY(y, y2) ((y) * (1 + (y2)*(-1.0f/6 + (y2)*(1.0f/120 + (y2)*(-1.0f/5040 + (y2)*(1.0f/362880))))))
+#define COS_POLY(y2) (1 + (y2)*(-0.5f + (y2)*(1.0f/24 + (y2)*(-1.0f/720 + (y2)*(1.0f/40320 + (y2)*(-1.0f/3628800))))))
+
+/*** plain C ***/
+
+static void clamp_scalar(float * v, int n) {
+  for(int k = 0; k < n; k++) {
+    float x = v[k] > 0 ? v[k] : 0; /* NaN fails the test too */
+    v[k] = x < 1 ? x : 1;
+  }
+}
+
+static void hsi_scalar(const float * h, const float * s, const float * i,
+		       float * r, float * g, float * b, int n) {
+  for(int k = 0; k < n; k++) {
+    float hh = isfinite(h[k]) ? fmodf(h[k], 360.0f) : 0;
+    if(hh < 0) hh += 360.0f;
+    float sector = floorf(hh * (1.0f/120));
+    if(sector > 2) sector = 2; /* hh rounded up to 360 */
+    if(sector < 0) sector = 0;
+    float y = (hh - 120.0f*sector - 60.0f) * DEG;
+    float y2 = y*y;
+    float f = 0.5f - HALF_SQRT3 * SIN_POLY(y, y2) / COS_POLY(y2);
+    float sat = s[k];
+    float lead = (1 + sat*f) * (1.0f/3);
+    float next = (1 + sat*(1-f)) * (1.0f/3);
+    float last = (1 - sat) * (1.0f/3);
+    float c[3];
+    int sc = (int)sector;
+    c[sc] = lead;
+    c[(sc+1)%3] = next;
+    c[(sc+2)%3] = last;
+    if(i != NULL) {
+      float i3 = 3*i[k];
+      for(int j = 0; j < 3; j++) {
+	float x = c[j]*i3;
+	x = x > 0 ? x : 0;
+	c[j] = x < 1 ? x : 1;
+      }
+    }
+    r[k] = c[0];
+    g[k] = c[1];
+    b[k] = c[2];
+  }
+}
+
+static void normalize_scalar(float * r, float * g, float * b, float * sum, int n) {
+  for(int k = 0; k < n; k++) {
+    float t = r[k] + g[k] + b[k];
+    sum[k] = t;
+    if(t != 0) {
+      r[k] /= t;
+      g[k] /= t;
+      b[k] /= t;
+    }
+  }
+}
+
+#ifdef SQ_COLOR_X86
+
+/*** SSE2 ***/
+
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/* no floor before SSE4.1: truncate, then step down where that rounded up */
+static inline __m128 floor4(__m128 x) {
+  __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+  return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1)));
+}
+
+static inline __m128 clamp4(__m128 x) {
+  /* max returns its second argument for NaN */
+  return _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_set1_ps(1));
+}
+
+static void clamp_sse2(float * v, int n) {
+  int k = 0;
+  for(; k + 4 <= n; k += 4) {
+    _mm_storeu_ps(v + k, clamp4(_mm_loadu_ps(v + k)));
+  }
+  clamp_scalar(v + k, n - k);
+}
+
+static void hsi_sse2(const float * h, const float * s, const float * i,
+		     float * r, float * g, float * b, int n) {
+  const __m128 one = _mm_set1_ps(1), third = _mm_set1_ps(1.0f/3);
+  int k = 0;
+  for(; k + 4 <= n; k += 4) {
+    __m128 hh = _mm_loadu_ps(h + k);
+    /* h - h is 0 unless h is NaN or infinite */
+    hh = _mm_and_ps(_mm_cmpeq_ps(_mm_sub_ps(hh, hh), _mm_setzero_ps()), hh);
+    __m128 mag = _mm_andnot_ps(_mm_set1_ps(-0.0f), hh);
+    if(_mm_movemask_ps(_mm_cmpge_ps(mag, _mm_set1_ps(HSI_WRAP_MAX)))) {
+      hsi_scalar(h + k, s + k, i ? i + k : NULL, r + k, g + k, b + k, 4);
+      continue;
+    }
+    hh = _mm_sub_ps(hh, _mm_mul_ps(_mm_set1_ps(360), floor4(_mm_mul_ps(hh, _mm_set1_ps(1.0f/360)))));
+    __m128 sector = floor4(_mm_mul_ps(hh, _mm_set1_ps(1.0f/120)));
+    sector = _mm_min_ps(_mm_max_ps(sector, _mm_setzero_ps()), _mm_set1_ps(2));
+    __m128 y = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(hh, _mm_mul_ps(_mm_set1_ps(120), sector)), _mm_set1_ps(60)),
+			  _mm_set1_ps(DEG));
+    __m128 y2 = _mm_mul_ps(y, y);
+    __m128 sn = _mm_add_ps(_mm_set1_ps(1.0f/120), _mm_mul_ps(y2, _mm_add_ps(_mm_set1_ps(-1.0f/5040), _mm_mul_ps(y2, _mm_set1_ps(1.0f/362880)))));
+    sn = _mm_mul_ps(y, _mm_add_ps(one, _mm_mul_ps(y2, _mm_add_ps(_mm_set1_ps(-1.0f/6), _mm_mul_ps(y2, sn)))));
+    __m128 cs = _mm_add_ps(_mm_set1_ps(1.0f/40320), _mm_mul_ps(y2, _mm_set1_ps(-1.0f/3628800)));
+    cs = _mm_add_ps(_mm_set1_ps(1.0f/24), _mm_mul_ps(y2, _mm_add_ps(_mm_set1_ps(-1.0f/720), _mm_mul_ps(y2, cs))));
+    cs = _mm_add_ps(one, _mm_mul_ps(y2, _mm_add_ps(_mm_set1_ps(-0.5f), _mm_mul_ps(y2, cs))));
+    __m128 f = _mm_sub_ps(_mm_set1_ps(0.5f), _mm_mul_ps(_mm_set1_ps(HALF_SQRT3), _mm_div_ps(sn, cs)));
+    __m128 sat = _mm_loadu_ps(s + k);
+    __m128 lead = _mm_mul_ps(_mm_add_ps(one, _mm_mul_ps(sat, f)), third);
+    __m128 next = _mm_mul_ps(_mm_add_ps(one, _mm_mul_ps(sat, _mm_sub_ps(one, f))), third);
+    __m128 last = _mm_mul_ps(_mm_sub_ps(one, sat), third);
+    __m128 in1 = _mm_cmpeq_ps(sector, one), in2 = _mm_cmpeq_ps(sector, _mm_set1_ps(2));
+    __m128 rr = select4(in2, next, select4(in1, last, lead));
+    __m128 gg = select4(in2, last, select4(in1, lead, next));
+    __m128 bb = select4(in2, lead, select4(in1, next, last));
+    if(i != NULL) {
+      __m128 i3 = _mm_mul_ps(_mm_loadu_ps(i + k), _mm_set1_ps(3));
+      rr = clamp4(_mm_mul_ps(rr, i3));
+      gg = clamp4(_mm_mul_ps(gg, i3));
+      bb = clamp4(_mm_mul_ps(bb, i3));
+    }
+    _mm_storeu_ps(r + k, rr);
+    _mm_storeu_ps(g + k, gg);
+    _mm_storeu_ps(b + k, bb);
+  }
+  hsi_scalar(h + k, s + k, i ? i + k : NULL, r + k, g + k, b + k, n - k);
+}
+
+static void normalize_sse2(float * r, float * g, float * b, float * sum, int n) {
+  int k = 0;
+  for(; k + 4 <= n; k += 4) {
+    __m128 rr = _mm_loadu_ps(r + k), gg = _mm_loadu_ps(g + k), bb = _mm_loadu_ps(b + k);
+    __m128 t = _mm_add_ps(_mm_add_ps(rr, gg), bb);
+    __m128 nz = _mm_cmpneq_ps(t, _mm_setzero_ps());
+    __m128 inv = _mm_and_ps(nz, _mm_div_ps(_mm_set1_ps(1), t));
+    _mm_storeu_ps(sum + k, t);
+    _mm_storeu_ps(r + k, _mm_mul_ps(rr, inv));
+    _mm_storeu_ps(g + k, _mm_mul_ps(gg, inv));
+    _mm_storeu_ps(b + k, _mm_mul_ps(bb, inv));
+  }
+  normalize_scalar(r + k, g + k, b + k, sum + k, n - k);
+}
+
+/*** AVX2 ***/
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256 clamp8(__m256 x) {
+  return _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), _mm256_set1_ps(1));
+}
+
+static AVX2 void clamp_avx2(float * v, int n) {
+  int k = 0;
+  for(; k + 8 <= n; k += 8) {
+    _mm256_storeu_ps(v + k, clamp8(_mm256_loadu_ps(v + k)));
+  }
+  clamp_sse2(v + k, n - k);
+}
+
+static AVX2 void hsi_avx2(const float * h, const float * s, const float * i,
+			  float * r, float * g, float * b, int n) {
+  const __m256 one = _mm256_set1_ps(1), third = _mm256_set1_ps(1.0f/3);
+  int k = 0;
+  for(; k + 8 <= n; k += 8) {
+    __m256 hh = _mm256_loadu_ps(h + k);
+    hh = _mm256_and_ps(_mm256_cmp_ps(_mm256_sub_ps(hh, hh), _mm256_setzero_ps(), _CMP_EQ_OQ), hh);
+    __m256 mag = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), hh);
+    if(_mm256_movemask_ps(_mm256_cmp_ps(mag, _mm256_set1_ps(HSI_WRAP_MAX), _CMP_GE_OQ))) {
+      hsi_scalar(h + k, s + k, i ? i + k : NULL, r + k, g + k, b + k, 8);
+      continue;
+    }
+    hh = _mm256_sub_ps(hh, _mm256_mul_ps(_mm256_set1_ps(360), _mm256_floor_ps(_mm256_mul_ps(hh, _mm256_set1_ps(1.0f/360)))));
+    __m256 sector = _mm256_floor_ps(_mm256_mul_ps(hh, _mm256_set1_ps(1.0f/120)));
+    sector = _mm256_min_ps(_mm256_max_ps(sector, _mm256_setzero_ps()), _mm256_set1_ps(2));
+    __m256 y = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(hh, _mm256_mul_ps(_mm256_set1_ps(120), sector)), _mm256_set1_ps(60)),
+			     _mm256_set1_ps(DEG));
+    __m256 y2 = _mm256_mul_ps(y, y);
+    __m256 sn = _mm256_add_ps(_mm256_set1_ps(1.0f/120), _mm256_mul_ps(y2, _mm256_add_ps(_mm256_set1_ps(-1.0f/5040), _mm256_mul_ps(y2, _mm256_set1_ps(1.0f/362880)))));
+    sn = _mm256_mul_ps(y, _mm256_add_ps(one, _mm256_mul_ps(y2, _mm256_add_ps(_mm256_set1_ps(-1.0f/6), _mm256_mul_ps(y2, sn)))));
+    __m256 cs = _mm256_add_ps(_mm256_set1_ps(1.0f/40320), _mm256_mul_ps(y2, _mm256_set1_ps(-1.0f/3628800)));
+    cs = _mm256_add_ps(_mm256_set1_ps(1.0f/24), _mm256_mul_ps(y2, _mm256_add_ps(_mm256_set1_ps(-1.0f/720), _mm256_mul_ps(y2, cs))));
+    cs = _mm256_add_ps(one, _mm256_mul_ps(y2, _mm256_add_ps(_mm256_set1_ps(-0.5f), _mm256_mul_ps(y2, cs))));
+    __m256 f = _mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(_mm256_set1_ps(HALF_SQRT3), _mm256_div_ps(sn, cs)));
+    __m256 sat = _mm256_loadu_ps(s + k);
+    __m256 lead = _mm256_mul_ps(_mm256_add_ps(one, _mm256_mul_ps(sat, f)), third);
+    __m256 next = _mm256_mul_ps(_mm256_add_ps(one, _mm256_mul_ps(sat, _mm256_sub_ps(one, f))), third);
+    __m256 last = _mm256_mul_ps(_mm256_sub_ps(one, sat), third);
+    __m256 in1 = _mm256_cmp_ps(sector, one, _CMP_EQ_OQ);
+    __m256 in2 = _mm256_cmp_ps(sector, _mm256_set1_ps(2), _CMP_EQ_OQ);
+    __m256 rr = _mm256_blendv_ps(_mm256_blendv_ps(lead, last, in1), next, in2);
+    __m256 gg = _mm256_blendv_ps(_mm256_blendv_ps(next, lead, in1), last, in2);
+    __m256 bb = _mm256_blendv_ps(_mm256_blendv_ps(last, next, in1), lead, in2);
+    if(i != NULL) {
+      __m256 i3 = _mm256_mul_ps(_mm256_loadu_ps(i + k), _mm256_set1_ps(3));
+      rr = clamp8(_mm256_mul_ps(rr, i3));
+      gg = clamp8(_mm256_mul_ps(gg, i3));
+      bb = clamp8(_mm256_mul_ps(bb, i3));
+    }
+    _mm256_storeu_ps(r + k, rr);
+    _mm256_storeu_ps(g + k, gg);
+    _mm256_storeu_ps(b + k, bb);
+  }
+  hsi_sse2(h + k, s + k, i ? i + k : NULL, r + k, g + k, b + k, n - k);
+}
+
+static AVX2 void normalize_avx2(float * r, float * g, float * b, float * sum, int n) {
+  int k = 0;
+  for(; k + 8 <= n; k += 8) {
+    __m256 rr = _mm256_loadu_ps(r + k), gg = _mm256_loadu_ps(g + k), bb = _mm256_loadu_ps(b + k);
+    __m256 t = _mm256_add_ps(_mm256_add_ps(rr, gg), bb);
+    __m256 nz = _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_NEQ_UQ);
+    __m256 inv = _mm256_and_ps(nz, _mm256_div_ps(_mm256_set1_ps(1), t));
+    _mm256_storeu_ps(sum + k, t);
+    _mm256_storeu_ps(r + k, _mm256_mul_ps(rr, inv));
+    _mm256_storeu_ps(g + k, _mm256_mul_ps(gg, inv));
+    _mm256_storeu_ps(b + k, _mm256_mul_ps(bb, inv));
+  }
+  normalize_sse2(r + k, g + k, b + k, sum + k, n - k);
+}
+
+#endif /* SQ_COLOR_X86 */
+
+/*** picking one ***/
+
+static void (*clamp_impl)(float *, int) = clamp_scalar;
+static void (*hsi_impl)(const float *, const float *, const float *,
+			float *, float *, float *, int) = hsi_scalar;
+static void (*normalize_impl)(float *, float *, float *, float *, int) = normalize_scalar;
+static const char * impl_name = "scalar";
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void pick_impl(void) {
+#ifdef SQ_COLOR_X86
+  char * want = getenv(SQ_SIMD_ENV);
+  if(want != NULL && strcmp(want, "scalar") == 0) {
+    return;
+  }
+  clamp_impl = clamp_sse2;
+  hsi_impl = hsi_sse2;
+  normalize_impl = normalize_sse2;
+  impl_name = "sse2";
+  if(want != NULL && strcmp(want, "sse2") == 0) {
+    return;
+  }
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    clamp_impl = clamp_avx2;
+    hsi_impl = hsi_avx2;
+    normalize_impl = normalize_avx2;
+    impl_name = "avx2";
+  }
+#endif
+}
+
+void sq_color_clamp(float * v, int n) {
+  pthread_once(&impl_once, pick_impl);
+  clamp_impl(v, n);
+}
+
+void sq_color_hsi_to_rgb(const float * h, const float * s, const float * i,
+			 float * r, float * g, float * b, int n) {
+  pthread_once(&impl_once, pick_impl);
+  hsi_impl(h, s, i, r, g, b, n);
+}
+
+void sq_color_normalize(float * r, float * g, float * b, float * sum, int n) {
+  pthread_once(&impl_once, pick_impl);
+  normalize_impl(r, g, b, sum, n);
+}
+
+const char * sq_color_impl(void) {
+  pthread_once(&impl_once, pick_impl);
+  return impl_name;
+}
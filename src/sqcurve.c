@@ -0,0 +1,91 @@
+/* output curves (see sqcurve.h) */
+
+#include "sqcurve.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SQ_CURVE_MAX_POINTS 64 /* for table: */
+
+static double logistic(double x) {
+  return 1 / (1 + exp(-x));
+}
+
+int sq_curve_is_linear(const char * spec) {
+  return spec == NULL || strcmp(spec, "linear") == 0;
+}
+
+int sq_curve_build(const char * spec, int max, unsigned short * table) {
+  double points[SQ_CURVE_MAX_POINTS];
+  int npoints = 0;
+  double param = 0;
+  char * end;
+  int kind;
+  if(sq_curve_is_linear(spec)) {
+    kind = 0;
+  } else if(strncmp(spec, "gamma:", 6) == 0 || strncmp(spec, "scurve:", 7) == 0) {
+    kind = spec[0] == 'g' ? 1 : 2;
+    param = strtod(strchr(spec, ':') + 1, &end);
+    if(*end != '\0' || !(param > 0)) {
+      printf("bad curve \"%s\": needs a positive number\n", spec);
+      return -1;
+    }
+  } else if(strncmp(spec, "table:", 6) == 0) {
+    kind = 3;
+    const char * p = spec + 6;
+    for(;;) {
+      if(npoints == SQ_CURVE_MAX_POINTS) {
+	printf("bad curve \"%s\": more than %d points\n", spec, SQ_CURVE_MAX_POINTS);
+	return -1;
+      }
+      points[npoints] = strtod(p, &end);
+      if(end == p || points[npoints] < 0 || points[npoints] > 1) {
+	printf("bad curve \"%s\": points go from 0 to 1\n", spec);
+	return -1;
+      }
+      npoints++;
+      if(*end == '\0') {
+	break;
+      }
+      if(*end != ',') {
+	printf("bad curve \"%s\": points are separated by commas\n", spec);
+	return -1;
+      }
+      p = end + 1;
+    }
+    if(npoints < 2) {
+      printf("bad curve \"%s\": needs at least two points\n", spec);
+      return -1;
+    }
+  } else {
+    printf("unknown curve \"%s\"\n", spec);
+    return -1;
+  }
+
+  for(int k = 0; k <= SQ_CURVE_STEPS; k++) {
+    double x = (double)k / SQ_CURVE_STEPS, y;
+    switch(kind) {
+    case 1 :
+      y = pow(x, param);
+      break;
+    case 2 :
+      y = (logistic(param*(x-0.5)) - logistic(-param/2))
+	/ (logistic(param/2) - logistic(-param/2));
+      break;
+    case 3 : {
+      double t = x * (npoints - 1);
+      int j = (int)t;
+      if(j >= npoints - 1) j = npoints - 2;
+      y = points[j] + (t - j) * (points[j+1] - points[j]);
+      break;
+    }
+    default :
+      y = x;
+    }
+    if(y < 0) y = 0;
+    if(y > 1) y = 1;
+    table[k] = (unsigned short)(y * max + 0.5);
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+/* published pages and the stats on them (see sqstats.h) */
+
+#include "sqstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void * map_page(const char * shmname, size_t size, int writable) {
+  int fd = shm_open(shmname, writable ? O_RDWR : O_RDONLY, 0);
+  if(fd == -1) {
+    return NULL;
+  }
+  void * p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void * sq_page_create(const char * shmname, size_t size) {
+  shm_unlink(shmname); /* one left over from a crash */
+  int fd = shm_open(shmname, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd == -1) {
+    perror("sqstats.c, page shm_open");
+    return NULL;
+  }
+  if(ftruncate(fd, size) == -1) {
+    perror("sqstats.c, page ftruncate");
+    close(fd);
+    shm_unlink(shmname);
+    return NULL;
+  }
+  close(fd);
+  void * p = map_page(shmname, size, 1);
+  if(p == NULL) {
+    perror("sqstats.c, page mmap");
+    shm_unlink(shmname);
+  }
+  return p;
+}
+
+void * sq_page_resize(void * page, const char * shmname, size_t old_size, size_t size) {
+  int fd = shm_open(shmname, O_RDWR, 0);
+  if(fd == -1 || ftruncate(fd, size) == -1) {
+    perror("sqstats.c, page resize");
+    if(fd != -1) close(fd);
+    return NULL;
+  }
+  close(fd);
+  void * p = map_page(shmname, size, 1);
+  if(p == NULL) {
+    perror("sqstats.c, page mmap");
+    return NULL;
+  }
+  munmap(page, old_size);
+  return p;
+}
+
+void * sq_page_map(const char * shmname, size_t * size) {
+  struct stat st;
+  int fd = shm_open(shmname, O_RDONLY, 0);
+  if(fd == -1) {
+    return NULL;
+  }
+  if(fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void * p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    return NULL;
+  }
+  *size = st.st_size;
+  return p;
+}
+
+void sq_page_unmap(void * page, size_t size) {
+  munmap(page, size);
+}
+
+void sq_page_destroy(void * page, const char * shmname, size_t size) {
+  munmap(page, size);
+  shm_unlink(shmname);
+}
+
+/* a copy of a seqlocked stats page (see sqstats.h) */
+int sq_stats_read(const char * shmname, void ** copy, size_t * copy_cap) {
+  size_t size;
+  struct sq_stats_header * h = sq_page_map(shmname, &size);
+  int ok = 0;
+  if(h == NULL) {
+    return 0;
+  }
+  for(int tries = 0; tries < 10000 && !ok; tries++) {
+    unsigned int seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    if(h->magic != SQ_STATS_MAGIC) {
+      break;
+    }
+    if(seq & 1) {
+      usleep(10); /* being written */
+      continue;
+    }
+    size_t want = h->size;
+    if(want > size) {
+      /* it grew */
+      sq_page_unmap(h, size);
+      if((h = sq_page_map(shmname, &size)) == NULL) {
+	return 0;
+      }
+      continue;
+    }
+    if(want > *copy_cap) {
+      void * bigger = realloc(*copy, want);
+      if(bigger == NULL) {
+	break; /* *copy is still the old one */
+      }
+      *copy = bigger;
+      *copy_cap = want;
+    }
+    memcpy(*copy, h, want);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    ok = __atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq;
+  }
+  sq_page_unmap(h, size);
+  return ok;
+}
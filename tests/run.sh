@@ -0,0 +1,18 @@
+#!/bin/sh
+# runs sqtest against a fresh server on each transport, with each
+# overflow policy (the drop one also dropping late timed changes), and
+# with a frame clock (and recording, which sqtest reads back).  make
+# test builds everything and runs this from the top of the tree.
+
+status=0
+for options in "-q coalesce" "-q drop -l drop" "-r 50 -o build/test.rec"; do
+  for transport in msg shm socket; do
+    echo "== $transport, $options"
+    build/server $options > build/test-server.log 2>&1 & server=$!
+    sleep 1
+    SQUIDLIGHTS_TRANSPORT=$transport build/sqtest $options || status=1
+    kill -INT $server
+    wait $server
+  done
+done
+exit $status
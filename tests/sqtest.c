@@ -0,0 +1,923 @@
+/* behaviour tests, run against a server by tests/run.sh.  Forks a
+   light process whose handlers write down every call they get, then
+   acts as a client and checks what the lights saw.  Each test has its
+   own light, so nothing one test leaves behind gets in another's
+   way.  Some tests run a real light process (elmolights) instead. */
+
+#include "protocol.h"
+#include "sqcolor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_LIGHTS 24
+#define TEST_PLAIN 16 /* sqtest16 and up have no hsi handler, so get the default one */
+#define TEST_CONNECT_SEC 5 /* for the lights to show up */
+#define TEST_QUIET_MSEC 300 /* the lights are done once they've heard nothing for this long */
+#define TEST_MAX_CALLS 16384
+#define TEST_TIMED_AHEAD_MSEC 300 /* how far ahead timed changes are sent */
+#define TEST_TIMED_SLACK_MSEC 40 /* how late they may come (a frame at -r 50, and some) */
+#define TEST_DROP_QUEUE 64 /* batches the server holds under -q drop (SERVER_PROC_QUEUE) */
+
+/* what a handler was called with */
+struct test_call {
+  int light; /* the light process's id */
+  int client; /* the clientid it came with */
+  int type; /* SQ_LIGHT_ON etc. */
+  float v[3];
+};
+
+/*** the light process ***/
+
+static int calls_fd = -1;
+static int other_to = -1; /* the other client's, in the client */
+
+static void note(int lightid, int clientid, int type, float a, float b, float c) {
+  struct test_call tc = {lightid, clientid, type, {a, b, c}};
+  if(write(calls_fd, &tc, sizeof(tc)) != sizeof(tc)) {
+    exit(1);
+  }
+}
+
+void on_handler(int lightid, int clientid) {
+  note(lightid, clientid, SQ_LIGHT_ON, 0, 0, 0);
+}
+void off_handler(int lightid, int clientid) {
+  note(lightid, clientid, SQ_LIGHT_OFF, 0, 0, 0);
+}
+void brightness_handler(int lightid, int clientid, float b) {
+  note(lightid, clientid, SQ_LIGHT_BRIGHTNESS, b, 0, 0);
+}
+void rgb_handler(int lightid, int clientid, float r, float g, float b) {
+  note(lightid, clientid, SQ_LIGHT_RGB, r, g, b);
+}
+void hsi_handler(int lightid, int clientid, float h, float s, float i) {
+  note(lightid, clientid, SQ_LIGHT_HSI, h, s, i);
+}
+void fade_handler(int lightid, int clientid, float b, float secs) {
+  note(lightid, clientid, SQ_LIGHT_FADE, b, secs, 0);
+}
+
+/* forks the light process.  returns its pid, with *fd where its calls
+   come out */
+pid_t start_lights(int * fd) {
+  int calls[2];
+  if(pipe(calls) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if(pid > 0) {
+    close(calls[1]);
+    *fd = calls[0];
+    return pid;
+  }
+  close(calls[0]);
+  close(other_to); /* so the other client sees us hang up, not it */
+  calls_fd = calls[1];
+  squidlights_light_initialize();
+  for(int k = 0; k < TEST_LIGHTS; k++) {
+    char name[32];
+    sprintf(name, "sqtest%d", k);
+    int light = squidlights_light_connect(name);
+    if(light == SQ_CONNECTION_ERROR) exit(1);
+    squidlights_light_add_on(light, &on_handler);
+    squidlights_light_add_off(light, &off_handler);
+    squidlights_light_add_brightness(light, &brightness_handler);
+    squidlights_light_add_rgb(light, &rgb_handler);
+    if(k < TEST_PLAIN) {
+      squidlights_light_add_hsi(light, &hsi_handler);
+    }
+    squidlights_light_add_fade(light, &fade_handler);
+  }
+  squidlights_light_run();
+  exit(0);
+}
+
+/*** the client ***/
+
+static int clientid;
+static int ids[TEST_LIGHTS]; /* the server's ids for sqtest0 .. */
+static pid_t light_pid;
+static int calls_in = -1;
+static struct test_call calls[TEST_MAX_CALLS];
+static int ncalls;
+static int failures = 0;
+
+static int find_lights(void) {
+  char name[32];
+  for(int k = 0; k < TEST_LIGHTS; k++) {
+    sprintf(name, "sqtest%d", k);
+    if((ids[k] = squidlights_client_getlight(name)) == SQ_UNDEFINED_LIGHT) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int wait_for_lights(void) {
+  long long give_up = squidlights_client_now() + TEST_CONNECT_SEC * 1000000LL;
+  while(squidlights_client_process_messages() != -1 && find_lights() == -1) {
+    if(squidlights_client_now() > give_up) {
+      return -1;
+    }
+    usleep(10000);
+  }
+  return 0;
+}
+
+/* the server's id for the light called name, once it shows up, or -1 */
+static int wait_for_light(char * name) {
+  long long give_up = squidlights_client_now() + TEST_CONNECT_SEC * 1000000LL;
+  int id;
+  while(squidlights_client_process_messages() != -1
+	&& (id = squidlights_client_getlight(name)) == SQ_UNDEFINED_LIGHT) {
+    if(squidlights_client_now() > give_up) {
+      return -1;
+    }
+    usleep(10000);
+  }
+  return id;
+}
+
+/*** another client ***/
+
+/* forked before we connect, so the two share nothing.  It does the
+   changes it's sent (as test_calls, with light the index in ids) and
+   answers each with a byte. */
+
+static pid_t other_pid;
+static int other_from = -1;
+static int other_clientid;
+
+
+static void send_change(struct test_call * tc) {
+  float * v = tc->v;
+  switch(tc->type) {
+  case SQ_LIGHT_ON : squidlights_client_light_on(clientid, ids[tc->light]); break;
+  case SQ_LIGHT_OFF : squidlights_client_light_off(clientid, ids[tc->light]); break;
+  case SQ_LIGHT_BRIGHTNESS : squidlights_client_light_set(clientid, ids[tc->light], v[0]); break;
+  case SQ_LIGHT_RGB : squidlights_client_light_rgb(clientid, ids[tc->light], v[0], v[1], v[2]); break;
+  case SQ_LIGHT_HSI : squidlights_client_light_hsi(clientid, ids[tc->light], v[0], v[1], v[2]); break;
+  case SQ_LIGHT_FADE : squidlights_client_light_fade(clientid, ids[tc->light], v[0], v[1]); break;
+  }
+}
+
+void start_other_client(void) {
+  int to[2], from[2];
+  if(pipe(to) == -1 || pipe(from) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = other_pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if(pid > 0) {
+    close(to[0]);
+    close(from[1]);
+    other_to = to[1];
+    other_from = from[0];
+    return;
+  }
+  close(to[1]);
+  close(from[0]);
+  close(calls_in);
+  if(squidlights_client_initialize() == -1 || (clientid = squidlights_client_connect("sqtest-other")) < 0
+     || wait_for_lights() == -1) {
+    exit(1);
+  }
+  /* connect numbers the clients of each process from 1, so this one
+     tags its changes with a number of its own */
+  clientid += 1000;
+  struct test_call tc;
+  char c = 0;
+  if(write(from[1], &clientid, sizeof(int)) != sizeof(int)) {
+    exit(1);
+  }
+  while(read(to[0], &tc, sizeof(tc)) == sizeof(tc)) {
+    send_change(&tc);
+    if(write(from[1], &c, 1) != 1) {
+      break;
+    }
+  }
+  squidlights_client_quit();
+  exit(0);
+}
+
+/* the other client changes light k */
+static void other_does(int k, int type, float a, float b, float c) {
+  struct test_call tc = {k, 0, type, {a, b, c}};
+  char ack;
+  if(write(other_to, &tc, sizeof(tc)) != sizeof(tc) || read(other_from, &ack, 1) != 1) {
+    printf("the other client died\n");
+    exit(1);
+  }
+}
+
+/* whether anything comes out of fd before it goes quiet */
+static int heard_from(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, TEST_QUIET_MSEC) > 0;
+}
+
+static void stop_lights(pid_t pid, int fd) {
+  kill(pid, SIGINT);
+  waitpid(pid, NULL, 0);
+  close(fd);
+}
+
+/* reads the calls the lights get until they go quiet */
+static void collect(void) {
+  struct pollfd pfd = {calls_in, POLLIN, 0};
+  ncalls = 0;
+  while(poll(&pfd, 1, TEST_QUIET_MSEC) > 0) {
+    struct test_call tc;
+    if(read(calls_in, &tc, sizeof(tc)) != sizeof(tc)) {
+      printf("the light process died\n");
+      exit(1);
+    }
+    if(ncalls < TEST_MAX_CALLS) {
+      calls[ncalls++] = tc;
+    }
+  }
+}
+
+/* the last call light k got of one of the kinds in types (a mask of
+   1 << SQ_LIGHT_xxx), or NULL */
+static struct test_call * last_call(int k, int types) {
+  for(int i = ncalls - 1; i >= 0; i--) {
+    if(calls[i].light == k && (types & (1 << calls[i].type))) {
+      return &calls[i];
+    }
+  }
+  return NULL;
+}
+
+static int is_call(struct test_call * tc, int type, float a, float b, float c) {
+  return tc != NULL && tc->type == type && tc->v[0] == a && tc->v[1] == b && tc->v[2] == c;
+}
+
+static void check(int ok, const char * what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if(!ok) {
+    failures++;
+  }
+}
+
+#define SWITCH ((1 << SQ_LIGHT_ON) | (1 << SQ_LIGHT_OFF))
+#define LEVEL ((1 << SQ_LIGHT_BRIGHTNESS) | (1 << SQ_LIGHT_FADE))
+#define COLOR ((1 << SQ_LIGHT_RGB) | (1 << SQ_LIGHT_HSI))
+
+/*** the tests ***/
+
+void test_frame_switch(int k) {
+  squidlights_client_frame_begin(clientid);
+  squidlights_client_light_on(clientid, ids[k]);
+  squidlights_client_light_off(clientid, ids[k]);
+  squidlights_client_light_on(clientid, ids[k]);
+  squidlights_client_frame_commit(clientid);
+  collect();
+  check(is_call(last_call(k, SWITCH), SQ_LIGHT_ON, 0, 0, 0), "frame: on, off, on ends on");
+}
+
+void test_frame_color(int k) {
+  squidlights_client_frame_begin(clientid);
+  squidlights_client_light_rgb(clientid, ids[k], 0.1, 0.2, 0.3);
+  squidlights_client_light_hsi(clientid, ids[k], 120, 1, 0.5);
+  squidlights_client_light_rgb(clientid, ids[k], 0.4, 0.5, 0.6);
+  squidlights_client_frame_commit(clientid);
+  collect();
+  check(is_call(last_call(k, COLOR), SQ_LIGHT_RGB, 0.4f, 0.5f, 0.6f), "frame: rgb, hsi, rgb ends on the second rgb");
+}
+
+void test_frame_lights(int k) {
+  squidlights_client_frame_begin(clientid);
+  squidlights_client_light_set(clientid, ids[k], 0.25);
+  squidlights_client_light_set(clientid, ids[k+1], 0.5);
+  squidlights_client_light_set(clientid, ids[k], 0.75);
+  squidlights_client_frame_commit(clientid);
+  collect();
+  int brightness = 1 << SQ_LIGHT_BRIGHTNESS;
+  check(is_call(last_call(k, brightness), SQ_LIGHT_BRIGHTNESS, 0.75f, 0, 0)
+	&& is_call(last_call(k+1, brightness), SQ_LIGHT_BRIGHTNESS, 0.5f, 0, 0),
+	"frame: each light gets its own latest brightness");
+}
+
+void test_frame_fade(int k) {
+  squidlights_client_frame_begin(clientid);
+  squidlights_client_light_set(clientid, ids[k], 0.5);
+  squidlights_client_light_fade(clientid, ids[k], 0.25, 2);
+  squidlights_client_light_set(clientid, ids[k], 0.75);
+  squidlights_client_frame_commit(clientid);
+  collect();
+  check(is_call(last_call(k, LEVEL), SQ_LIGHT_BRIGHTNESS, 0.75f, 0, 0), "frame: set, fade, set ends on the second set");
+}
+
+/* a change the light was sent before still goes out if something
+   else has undone it since (with -r the server leaves out changes the
+   light already has) */
+void test_resend(int k) {
+  squidlights_client_light_set(clientid, ids[k], 0.5);
+  collect();
+  squidlights_client_light_fade(clientid, ids[k], 0.25, 2);
+  collect();
+  squidlights_client_light_set(clientid, ids[k], 0.5);
+  collect();
+  check(is_call(last_call(k, LEVEL), SQ_LIGHT_BRIGHTNESS, 0.5f, 0, 0), "resend: set, fade, set ends on the set");
+  squidlights_client_light_rgb(clientid, ids[k], 0.1, 0.2, 0.3);
+  collect();
+  squidlights_client_light_hsi(clientid, ids[k], 120, 1, 0.5);
+  collect();
+  squidlights_client_light_rgb(clientid, ids[k], 0.1, 0.2, 0.3);
+  collect();
+  check(is_call(last_call(k, COLOR), SQ_LIGHT_RGB, 0.1f, 0.2f, 0.3f), "resend: rgb, hsi, rgb ends on the rgb");
+}
+
+/* sets light k's brightness to 1/sent, 2/sent .. 1 while the light
+   process is stopped, and lets it go.  Returns how many of them it
+   got, or -1 if they came out of order or didn't end with 1. */
+static int brightnesses(int k, int sent) {
+  kill(light_pid, SIGSTOP);
+  for(int i = 1; i <= sent; i++) {
+    squidlights_client_light_set(clientid, ids[k], i / (float)sent);
+  }
+  usleep(TEST_QUIET_MSEC * 1000);
+  kill(light_pid, SIGCONT);
+  collect();
+  int got = 0;
+  float last = 0;
+  for(int i = 0; i < ncalls; i++) {
+    if(calls[i].light == k && calls[i].type == SQ_LIGHT_BRIGHTNESS) {
+      if(calls[i].v[0] <= last) {
+	return -1;
+      }
+      last = calls[i].v[0];
+      got++;
+    }
+  }
+  return last == 1.0f ? got : -1;
+}
+
+/* by default a stopped light's changes are coalesced, so once it
+   goes again it gets far fewer of them, in order, ending with the
+   latest */
+void test_coalesce(int k) {
+  int sent = 200;
+  int got = brightnesses(k, sent);
+  printf("     (%d of %d brightnesses got there)\n", got, sent);
+  check(got > 0 && got < sent, "coalesce: a stopped light gets the latest, in order");
+}
+
+/* under -q drop nothing is coalesced: a stopped light gets every
+   change once it goes again, until its queue of batches fills, and
+   then the oldest are lost */
+void test_drop(int k) {
+  int got = brightnesses(k, 100);
+  check(got == 100, "drop: a stopped light gets every change, in order");
+  /* well past the queue, since a socket holds a good many batches
+     too */
+  int sent = 8 * TEST_DROP_QUEUE * SQ_BATCH_MAX;
+  got = brightnesses(k, sent);
+  printf("     (%d of %d brightnesses got there)\n", got, sent);
+  check(got > 0 && got < sent, "drop: past its queue it loses the oldest");
+}
+
+/* changes from two clients to one light process, held up so they go
+   out together, each reach the light with their own clientid, even
+   two to the same light.  (which of two changes to one channel from
+   two clients wins is up to the transport, so they use different
+   ones.) */
+void test_two_clients(int k) {
+  kill(light_pid, SIGSTOP);
+  for(int i = 1; i <= 10; i++) {
+    squidlights_client_light_set(clientid, ids[k+2], i / 10.0); /* fills its queue */
+  }
+  squidlights_client_light_set(clientid, ids[k], 0.5);
+  other_does(k, SQ_LIGHT_RGB, 0.1, 0.2, 0.3);
+  other_does(k+1, SQ_LIGHT_HSI, 120, 1, 0.5);
+  squidlights_client_light_set(clientid, ids[k+1], 0.75);
+  usleep(TEST_QUIET_MSEC * 1000);
+  kill(light_pid, SIGCONT);
+  collect();
+  int ok = 1, seen = 0;
+  for(int i = 0; i < ncalls; i++) {
+    if(calls[i].light == k || calls[i].light == k+1) {
+      int want = calls[i].type == SQ_LIGHT_BRIGHTNESS ? clientid : other_clientid;
+      ok = ok && calls[i].client == want;
+      seen |= 1 << (2*(calls[i].light - k) + (want == clientid));
+    }
+  }
+  check(ok && seen == 15, "clients: each change goes out with the client that made it");
+}
+
+/* a second process can't take over the lights while the first is
+   there, but can once it's gone */
+void test_same_names(int k) {
+  int other_in;
+  pid_t other = start_lights(&other_in);
+  usleep(TEST_QUIET_MSEC * 1000);
+  squidlights_client_light_set(clientid, ids[k], 0.5);
+  collect();
+  check(is_call(last_call(k, 1 << SQ_LIGHT_BRIGHTNESS), SQ_LIGHT_BRIGHTNESS, 0.5f, 0, 0)
+	&& !heard_from(other_in), "names: a live light keeps its name");
+  stop_lights(other, other_in);
+
+  stop_lights(light_pid, calls_in);
+  light_pid = start_lights(&calls_in);
+  usleep(TEST_QUIET_MSEC * 1000);
+  if(wait_for_lights() == -1) {
+    check(0, "names: a light that went away can come back");
+    return;
+  }
+  squidlights_client_light_set(clientid, ids[k], 0.25);
+  collect();
+  check(is_call(last_call(k, 1 << SQ_LIGHT_BRIGHTNESS), SQ_LIGHT_BRIGHTNESS, 0.25f, 0, 0),
+	"names: a light that went away can come back");
+}
+
+/*** elmolights ***/
+
+/* An elmolights process sends to two UDP sockets here, standing in
+   for two hosts with fixtures on them, and we read its OSC. */
+
+#define ELMO_TEST_FIXTURES 4
+/* the host each fixture sqelmo0 .. is on */
+static const int elmo_test_host[ELMO_TEST_FIXTURES] = {0, 0, 1, 0};
+
+/* what came in a datagram */
+struct osc_datagram {
+  int bundle; /* whether it was a bundle */
+  int count; /* messages */
+  float rgb[16][3];
+};
+
+static unsigned int osc_int(unsigned char * p) {
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+/* one "/light/color/set ,fff" message of exactly len bytes.  returns
+   -1 if that isn't what it is. */
+static int osc_message(unsigned char * p, int len, float * rgb) {
+  static const char head[] = "/light/color/set\0\0\0\0,fff\0\0\0\0";
+  if(len != sizeof(head) - 1 + 12 || memcmp(p, head, sizeof(head) - 1) != 0) {
+    return -1;
+  }
+  for(int j = 0; j < 3; j++) {
+    unsigned int v = osc_int(p + sizeof(head) - 1 + 4*j);
+    memcpy(&rgb[j], &v, 4);
+  }
+  return 0;
+}
+
+/* a datagram, which is a message or a bundle of them.  returns -1 if
+   it's neither. */
+static int osc_datagram(unsigned char * p, int len, struct osc_datagram * d) {
+  d->count = 0;
+  d->bundle = len >= 16 && memcmp(p, "#bundle\0", 8) == 0;
+  if(!d->bundle) {
+    d->count = 1;
+    return osc_message(p, len, d->rgb[0]);
+  }
+  /* the time tag is "immediately" */
+  if(osc_int(p + 8) != 0 || osc_int(p + 12) != 1) {
+    return -1;
+  }
+  for(int at = 16; at < len; d->count++) {
+    int size = at + 4 <= len ? (int)osc_int(p + at) : -1;
+    if(size < 0 || at + 4 + size > len || d->count == 16
+       || osc_message(p + at + 4, size, d->rgb[d->count]) == -1) {
+      return -1;
+    }
+    at += 4 + size;
+  }
+  return 0;
+}
+
+/* reads what comes to each host until they go quiet.  got[h] is how
+   many datagrams host h got (up to 4, in d[h]); returns -1 if
+   something wasn't OSC. */
+static int elmo_read(int * socks, int * got, struct osc_datagram d[2][4]) {
+  struct pollfd pfd[2] = {{socks[0], POLLIN, 0}, {socks[1], POLLIN, 0}};
+  unsigned char buf[2048];
+  int bad = 0;
+  got[0] = got[1] = 0;
+  while(poll(pfd, 2, TEST_QUIET_MSEC) > 0) {
+    for(int h = 0; h < 2; h++) {
+      if(pfd[h].revents & POLLIN) {
+	int len = recv(socks[h], buf, sizeof(buf), 0);
+	if(got[h] < 4 && osc_datagram(buf, len, &d[h][got[h]]) == -1) {
+	  bad = 1;
+	}
+	got[h]++;
+      }
+    }
+  }
+  return bad ? -1 : 0;
+}
+
+/* fixtures at one address share a bundle, one alone gets a plain
+   message, and after the first tick only the fixture that changed is
+   sent */
+void test_elmo(void) {
+  int socks[2], ports[2];
+  struct osc_datagram d[2][4];
+  int got[2];
+  char conf[64], name[32];
+  for(int h = 0; h < 2; h++) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if((socks[h] = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+       || bind(socks[h], (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || getsockname(socks[h], (struct sockaddr *) &addr, &len) == -1) {
+      perror("sqtest.c, udp socket");
+      exit(1);
+    }
+    ports[h] = ntohs(addr.sin_port);
+  }
+  sprintf(conf, "/tmp/sqtest-elmo-%d.conf", (int)getpid());
+  FILE * fp = fopen(conf, "w");
+  if(fp == NULL) {
+    perror("sqtest.c, fopen");
+    exit(1);
+  }
+  for(int k = 0; k < ELMO_TEST_FIXTURES; k++) {
+    fprintf(fp, "127.0.0.1:%d sqelmo%d\n", ports[elmo_test_host[k]], k);
+  }
+  fclose(fp);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0) {
+    close(other_to);
+    close(calls_in);
+    if(freopen("/dev/null", "w", stdout) == NULL) exit(1);
+    /* a keepalive that never comes, so only changes are sent */
+    execl("build/lights/elmolights", "elmolights", "-r", "50", "-k", "1000", conf, (char *) NULL);
+    exit(1);
+  }
+  sprintf(name, "sqelmo%d", ELMO_TEST_FIXTURES - 1);
+  int ok = pid != -1 && wait_for_light(name) != -1 && elmo_read(socks, got, d) == 0;
+  check(ok && got[0] == 1 && d[0][0].bundle && d[0][0].count == 3
+	&& got[1] == 1 && !d[1][0].bundle && d[1][0].count == 1,
+	"elmo: a host's fixtures share a bundle, and a lone one goes plain");
+
+  int id = wait_for_light("sqelmo1");
+  if(id != -1) {
+    squidlights_client_light_rgb(clientid, id, 0, 1, 0);
+  }
+  ok = ok && id != -1 && elmo_read(socks, got, d) == 0;
+  check(ok && got[0] == 1 && !d[0][0].bundle && d[0][0].rgb[0][0] == 0
+	&& d[0][0].rgb[0][1] == 1 && d[0][0].rgb[0][2] == 0 && got[1] == 0,
+	"elmo: only the fixture that changed is sent");
+
+  if(pid != -1) {
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+  }
+  unlink(conf);
+  close(socks[0]);
+  close(socks[1]);
+}
+
+/* a strobe the server runs by itself: the light should go on and off
+   until it's stopped, and then stay put */
+void test_effect(int k) {
+  struct effect_msg e;
+  memset(&e, 0, sizeof(e));
+  e.effectid = 0;
+  e.kind = SQ_EFFECT_STROBE;
+  e.rate = 5;
+  e.duty = 0.5;
+  e.i = 1; /* s = 0, so plain brightness */
+  e.nlights = 1;
+  e.lights[0] = ids[k];
+  squidlights_client_effect(clientid, &e);
+  usleep(700000); /* three and a half flashes */
+  squidlights_client_effect_stop(clientid, e.effectid);
+  collect();
+  int on = 0, off = 0;
+  for(int j = 0; j < ncalls; j++) {
+    if(calls[j].light == k && calls[j].type == SQ_LIGHT_BRIGHTNESS) {
+      on += calls[j].v[0] == 1;
+      off += calls[j].v[0] == 0;
+    }
+  }
+  check(on >= 2 && off >= 2, "effect: a strobe steps the light on and off");
+  collect();
+  check(last_call(k, ~0) == NULL, "effect: once stopped it leaves the light alone");
+}
+
+/* waits up to msec for light k's next call, keeping the calls read on
+   the way as collect does.  Returns when it came (client_now), or -1. */
+static long long wait_for_call(int k, int msec) {
+  struct pollfd pfd = {calls_in, POLLIN, 0};
+  long long until = squidlights_client_now() + msec * 1000LL, now;
+  ncalls = 0;
+  while((now = squidlights_client_now()) < until && poll(&pfd, 1, (until - now + 999) / 1000) > 0) {
+    struct test_call tc;
+    if(read(calls_in, &tc, sizeof(tc)) != sizeof(tc)) {
+      printf("the light process died\n");
+      exit(1);
+    }
+    if(ncalls < TEST_MAX_CALLS) {
+      calls[ncalls++] = tc;
+    }
+    if(tc.light == k) {
+      return squidlights_client_now();
+    }
+  }
+  return -1;
+}
+
+/* a change for later should reach the light on its tick (or the next
+   frame with -r), never before; one whose time has gone by is applied
+   or dropped as the server's -l says */
+void test_timed(int k, int late_drop) {
+  long long at = squidlights_client_now() + TEST_TIMED_AHEAD_MSEC * 1000LL;
+  squidlights_client_at(at);
+  squidlights_client_light_rgb(clientid, ids[k], 0.2, 0.3, 0.4);
+  squidlights_client_at(0);
+  long long came = wait_for_call(k, 2 * TEST_TIMED_AHEAD_MSEC);
+  char what[96];
+  sprintf(what, "timed: a change comes on its tick (%+.1fms)", came == -1 ? 0 : (came - at) / 1000.0);
+  check(came >= at && came <= at + TEST_TIMED_SLACK_MSEC * 1000LL
+	&& is_call(last_call(k, COLOR), SQ_LIGHT_RGB, 0.2f, 0.3f, 0.4f), what);
+  collect();
+
+  squidlights_client_at(squidlights_client_now() - TEST_TIMED_AHEAD_MSEC * 1000LL);
+  squidlights_client_light_rgb(clientid, ids[k+1], 0.5, 0.6, 0.7);
+  squidlights_client_at(0);
+  collect();
+  if(late_drop) {
+    check(last_call(k+1, COLOR) == NULL, "timed: a late change is dropped (-l drop)");
+  } else {
+    check(is_call(last_call(k+1, COLOR), SQ_LIGHT_RGB, 0.5f, 0.6f, 0.7f), "timed: a late change is applied right away");
+  }
+}
+
+/* hsi to chroma the way elmolights did it before lights.c had one,
+   with the cosines */
+static void elmo_chroma(double h, double s, double * rgb) {
+  h = fmod(h, 360);
+  if(h < 0) h += 360;
+  int sector = h < 120 ? 0 : h < 240 ? 1 : 2;
+  h -= 120*sector;
+  double f = cos(h*M_PI/180) / cos((60 - h)*M_PI/180);
+  rgb[sector] = (1 + s*f)/3;
+  rgb[(sector+1)%3] = (1 + s*(1 - f))/3;
+  rgb[(sector+2)%3] = (1 - s)/3;
+}
+
+/* lights from k up have no hsi handler, so hsi comes to them as rgb.
+   a NaN hue should come out as hue 0 */
+void test_default_hsi(int k) {
+  static const float hues[] = {0, 45, 119.5, 200, 300, 725, -30, NAN};
+  const int n = sizeof(hues)/sizeof(hues[0]);
+  const float s = 0.8, i = 0.5;
+  for(int j = 0; j < n; j++) {
+    squidlights_client_light_hsi(clientid, ids[k+j], hues[j], s, i);
+  }
+  collect();
+  for(int j = 0; j < n; j++) {
+    double c[3];
+    elmo_chroma(isnan(hues[j]) ? 0 : hues[j], s, c);
+    struct test_call * tc = last_call(k+j, COLOR);
+    int ok = tc != NULL && tc->type == SQ_LIGHT_RGB;
+    for(int m = 0; ok && m < 3; m++) {
+      double want = fmin(fmax(3*i*c[m], 0), 1);
+      ok = fabs(tc->v[m] - want) < 1e-4;
+    }
+    char what[64];
+    sprintf(what, "hsi without a handler: hue %g as rgb", hues[j]);
+    check(ok, what);
+  }
+}
+
+/* sq_color_hsi_to_rgb, the one hsi conversion, each way it can be
+   done: against the scalar one and against elmo_chroma.  which one is
+   picked once per process, so each runs in a child.  the lengths
+   aren't all whole vectors, so the tails get done too, and the odd
+   hues land in different lanes. */
+#define HSI_TEST_N 40
+static const int hsi_test_lengths[] = {1, 3, 4, 5, 7, 8, 9, 13, 17, 40};
+#define HSI_TEST_LENGTHS (int)(sizeof(hsi_test_lengths)/sizeof(hsi_test_lengths[0]))
+
+struct hsi_test_out {
+  char impl[8]; /* what it really ran, if the cpu hasn't got avx2 */
+  float rgb[HSI_TEST_LENGTHS][2][3][HSI_TEST_N]; /* chroma, then with i */
+};
+
+static float hsi_test_h[HSI_TEST_N], hsi_test_s[HSI_TEST_N], hsi_test_i[HSI_TEST_N];
+
+static void hsi_test_inputs(void) {
+  static const float odd[] = {1e10, NAN, -1e10, INFINITY, 719.99994, -0.0001, 359.99997, 1048577, -INFINITY, 120};
+  for(int k = 0; k < HSI_TEST_N; k++) {
+    hsi_test_h[k] = k % 3 == 1 ? odd[k/3 % 10] : k * 47.3f - 300;
+    hsi_test_s[k] = (k % 5) / 4.0f;
+    hsi_test_i[k] = (k % 7) / 4.0f;
+  }
+}
+
+static pid_t hsi_test_run(const char * impl, int * fd) {
+  int out[2];
+  if(pipe(out) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if(pid > 0) {
+    close(out[1]);
+    *fd = out[0];
+    return pid;
+  }
+  close(out[0]);
+  setenv(SQ_SIMD_ENV, impl, 1);
+  static struct hsi_test_out res;
+  memset(&res, 0, sizeof(res));
+  strncpy(res.impl, sq_color_impl(), sizeof(res.impl) - 1);
+  for(int l = 0; l < HSI_TEST_LENGTHS; l++) {
+    int n = hsi_test_lengths[l];
+    for(int m = 0; m < 2; m++) {
+      float (*c)[HSI_TEST_N] = res.rgb[l][m];
+      sq_color_hsi_to_rgb(hsi_test_h, hsi_test_s, m ? hsi_test_i : NULL, c[0], c[1], c[2], n);
+    }
+  }
+  int ok = write(out[1], &res, sizeof(res)) == sizeof(res);
+  _exit(!ok);
+}
+
+static int hsi_test_read(int fd, struct hsi_test_out * res) {
+  char * p = (char *)res;
+  size_t got = 0;
+  while(got < sizeof(*res)) {
+    ssize_t r = read(fd, p + got, sizeof(*res) - got);
+    if(r <= 0) return -1;
+    got += r;
+  }
+  return 0;
+}
+
+void test_hsi_impls(void) {
+  static const char * impls[] = {"scalar", "sse2", "avx2"};
+  static struct hsi_test_out res[3];
+  hsi_test_inputs();
+  for(int j = 0; j < 3; j++) {
+    int fd;
+    pid_t pid = hsi_test_run(impls[j], &fd);
+    int got = hsi_test_read(fd, &res[j]) == 0;
+    close(fd);
+    waitpid(pid, NULL, 0);
+    if(!got) {
+      printf("FAIL hsi %s: the child died\n", impls[j]);
+      failures++;
+      return;
+    }
+  }
+  for(int j = 0; j < 3; j++) {
+    if(strcmp(res[j].impl, impls[j]) != 0) {
+      printf("skip hsi %s: only got %s\n", impls[j], res[j].impl);
+      continue;
+    }
+    double worst_scalar = 0, worst_elmo = 0;
+    for(int l = 0; l < HSI_TEST_LENGTHS; l++) {
+      for(int k = 0; k < hsi_test_lengths[l]; k++) {
+	double e[3];
+	elmo_chroma(isfinite(hsi_test_h[k]) ? hsi_test_h[k] : 0, hsi_test_s[k], e);
+	for(int m = 0; m < 2; m++) {
+	  for(int c = 0; c < 3; c++) {
+	    double want = m ? fmin(fmax(3*hsi_test_i[k]*e[c], 0), 1) : e[c];
+	    double got = res[j].rgb[l][m][c][k];
+	    double vs = fabs(got - res[0].rgb[l][m][c][k]);
+	    double ve = fabs(got - want);
+	    if(!(vs <= worst_scalar)) worst_scalar = isnan(vs) ? INFINITY : vs;
+	    if(!(ve <= worst_elmo)) worst_elmo = isnan(ve) ? INFINITY : ve;
+	  }
+	}
+      }
+    }
+    char what[96];
+    sprintf(what, "hsi %s: within 1e-5 of scalar (%g) and 1e-4 of the cosines (%g)",
+	    impls[j], worst_scalar, worst_elmo);
+    check(worst_scalar < 1e-5 && worst_elmo < 1e-4, what);
+  }
+}
+
+/* the server's recording (-o), read back while it's still going: it
+   should have every light of ours in it */
+void test_record(char * file) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "build/clients/sqreplay names %s", file);
+  FILE * names = popen(cmd, "r");
+  if(names == NULL) {
+    perror("popen");
+    failures++;
+    return;
+  }
+  char seen[TEST_LIGHTS] = {0};
+  char line[64];
+  int k;
+  while(fgets(line, sizeof(line), names) != NULL) {
+    if(sscanf(line, "sqtest%d", &k) == 1 && k >= 0 && k < TEST_LIGHTS) {
+      seen[k] = 1;
+    }
+  }
+  int status = pclose(names);
+  for(k = 0; k < TEST_LIGHTS && seen[k]; k++);
+  check(status == 0 && k == TEST_LIGHTS, "record: sqreplay names finds all the lights in the recording");
+}
+
+/*** main ***/
+
+void print_usage(char * name) {
+  printf("usage: %s [-q policy] [-r hz] [-l late] [-o file]\n", name);
+  printf("tests a running server, which was started with the same options\n");
+}
+
+int main(int argc, char ** argv) {
+  char * policy = "coalesce";
+  int late_drop = 0;
+  char * record = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "q:r:l:o:")) != -1) {
+    switch(opt) {
+    case 'q' : policy = optarg; break;
+    case 'l' : late_drop = strcmp(optarg, "drop") == 0; break;
+    case 'o' : record = optarg; break;
+    case 'r' : break; /* the tests are the same with a frame clock */
+    default :
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  light_pid = start_lights(&calls_in);
+  start_other_client();
+  if(squidlights_client_initialize() == -1 || (clientid = squidlights_client_connect("sqtest")) < 0) {
+    printf("couldn't connect.  is the server running?\n");
+    kill(light_pid, SIGKILL);
+    return 1;
+  }
+  if(wait_for_lights() == -1) {
+    printf("the lights didn't show up\n");
+    kill(light_pid, SIGKILL);
+    return 1;
+  }
+  if(read(other_from, &other_clientid, sizeof(int)) != sizeof(int)) {
+    printf("the other client didn't connect\n");
+    kill(light_pid, SIGKILL);
+    return 1;
+  }
+
+  test_frame_switch(0);
+  test_frame_color(1);
+  test_frame_lights(2);
+  test_frame_fade(4);
+  test_resend(5);
+  if(strcmp(policy, "drop") == 0) {
+    test_drop(6);
+  } else {
+    test_coalesce(6);
+  }
+  test_two_clients(8);
+  test_effect(11);
+  test_timed(12, late_drop);
+  test_default_hsi(TEST_PLAIN);
+  test_hsi_impls();
+  test_elmo();
+  test_same_names(7);
+  if(record != NULL) {
+    test_record(record);
+  }
+
+  close(other_to);
+  waitpid(other_pid, NULL, 0);
+  stop_lights(light_pid, calls_in);
+  squidlights_client_quit();
+  printf("%d failed\n", failures);
+  return failures > 0;
+}